@@ -0,0 +1,239 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "codegen.h"
+
+#include <cmath>    // std::isinf, std::isnan
+#include <cstdint>
+#include <vector>
+
+#include "fmt/core.h"
+#include "graph_autodiff/ops.h"
+
+using namespace graph_autodiff;
+
+namespace {
+/// Statements that define `float {name}` as `{base}` to the power `n`, with
+/// the same sequence of multiplications as ipow().
+std::string pow_statements(const std::string& name, const std::string& base,
+                           std::int64_t n) {
+  std::string code = fmt::format("  float {} = 1.f;\n", name);
+  if (n != 0) code += fmt::format("  float {}_base = {};\n", name, base);
+  for (std::uint64_t e = n < 0 ? -std::uint64_t(n) : std::uint64_t(n); e != 0;
+       e >>= 1) {
+    if (e & 1) code += fmt::format("  {0} *= {0}_base;\n", name);
+    if (e > 1) code += fmt::format("  {0}_base *= {0}_base;\n", name);
+  }
+  if (n < 0) code += fmt::format("  {0} = 1.f / {0};\n", name);
+  return code;
+}
+}  // end of anonymous namespace
+
+std::string graph_autodiff::float_literal(float value) {
+  if (std::isnan(value)) return "std::numeric_limits<float>::quiet_NaN()";
+  if (std::isinf(value))
+    return value > 0 ? "std::numeric_limits<float>::infinity()"
+                     : "-std::numeric_limits<float>::infinity()";
+  // hexadecimal floating point literals are exact
+  return fmt::format("{:a}f", value);
+}
+
+std::string graph_autodiff::generate_header(const CompiledGraph& graph,
+                                            std::string_view ns,
+                                            std::string_view source) {
+  const std::size_t n_vars = graph.layout().size();
+
+  std::string names;
+  for (const std::string& name : graph.layout().names()) {
+    names += "    \"";
+    for (const char c : name) {
+      if (c == '"' || c == '\\') names += '\\';
+      names += c;
+    }
+    names += "\",\n";
+  }
+
+  return fmt::format(
+      R"(// Generated by graph_autodiff from {source}. Do not edit.
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <string_view>
+#include <utility>
+
+#include "Eigen/Core"
+
+namespace {ns} {{
+
+inline constexpr std::size_t kNumVariables = {n_vars};
+
+/// The names of the variables, in the order of inputs and gradients.
+inline constexpr std::array<std::string_view, kNumVariables> kVariableNames = {{
+{names}}};
+
+using Vector = Eigen::Matrix<float, 1, kNumVariables>;
+
+/// Evaluate the graph. `inputs[i]` is the value of kVariableNames[i].
+template <typename Inputs>
+constexpr float eval(const Inputs& inputs) {{
+{value_body}}}
+
+/// Evaluate the graph and write its gradient into `grad`.
+inline float eval_grad(const Vector& inputs, Vector& grad) {{
+{grad_body}}}
+
+/// Evaluate the graph and its gradient.
+inline std::pair<float, Vector> eval_grad(const Vector& inputs) {{
+  Vector grad;
+  const float value = eval_grad(inputs, grad);
+  return {{value, grad}};
+}}
+
+}}  // namespace {ns}
+)",
+      fmt::arg("source", source), fmt::arg("ns", ns),
+      fmt::arg("n_vars", n_vars), fmt::arg("names", names),
+      fmt::arg("value_body",
+               generate_function_body(graph, /*with_gradient=*/false)),
+      fmt::arg("grad_body",
+               generate_function_body(graph, /*with_gradient=*/true)));
+}
+
+std::string graph_autodiff::generate_function_body(const CompiledGraph& graph,
+                                                   bool with_gradient) {
+  const absl::Span<const Instruction> tape = graph.instructions();
+  const absl::Span<const float> constants = graph.constant_table();
+  std::string body;
+
+  // values: v{i} is the result of instruction i
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        body += fmt::format("  const float v{} = {};\n", i,
+                            float_literal(constants[instr.op1]));
+        break;
+      case OpCode::kVar:
+        body += fmt::format("  const float v{} = inputs[{}];\n", i, instr.op1);
+        break;
+      case OpCode::kSum:
+        body += fmt::format("  const float v{} = v{} + v{};\n", i, instr.op1,
+                            instr.op2);
+        break;
+      case OpCode::kMul:
+        body += fmt::format("  const float v{} = v{} * v{};\n", i, instr.op1,
+                            instr.op2);
+        break;
+      case OpCode::kSub:
+        body += fmt::format("  const float v{} = v{} - v{};\n", i, instr.op1,
+                            instr.op2);
+        break;
+      case OpCode::kDiv:
+        body += fmt::format("  const float v{} = v{} / v{};\n", i, instr.op1,
+                            instr.op2);
+        break;
+      case OpCode::kNeg:
+        body += fmt::format("  const float v{} = -v{};\n", i, instr.op1);
+        break;
+      case OpCode::kPow:
+        body += pow_statements(fmt::format("v{}", i),
+                               fmt::format("v{}", instr.op1),
+                               pow_exponent(instr));
+        break;
+      case OpCode::kExp:
+        body += fmt::format("  const float v{} = std::exp(v{});\n", i,
+                            instr.op1);
+        break;
+      case OpCode::kLog:
+        body += fmt::format("  const float v{} = std::log(v{});\n", i,
+                            instr.op1);
+        break;
+    }
+  }
+
+  if (with_gradient) {
+    // adjoints: a{i} is the derivative of the result w.r.t. v{i}. Walking the
+    // tape backwards, each adjoint is complete by the time it is visited.
+    // Adjoints and gradient elements are defined by their first contribution
+    // rather than zero-initialized, so the code only contains useful work.
+    std::vector<bool> has_adjoint(tape.size(), false);
+    std::vector<bool> has_grad(graph.layout().size(), false);
+    const auto contribute = [&](std::uint32_t idx, const std::string& expr) {
+      if (tape[idx].opcode == OpCode::kConst) return;  // never needed
+      if (has_adjoint[idx]) {
+        body += fmt::format("  a{} += {};\n", idx, expr);
+      } else {
+        body += fmt::format("  float a{} = {};\n", idx, expr);
+        has_adjoint[idx] = true;
+      }
+    };
+
+    const std::size_t root = tape.size() - 1;
+    body += fmt::format("  float a{} = 1.f;\n", root);
+    has_adjoint[root] = true;
+    for (std::size_t i = tape.size(); i-- > 0;) {
+      if (!has_adjoint[i]) continue;
+      const Instruction& instr = tape[i];
+      switch (instr.opcode) {
+        case OpCode::kConst:
+          break;
+        case OpCode::kVar:
+          body += fmt::format("  grad[{}] {} a{};\n", instr.op1,
+                              has_grad[instr.op1] ? "+=" : "=", i);
+          has_grad[instr.op1] = true;
+          break;
+        case OpCode::kSum:
+          contribute(instr.op1, fmt::format("a{}", i));
+          contribute(instr.op2, fmt::format("a{}", i));
+          break;
+        case OpCode::kMul:
+          contribute(instr.op1, fmt::format("a{} * v{}", i, instr.op2));
+          contribute(instr.op2, fmt::format("a{} * v{}", i, instr.op1));
+          break;
+        case OpCode::kSub:
+          contribute(instr.op1, fmt::format("a{}", i));
+          contribute(instr.op2, fmt::format("-a{}", i));
+          break;
+        case OpCode::kDiv:
+          contribute(instr.op1,
+                     fmt::format("a{} * (1.f / v{})", i, instr.op2));
+          contribute(instr.op2,
+                     fmt::format("a{} * (-v{} / v{})", i, i, instr.op2));
+          break;
+        case OpCode::kNeg:
+          contribute(instr.op1, fmt::format("-a{}", i));
+          break;
+        case OpCode::kPow: {
+          // n * x^(n-1), see op_partials()
+          const std::int64_t n = pow_exponent(instr);
+          if (n == 0) break;
+          body += pow_statements(fmt::format("d{}", i),
+                                 fmt::format("v{}", instr.op1), n - 1);
+          contribute(instr.op1, fmt::format("a{} * ({} * d{})", i,
+                                            float_literal(float(n)), i));
+          break;
+        }
+        case OpCode::kExp:
+          contribute(instr.op1, fmt::format("a{} * v{}", i, i));
+          break;
+        case OpCode::kLog:
+          contribute(instr.op1,
+                     fmt::format("a{} * (1.f / v{})", i, instr.op1));
+          break;
+      }
+    }
+
+    // variables that do not contribute to the result
+    for (std::size_t slot = 0; slot < has_grad.size(); ++slot)
+      if (!has_grad[slot]) body += fmt::format("  grad[{}] = 0.f;\n", slot);
+  }
+
+  body += fmt::format("  return v{};\n", tape.size() - 1);
+  return body;
+}
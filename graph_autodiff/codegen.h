@@ -0,0 +1,52 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "graph_autodiff/compiled_graph.h"
+
+namespace graph_autodiff {
+
+/// Generate the body of a C++ function that evaluates `graph` with
+/// straight-line code: one statement per instruction, with no loops,
+/// branches or memory accesses other than reading the inputs and writing
+/// the gradient.
+/// The generated code reads the value of the variable in slot i of the
+/// graph's layout as `inputs[i]` and returns the graph's value. If
+/// `with_gradient`, it also writes the derivative w.r.t. that variable to
+/// `grad[i]`, computed in reverse mode. Only float arithmetic is used, so
+/// the body is also valid in a constexpr function, unless the graph has
+/// exponentials or logarithms (std::exp and std::log, from <cmath>).
+/// Integer powers are expanded into multiplications.
+std::string generate_function_body(const CompiledGraph& graph,
+                                   bool with_gradient);
+
+/// Generate a self-contained C++ header that evaluates `graph` with
+/// straight-line code (see generate_function_body()), for use at build time.
+/// In namespace `ns` (which may be nested, e.g. `a::b`), the header defines:
+/// - `kNumVariables` and `kVariableNames`: the graph's layout()
+/// - `Vector`: an `Eigen::Matrix<float, 1, kNumVariables>`
+/// - `constexpr float eval(const Inputs& inputs)`: a template for any
+///   type with `operator[]`, usable in constant expressions e.g. with a
+///   `std::array<float, kNumVariables>` (if the graph has no exponentials
+///   or logarithms)
+/// - `float eval_grad(const Vector& inputs, Vector& grad)`, which returns the
+///   value and writes the gradient, and `std::pair<float, Vector>
+///   eval_grad(const Vector& inputs)`
+/// Inputs and gradients have the same layout as the graph's dense inputs.
+/// `source` is only mentioned in a comment.
+std::string generate_header(const CompiledGraph& graph, std::string_view ns,
+                            std::string_view source);
+
+/// A C++ literal that evaluates exactly to `value`, including for infinities
+/// and NaNs (which require <limits>).
+std::string float_literal(float value);
+
+}  // namespace graph_autodiff
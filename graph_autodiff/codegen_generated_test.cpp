@@ -0,0 +1,43 @@
+// Checks a header generated at build time by graph_autodiff_cc_library from
+// testdata/codegen_test_graph.pb, which stores
+// x*x*y + 3*x*z - y/z + pow(z, 2).
+#include "graph_autodiff/codegen_test_graph.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <string_view>
+
+#include "Eigen/Core"
+#include "absl/status/statusor.h"
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+static_assert(generated::kNumVariables == 3);
+static_assert(generated::kVariableNames[2] == std::string_view("z"));
+// the generated eval() can be evaluated at compile time
+static_assert(generated::eval(std::array<float, 3>{2.f, 3.f, 4.f}) == 51.25f);
+
+TEST(CodegenGenerated, MatchesCompiledGraph) {
+  const absl::StatusOr<Graph> g =
+      from_file("graph_autodiff/testdata/codegen_test_graph.pb");
+  ASSERT_TRUE(g.ok()) << g.status();
+  const CompiledGraph cg = g->compile();
+  ASSERT_EQ(cg.layout().size(), generated::kNumVariables);
+  for (std::size_t i = 0; i < generated::kNumVariables; ++i)
+    EXPECT_EQ(cg.layout().names()[i], generated::kVariableNames[i]);
+
+  for (int i = 0; i < 10; ++i) {
+    // keep z away from 0, which divides y
+    generated::Vector inputs = generated::Vector::Random();
+    inputs[2] += 3.f;
+    const auto [value, grad] = generated::eval_grad(inputs);
+    const auto &[expected_value, expected_grad] = cg.eval_grad(
+        absl::Span<const float>(inputs.data(), generated::kNumVariables));
+    EXPECT_FLOAT_EQ(generated::eval(inputs), expected_value);
+    EXPECT_FLOAT_EQ(value, expected_value);
+    for (std::size_t j = 0; j < generated::kNumVariables; ++j)
+      EXPECT_FLOAT_EQ(grad[j], expected_grad[j]);
+  }
+}
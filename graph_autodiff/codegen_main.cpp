@@ -0,0 +1,45 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+// Generate a C++ header that evaluates a graph, see generate_header().
+// Usage: codegen <graph.pb> <output.h> <namespace>
+// where graph.pb was written by to_file(). Used by graph_autodiff_cc_library
+// (see defs.bzl).
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "absl/status/statusor.h"
+#include "graph_autodiff/codegen.h"
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " <graph.pb> <output.h> <namespace>\n";
+    return 1;
+  }
+  const std::string input_path = argv[1];
+  const std::string output_path = argv[2];
+  const std::string ns = argv[3];
+
+  const absl::StatusOr<Graph> graph = from_file(input_path);
+  if (!graph.ok()) {
+    std::cerr << graph.status() << '\n';
+    return 1;
+  }
+
+  std::ofstream out_file(output_path);
+  out_file << generate_header(graph->compile(), ns, input_path);
+  if (!out_file.good()) {
+    std::cerr << "Could not write file " << output_path << '\n';
+    return 1;
+  }
+  return 0;
+}
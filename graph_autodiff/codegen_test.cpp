@@ -0,0 +1,42 @@
+#include "graph_autodiff/codegen.h"
+
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <string>
+
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+TEST(Codegen, FloatLiterals) {
+  EXPECT_EQ(float_literal(1.), "0x1p+0f");
+  EXPECT_EQ(float_literal(-0.5), "-0x1p-1f");
+  EXPECT_EQ(float_literal(std::numeric_limits<float>::infinity()),
+            "std::numeric_limits<float>::infinity()");
+}
+
+TEST(Codegen, StraightLineCode) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x * y + x;
+  const std::string body =
+      generate_function_body(g.compile(), /*with_gradient=*/true);
+  EXPECT_EQ(body.find("for"), std::string::npos);
+  EXPECT_EQ(body.find("if"), std::string::npos);
+  EXPECT_NE(body.find("inputs[0]"), std::string::npos);
+  EXPECT_NE(body.find("grad[1]"), std::string::npos);
+}
+
+TEST(Codegen, Header) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x * y + x;
+  const std::string header = generate_header(g.compile(), "my::graph", "g.pb");
+  EXPECT_NE(header.find("namespace my::graph {"), std::string::npos);
+  EXPECT_NE(header.find("kNumVariables = 2;"), std::string::npos);
+  EXPECT_NE(header.find("\"x\",\n    \"y\","), std::string::npos);
+  EXPECT_NE(header.find("Eigen::Matrix<float, 1, kNumVariables>"),
+            std::string::npos);
+  EXPECT_NE(header.find("constexpr float eval("), std::string::npos);
+}
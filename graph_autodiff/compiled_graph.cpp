@@ -0,0 +1,1689 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "compiled_graph.h"
+
+#include <fcntl.h>     // open
+#include <sys/mman.h>  // mmap, munmap
+#include <sys/stat.h>  // fstat
+#include <unistd.h>    // close
+
+#include <algorithm>  // std::clamp, std::min, std::copy, std::equal
+#include <cassert>
+#include <chrono>
+#include <cstddef>     // std::size_t, offsetof
+#include <cstring>     // std::memcpy
+#include <fstream>
+#include <functional>  // std::greater_equal
+#include <iterator>
+#include <type_traits>
+
+#include "absl/algorithm/container.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "fmt/core.h"
+#include "graph_autodiff/fail.h"
+#include "graph_autodiff/ops.h"
+#include "graph_autodiff/thread_pool.h"
+
+using namespace graph_autodiff;
+
+namespace {
+// the tables of a CompiledGraph that is not backed by a file
+struct OwnedTables {
+  std::vector<Instruction> tape;
+  std::vector<float> constants;
+  std::vector<std::uint32_t> grad_rows;
+};
+
+template <typename T>
+using RowMajorMatrixX =
+    Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// The context of the evaluations that are not passed one. There is one per
+// thread, so concurrent evaluations never share buffers, and evaluations on
+// the same thread reuse them rather than allocating new ones. No evaluation
+// calls another one that uses it, so it is never used twice at once.
+// Its buffers are released when the thread exits.
+template <typename T>
+BasicEvalContext<T>& this_thread_context() noexcept {
+  thread_local BasicEvalContext<T> ctx;
+  return ctx;
+}
+}  // end of anonymous namespace
+
+GradMode graph_autodiff::choose_grad_mode(std::size_t n_vars,
+                                          std::size_t n_outputs) noexcept {
+  // on a tie forward mode wins, as it does not need a separate values pass
+  return n_vars <= n_outputs ? GradMode::kForward : GradMode::kReverse;
+}
+
+VariableLayout::VariableLayout(std::vector<std::string> var_names_)
+    : var_names(std::move(var_names_)) {
+  assert(absl::c_adjacent_find(var_names, std::greater_equal<>()) ==
+         var_names.end());
+}
+
+std::optional<std::size_t> VariableLayout::slot(
+    std::string_view name) const noexcept {
+  auto it = absl::c_lower_bound(var_names, name);
+  if (it == var_names.end() || *it != name) return std::nullopt;
+  return std::distance(var_names.begin(), it);
+}
+
+absl::StatusOr<std::vector<float>> VariableLayout::bind(
+    const Inputs& inputs) const {
+  return bind<float>(inputs);
+}
+
+template <typename T>
+absl::StatusOr<std::vector<T>> VariableLayout::bind(
+    const BasicInputs<T>& inputs) const {
+  std::vector<T> var_values;
+  var_values.reserve(var_names.size());
+  for (const std::string& name : var_names) {
+    auto var_it = inputs.find(name);
+    if (var_it == inputs.end()) {
+      return absl::InvalidArgumentError(
+          fmt::format("No value was provided for variable '{}'.", name));
+    }
+    var_values.push_back(var_it->second);
+  }
+  return var_values;
+}
+
+std::vector<std::size_t> VariableLayout::gradient_columns(
+    const Inputs& inputs) const {
+  return gradient_columns<float>(inputs);
+}
+
+template <typename T>
+std::vector<std::size_t> VariableLayout::gradient_columns(
+    const BasicInputs<T>& inputs) const {
+  std::vector<std::string_view> input_names;
+  input_names.reserve(inputs.size());
+  absl::c_transform(inputs, std::back_inserter(input_names),
+                    [](const auto& p) { return std::string_view(p.first); });
+  absl::c_sort(input_names);
+
+  std::vector<std::size_t> columns;
+  columns.reserve(var_names.size());
+  for (const std::string& name : var_names) {
+    auto it = absl::c_lower_bound(input_names, name);
+    columns.push_back(std::distance(input_names.begin(), it));
+  }
+  return columns;
+}
+
+CompiledGraph::CompiledGraph(std::vector<Instruction> tape_,
+                             std::vector<float> constants_,
+                             VariableLayout layout_)
+    : var_layout(std::move(layout_)) {
+  assert(!tape_.empty());
+  auto owned = std::make_shared<OwnedTables>();
+  owned->tape = std::move(tape_);
+  owned->constants = std::move(constants_);
+  tape = owned->tape;
+  constants = owned->constants;
+
+  // linear-scan assignment of gradient rows: the row of an instruction
+  // becomes available again right after the instruction that uses it last
+  std::vector<std::uint32_t> last_use(tape.size());
+  for (std::uint32_t i = 0; i < tape.size(); ++i) {
+    last_use[i] = i;
+    const Instruction& instr = tape[i];
+    const int n_ops = n_operands(instr.opcode);
+    if (n_ops >= 1) last_use[instr.op1] = i;
+    if (n_ops == 2) last_use[instr.op2] = i;
+  }
+
+  std::vector<std::uint32_t>& rows = owned->grad_rows;
+  rows.resize(tape.size());
+  std::vector<std::uint32_t> free_rows;
+  for (std::uint32_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    const int n_ops = n_operands(instr.opcode);
+    // an instruction can safely write its gradient into one of its
+    // operands' rows: the gradient updates are coefficient-wise
+    if (n_ops >= 1 && last_use[instr.op1] == i)
+      free_rows.push_back(rows[instr.op1]);
+    if (n_ops == 2 && last_use[instr.op2] == i && instr.op2 != instr.op1)
+      free_rows.push_back(rows[instr.op2]);
+
+    if (free_rows.empty()) {
+      rows[i] = n_grad_rows++;
+    } else {
+      rows[i] = free_rows.back();
+      free_rows.pop_back();
+    }
+  }
+
+  grad_rows = rows;
+  storage = std::move(owned);
+}
+
+CompiledGraph::CompiledGraph(std::shared_ptr<const void> storage_,
+                             absl::Span<const Instruction> tape_,
+                             absl::Span<const float> constants_,
+                             VariableLayout layout_,
+                             absl::Span<const std::uint32_t> grad_rows_,
+                             std::uint32_t n_grad_rows_)
+    : storage(std::move(storage_)),
+      tape(tape_),
+      constants(constants_),
+      var_layout(std::move(layout_)),
+      grad_rows(grad_rows_),
+      n_grad_rows(n_grad_rows_) {
+  assert(!tape.empty());
+  assert(grad_rows.size() == tape.size());
+}
+
+template <typename T>
+class CompiledGraph::ProfileScope {
+  const CompiledGraph& graph;
+  const BasicEvalContext<T>& ctx;
+  Pass pass;
+  std::size_t n_points;
+  const std::vector<bool>* depends;
+  std::chrono::steady_clock::time_point start;
+  std::size_t start_bytes = 0;
+
+ public:
+  /// Record a pass of kind `pass` over `n_points` points. Derivatives are
+  /// only counted for the instructions in `depends`, if not null.
+  ProfileScope(const CompiledGraph& graph_, const BasicEvalContext<T>& ctx_,
+               Pass pass_, std::size_t n_points_ = 1,
+               const std::vector<bool>* depends_ = nullptr) noexcept
+      : graph(graph_),
+        ctx(ctx_),
+        pass(pass_),
+        n_points(n_points_),
+        depends(depends_) {
+    if constexpr (kProfilingEnabled) {
+      if (ctx.profile == nullptr) return;
+      start_bytes = ctx.buffer_bytes();
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+
+  ~ProfileScope() {
+    if constexpr (kProfilingEnabled) {
+      if (ctx.profile == nullptr) return;
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      EvalProfile& profile = *ctx.profile;
+      const std::size_t tape_size = graph.tape.size();
+      profile.tape_size = tape_size;
+      profile.value_counts.resize(tape_size);
+      profile.derivative_counts.resize(tape_size);
+      if (pass == Pass::kValues) {
+        ++profile.value_passes;
+        profile.value_time += elapsed;
+      } else {
+        ++profile.derivative_passes;
+        profile.derivative_time += elapsed;
+      }
+      if (pass != Pass::kDerivatives)
+        for (std::uint64_t& count : profile.value_counts) count += n_points;
+      if (pass != Pass::kValues)
+        for (std::size_t i = 0; i < tape_size; ++i)
+          if (depends == nullptr || (*depends)[i])
+            profile.derivative_counts[i] += n_points;
+      const std::size_t bytes = ctx.buffer_bytes();
+      if (bytes > start_bytes) profile.bytes_allocated += bytes - start_bytes;
+    }
+  }
+};
+
+template <typename T>
+void CompiledGraph::eval_values(absl::Span<const T> var_values,
+                                BasicEvalContext<T>& ctx) const noexcept {
+  const ProfileScope<T> scope(*this, ctx, Pass::kValues);
+  std::vector<T>& values = ctx.values;
+  values.resize(tape.size());
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        values[i] = T(constants[instr.op1]);
+        break;
+      case OpCode::kVar:
+        values[i] = var_values[instr.op1];
+        break;
+      case OpCode::kSum:
+        values[i] = values[instr.op1] + values[instr.op2];
+        break;
+      case OpCode::kMul:
+        values[i] = values[instr.op1] * values[instr.op2];
+        break;
+      default:
+        values[i] = apply_op(instr, values[instr.op1], operand2(instr, values));
+        break;
+    }
+  }
+}
+
+float CompiledGraph::eval(const Inputs& inputs) const noexcept {
+  return eval<float>(inputs);
+}
+
+template <typename T>
+T CompiledGraph::eval(const BasicInputs<T>& inputs) const noexcept {
+  const absl::StatusOr<std::vector<T>> var_values = var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  BasicEvalContext<T>& ctx = this_thread_context<T>();
+  return eval<T>(*var_values, ctx);
+}
+
+float CompiledGraph::eval(absl::Span<const float> inputs) const noexcept {
+  EvalContext& ctx = this_thread_context<float>();
+  return eval(inputs, ctx);
+}
+
+float CompiledGraph::eval(absl::Span<const float> inputs,
+                          EvalContext& ctx) const noexcept {
+  return eval<float>(inputs, ctx);
+}
+
+template <typename T>
+T CompiledGraph::eval(absl::Span<const T> inputs,
+                      BasicEvalContext<T>& ctx) const noexcept {
+  assert(inputs.size() == var_layout.size());
+  eval_values<T>(inputs, ctx);
+  return ctx.values.back();
+}
+
+std::pair<float, Eigen::RowVectorXf> CompiledGraph::eval_grad(
+    const Inputs& inputs, GradMode mode) const noexcept {
+  return eval_grad<float>(inputs, mode);
+}
+
+template <typename T>
+std::pair<T, Eigen::RowVectorX<T>> CompiledGraph::eval_grad(
+    const BasicInputs<T>& inputs, GradMode mode) const noexcept {
+  const absl::StatusOr<std::vector<T>> var_values = var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  BasicEvalContext<T>& ctx = this_thread_context<T>();
+  Eigen::RowVectorX<T> var_grads(var_layout.size());
+  const T value = eval_grad<T>(*var_values, var_grads, ctx, mode);
+
+  // derivatives w.r.t. inputs that do not appear in the graph are zero
+  Eigen::RowVectorX<T> grads = Eigen::RowVectorX<T>::Zero(inputs.size());
+  const std::vector<std::size_t> grad_cols =
+      var_layout.gradient_columns(inputs);
+  for (std::size_t i = 0; i < grad_cols.size(); ++i)
+    grads[grad_cols[i]] = var_grads[i];
+
+  return {value, grads};
+}
+
+std::pair<float, Eigen::RowVectorXf> CompiledGraph::eval_grad(
+    absl::Span<const float> inputs, GradMode mode) const noexcept {
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::RowVectorXf grads(var_layout.size());
+  const float value = eval_grad(inputs, grads, ctx, mode);
+  return {value, grads};
+}
+
+float CompiledGraph::eval_grad(absl::Span<const float> inputs,
+                               Eigen::Ref<Eigen::RowVectorXf> grad_out,
+                               EvalContext& ctx, GradMode mode) const noexcept {
+  return eval_grad<float>(inputs, grad_out, ctx, mode);
+}
+
+template <typename T>
+T CompiledGraph::eval_grad(absl::Span<const T> inputs,
+                           Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                           BasicEvalContext<T>& ctx,
+                           GradMode mode) const noexcept {
+  assert(inputs.size() == var_layout.size());
+  assert(std::size_t(grad_out.size()) == var_layout.size());
+  if (mode == GradMode::kAuto)
+    mode = choose_grad_mode(var_layout.size(), /*n_outputs=*/1);
+
+  switch (mode) {
+    case GradMode::kForward:
+      return eval_grad_forward<T>(inputs, grad_out, ctx);
+    case GradMode::kSparseForward:
+      return eval_grad_sparse_forward<T>(inputs, /*selection=*/nullptr,
+                                         grad_out, ctx);
+    default:
+      return eval_grad_reverse<T>(inputs, grad_out, ctx);
+  }
+}
+
+VariableSelection CompiledGraph::select(
+    absl::Span<const std::string_view> names) const {
+  VariableSelection selection;
+  selection.n_selected = names.size();
+  selection.columns.assign(var_layout.size(), VariableSelection::kNotSelected);
+  for (std::uint32_t col = 0; col < names.size(); ++col) {
+    if (const std::optional<std::size_t> slot = var_layout.slot(names[col])) {
+      assert(selection.columns[*slot] == VariableSelection::kNotSelected);
+      selection.columns[*slot] = col;
+    }
+  }
+
+  selection.depends.resize(tape.size());
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        selection.depends[i] = false;
+        break;
+      case OpCode::kVar:
+        selection.depends[i] =
+            selection.columns[instr.op1] != VariableSelection::kNotSelected;
+        break;
+      default:
+        selection.depends[i] =
+            selection.depends[instr.op1] ||
+            (n_operands(instr.opcode) == 2 && selection.depends[instr.op2]);
+        break;
+    }
+  }
+
+  return selection;
+}
+
+std::pair<float, Eigen::RowVectorXf> CompiledGraph::eval_grad(
+    const Inputs& inputs, const VariableSelection& selection,
+    GradMode mode) const noexcept {
+  const absl::StatusOr<std::vector<float>> var_values =
+      var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::RowVectorXf grads(selection.size());
+  const float value = eval_grad(*var_values, selection, grads, ctx, mode);
+  return {value, grads};
+}
+
+float CompiledGraph::eval_grad(absl::Span<const float> inputs,
+                               const VariableSelection& selection,
+                               Eigen::Ref<Eigen::RowVectorXf> grad_out,
+                               EvalContext& ctx, GradMode mode) const noexcept {
+  return eval_grad<float>(inputs, selection, grad_out, ctx, mode);
+}
+
+template <typename T>
+T CompiledGraph::eval_grad(absl::Span<const T> inputs,
+                           const VariableSelection& selection,
+                           Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                           BasicEvalContext<T>& ctx,
+                           GradMode mode) const noexcept {
+  assert(inputs.size() == var_layout.size());
+  assert(selection.depends.size() == tape.size());
+  assert(std::size_t(grad_out.size()) == selection.size());
+  if (mode == GradMode::kAuto)
+    mode = choose_grad_mode(selection.size(), /*n_outputs=*/1);
+
+  switch (mode) {
+    case GradMode::kForward:
+      return eval_grad_forward<T>(inputs, selection, grad_out, ctx);
+    case GradMode::kSparseForward:
+      return eval_grad_sparse_forward<T>(inputs, &selection, grad_out, ctx);
+    default:
+      return eval_grad_reverse<T>(inputs, selection, grad_out, ctx);
+  }
+}
+
+template <typename T, typename Visitor>
+void CompiledGraph::forward_pass(absl::Span<const T> var_values,
+                                 BasicEvalContext<T>& ctx,
+                                 Visitor&& visit) const noexcept {
+  const ProfileScope<T> scope(*this, ctx, Pass::kValuesAndDerivatives);
+  std::vector<T>& values = ctx.values;
+  values.resize(tape.size());
+  // row-major so that each instruction's gradient is contiguous in memory
+  ctx.grads.resize(std::size_t(n_grad_rows) * var_layout.size());
+  Eigen::Map<RowMajorMatrixX<T>> grads(ctx.grads.data(), n_grad_rows,
+                                       var_layout.size());
+
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    auto grad = grads.row(grad_rows[i]);
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        // derivatives of a constant are all zero
+        values[i] = T(constants[instr.op1]);
+        grad.setZero();
+        break;
+      case OpCode::kVar:
+        // derivatives of a variable w.r.t. all variables is a one-hot vector:
+        // the only 1. is at the position of the variable itself
+        values[i] = var_values[instr.op1];
+        grad.setZero();
+        grad[instr.op1] = T(1);
+        break;
+      case OpCode::kSum:
+        values[i] = values[instr.op1] + values[instr.op2];
+        grad =
+            grads.row(grad_rows[instr.op1]) + grads.row(grad_rows[instr.op2]);
+        break;
+      case OpCode::kMul:
+        // dMul/dvalue_i for value1*value2 is (value2, value1)
+        values[i] = values[instr.op1] * values[instr.op2];
+        grad = values[instr.op2] * grads.row(grad_rows[instr.op1]) +
+               values[instr.op1] * grads.row(grad_rows[instr.op2]);
+        break;
+      default: {
+        values[i] = apply_op(instr, values[instr.op1], operand2(instr, values));
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        if (n_operands(instr.opcode) == 2)
+          grad = d1 * grads.row(grad_rows[instr.op1]) +
+                 d2 * grads.row(grad_rows[instr.op2]);
+        else
+          grad = d1 * grads.row(grad_rows[instr.op1]);
+        break;
+      }
+    }
+    visit(i, grad);
+  }
+}
+
+template <typename T>
+void CompiledGraph::reverse_pass(std::size_t root,
+                                 Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                                 BasicEvalContext<T>& ctx) const noexcept {
+  const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives);
+  const std::vector<T>& values = ctx.values;
+
+  // adjoints[i] is the derivative of the output w.r.t. the result of
+  // instruction i: walking the tape backwards, each instruction pushes its
+  // adjoint to its operands before they are visited
+  std::vector<T>& adjoints = ctx.adjoints;
+  adjoints.assign(root + 1, T(0));
+  adjoints[root] = T(1);
+  grad_out.setZero();
+
+  for (std::size_t i = root + 1; i-- > 0;) {
+    const Instruction& instr = tape[i];
+    const T adjoint = adjoints[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        break;
+      case OpCode::kVar:
+        grad_out[instr.op1] += adjoint;
+        break;
+      case OpCode::kSum:
+        adjoints[instr.op1] += adjoint;
+        adjoints[instr.op2] += adjoint;
+        break;
+      case OpCode::kMul:
+        adjoints[instr.op1] += adjoint * values[instr.op2];
+        adjoints[instr.op2] += adjoint * values[instr.op1];
+        break;
+      default: {
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        adjoints[instr.op1] += adjoint * d1;
+        if (n_operands(instr.opcode) == 2) adjoints[instr.op2] += adjoint * d2;
+        break;
+      }
+    }
+  }
+}
+
+template <typename T>
+T CompiledGraph::eval_grad_forward(absl::Span<const T> var_values,
+                                   Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                                   BasicEvalContext<T>& ctx) const noexcept {
+  forward_pass<T>(var_values, ctx, [&](std::size_t i, const auto& grad) {
+    if (i == tape.size() - 1) grad_out = grad;
+  });
+  return ctx.values.back();
+}
+
+template <typename T>
+T CompiledGraph::eval_grad_reverse(absl::Span<const T> var_values,
+                                   Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                                   BasicEvalContext<T>& ctx) const noexcept {
+  eval_values<T>(var_values, ctx);
+  reverse_pass<T>(tape.size() - 1, grad_out, ctx);
+  return ctx.values.back();
+}
+
+template <typename T>
+T CompiledGraph::eval_grad_forward(absl::Span<const T> var_values,
+                                   const VariableSelection& selection,
+                                   Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                                   BasicEvalContext<T>& ctx) const noexcept {
+  const ProfileScope<T> scope(*this, ctx, Pass::kValuesAndDerivatives,
+                              /*n_points=*/1, &selection.depends);
+  std::vector<T>& values = ctx.values;
+  values.resize(tape.size());
+  ctx.grads.resize(std::size_t(n_grad_rows) * selection.size());
+  Eigen::Map<RowMajorMatrixX<T>> grads(ctx.grads.data(), n_grad_rows,
+                                       selection.size());
+
+  // same as the full forward mode, except that the gradients of the
+  // instructions that do not depend on the selection are known to be zero:
+  // they are neither computed nor read
+  const std::vector<bool>& depends = selection.depends;
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        values[i] = T(constants[instr.op1]);
+        break;
+      case OpCode::kVar:
+        values[i] = var_values[instr.op1];
+        break;
+      case OpCode::kSum:
+        values[i] = values[instr.op1] + values[instr.op2];
+        break;
+      case OpCode::kMul:
+        values[i] = values[instr.op1] * values[instr.op2];
+        break;
+      default:
+        values[i] = apply_op(instr, values[instr.op1], operand2(instr, values));
+        break;
+    }
+    if (!depends[i]) continue;
+
+    auto grad = grads.row(grad_rows[i]);
+    if (instr.opcode == OpCode::kVar) {
+      grad.setZero();
+      grad[selection.columns[instr.op1]] = T(1);
+      continue;
+    }
+
+    // an operation, at least one of whose operands depends on the
+    // selection (constants never do)
+    auto grad1 = grads.row(grad_rows[instr.op1]);
+    const bool depends1 = depends[instr.op1];
+    if (n_operands(instr.opcode) == 1) {
+      grad = instr_partials(instr, i, values).first * grad1;
+      continue;
+    }
+    auto grad2 = grads.row(grad_rows[instr.op2]);
+    const bool depends2 = depends[instr.op2];
+    if (instr.opcode == OpCode::kSum) {
+      if (depends1 && depends2)
+        grad = grad1 + grad2;
+      else if (depends1)
+        grad = grad1;
+      else
+        grad = grad2;
+    } else {
+      const auto [d1, d2] = instr_partials(instr, i, values);
+      if (depends1 && depends2)
+        grad = d1 * grad1 + d2 * grad2;
+      else if (depends1)
+        grad = d1 * grad1;
+      else
+        grad = d2 * grad2;
+    }
+  }
+
+  if (depends.back())
+    grad_out = grads.row(grad_rows.back());
+  else
+    grad_out.setZero();
+  return values.back();
+}
+
+template <typename T>
+T CompiledGraph::eval_grad_reverse(absl::Span<const T> var_values,
+                                   const VariableSelection& selection,
+                                   Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                                   BasicEvalContext<T>& ctx) const noexcept {
+  std::vector<T>& values = ctx.values;
+  eval_values<T>(var_values, ctx);
+  const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives, /*n_points=*/1,
+                              &selection.depends);
+
+  // adjoints are only propagated to instructions that depend on the
+  // selection: all others cannot contribute to the selected derivatives
+  std::vector<T>& adjoints = ctx.adjoints;
+  adjoints.assign(tape.size(), T(0));
+  adjoints.back() = T(1);
+  grad_out.setZero();
+
+  const std::vector<bool>& depends = selection.depends;
+  for (std::size_t i = tape.size(); i-- > 0;) {
+    if (!depends[i]) continue;
+    const Instruction& instr = tape[i];
+    const T adjoint = adjoints[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        break;
+      case OpCode::kVar:
+        grad_out[selection.columns[instr.op1]] += adjoint;
+        break;
+      case OpCode::kSum:
+        adjoints[instr.op1] += adjoint;
+        adjoints[instr.op2] += adjoint;
+        break;
+      case OpCode::kMul:
+        adjoints[instr.op1] += adjoint * values[instr.op2];
+        adjoints[instr.op2] += adjoint * values[instr.op1];
+        break;
+      default: {
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        adjoints[instr.op1] += adjoint * d1;
+        if (n_operands(instr.opcode) == 2) adjoints[instr.op2] += adjoint * d2;
+        break;
+      }
+    }
+  }
+
+  return values.back();
+}
+
+template <typename T>
+T CompiledGraph::eval_grad_sparse_forward(
+    absl::Span<const T> var_values, const VariableSelection* selection,
+    Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+    BasicEvalContext<T>& ctx) const noexcept {
+  eval_values<T>(var_values, ctx);
+  eval_sparse_grads<T>(selection, ctx);
+
+  const std::vector<std::uint32_t>& begin = ctx.sparse_begin;
+  grad_out.setZero();
+  for (std::uint32_t j = begin[tape.size() - 1]; j < begin.back(); ++j)
+    grad_out[ctx.sparse_slots[j]] = ctx.sparse_grads[j];
+  return ctx.values.back();
+}
+
+template <typename T>
+void CompiledGraph::eval_sparse_grads(const VariableSelection* selection,
+                                      BasicEvalContext<T>& ctx) const noexcept {
+  const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives, /*n_points=*/1,
+                              selection ? &selection->depends : nullptr);
+  const std::vector<T>& values = ctx.values;
+
+  // each instruction's derivatives are stored as a sorted list of
+  // (slot, derivative) pairs, appended to the buffers in tape order.
+  // Those of sums and products are merged from their operands' lists.
+  std::vector<std::uint32_t>& begin = ctx.sparse_begin;
+  std::vector<std::uint32_t>& slots = ctx.sparse_slots;
+  std::vector<T>& grads = ctx.sparse_grads;
+  begin.resize(tape.size() + 1);
+  slots.clear();
+  grads.clear();
+
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    begin[i] = slots.size();
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        break;
+      case OpCode::kVar: {
+        // with a selection, derivatives are stored by gradient column
+        const std::uint32_t col =
+            selection ? selection->columns[instr.op1] : instr.op1;
+        if (col != VariableSelection::kNotSelected) {
+          slots.push_back(col);
+          grads.push_back(T(1));
+        }
+        break;
+      }
+      default: {
+        // c1 and c2 are the derivatives w.r.t. the operands. Unary operations
+        // merge their operand's list with an empty one.
+        const auto [c1, c2] = instr_partials(instr, i, values);
+        const bool is_binary = n_operands(instr.opcode) == 2;
+        std::uint32_t j1 = begin[instr.op1];
+        const std::uint32_t end1 = begin[instr.op1 + 1];
+        std::uint32_t j2 = is_binary ? begin[instr.op2] : 0;
+        const std::uint32_t end2 = is_binary ? begin[instr.op2 + 1] : 0;
+        // indices rather than iterators: the buffers grow while we read them
+        while (j1 < end1 || j2 < end2) {
+          if (j2 == end2 || (j1 < end1 && slots[j1] < slots[j2])) {
+            slots.push_back(slots[j1]);
+            grads.push_back(c1 * grads[j1++]);
+          } else if (j1 == end1 || slots[j2] < slots[j1]) {
+            slots.push_back(slots[j2]);
+            grads.push_back(c2 * grads[j2++]);
+          } else {
+            slots.push_back(slots[j1]);
+            grads.push_back(c1 * grads[j1++] + c2 * grads[j2++]);
+          }
+        }
+        break;
+      }
+    }
+  }
+  begin.back() = slots.size();
+}
+
+template <typename T>
+void CompiledGraph::eval_adjoints(absl::Span<const T> var_values,
+                                  BasicEvalContext<T>& ctx) const noexcept {
+  std::vector<T>& values = ctx.values;
+  eval_values<T>(var_values, ctx);
+  const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives);
+
+  // same as eval_grad_reverse, without collecting the variables' adjoints
+  std::vector<T>& adjoints = ctx.adjoints;
+  adjoints.assign(tape.size(), T(0));
+  adjoints.back() = T(1);
+  for (std::size_t i = tape.size(); i-- > 0;) {
+    const Instruction& instr = tape[i];
+    const T adjoint = adjoints[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+      case OpCode::kVar:
+        break;
+      case OpCode::kSum:
+        adjoints[instr.op1] += adjoint;
+        adjoints[instr.op2] += adjoint;
+        break;
+      case OpCode::kMul:
+        adjoints[instr.op1] += adjoint * values[instr.op2];
+        adjoints[instr.op2] += adjoint * values[instr.op1];
+        break;
+      default: {
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        adjoints[instr.op1] += adjoint * d1;
+        if (n_operands(instr.opcode) == 2) adjoints[instr.op2] += adjoint * d2;
+        break;
+      }
+    }
+  }
+}
+
+std::pair<float, Eigen::MatrixXf> CompiledGraph::eval_hessian(
+    const Inputs& inputs) const noexcept {
+  const absl::StatusOr<std::vector<float>> var_values =
+      var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::MatrixXf var_hess(var_layout.size(), var_layout.size());
+  const float value = eval_hessian(*var_values, var_hess, ctx);
+
+  // second derivatives w.r.t. inputs that do not appear in the graph are zero
+  Eigen::MatrixXf hess = Eigen::MatrixXf::Zero(inputs.size(), inputs.size());
+  const std::vector<std::size_t> grad_cols =
+      var_layout.gradient_columns(inputs);
+  for (std::size_t j = 0; j < grad_cols.size(); ++j)
+    for (std::size_t i = 0; i < grad_cols.size(); ++i)
+      hess(grad_cols[i], grad_cols[j]) = var_hess(i, j);
+
+  return {value, hess};
+}
+
+float CompiledGraph::eval_hessian(absl::Span<const float> inputs,
+                                  Eigen::Ref<Eigen::MatrixXf> hess_out,
+                                  EvalContext& ctx) const noexcept {
+  return eval_hessian_dense<float>(inputs, hess_out, ctx);
+}
+
+template <typename T>
+T CompiledGraph::eval_hessian_dense(absl::Span<const T> var_values,
+                                    Eigen::Ref<Eigen::MatrixX<T>> hess_out,
+                                    BasicEvalContext<T>& ctx) const noexcept {
+  const std::size_t n_vars = var_layout.size();
+  assert(var_values.size() == n_vars);
+  assert(std::size_t(hess_out.rows()) == n_vars);
+  assert(std::size_t(hess_out.cols()) == n_vars);
+
+  eval_adjoints<T>(var_values, ctx);
+  const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives);
+  const std::vector<T>& values = ctx.values;
+  const std::vector<T>& adjoints = ctx.adjoints;
+
+  // the gradients are propagated as in eval_grad_forward
+  ctx.grads.resize(std::size_t(n_grad_rows) * n_vars);
+  Eigen::Map<RowMajorMatrixX<T>> grads(ctx.grads.data(), n_grad_rows,
+                                       n_vars);
+  hess_out.setZero();
+  auto lower = hess_out.template selfadjointView<Eigen::Lower>();
+
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    auto grad = grads.row(grad_rows[i]);
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        grad.setZero();
+        break;
+      case OpCode::kVar:
+        grad.setZero();
+        grad[instr.op1] = T(1);
+        break;
+      case OpCode::kSum:
+        grad =
+            grads.row(grad_rows[instr.op1]) + grads.row(grad_rows[instr.op2]);
+        break;
+      case OpCode::kMul: {
+        // the updates must happen before `grad` is written, as it might
+        // reuse the row of one of the operands
+        auto grad1 = grads.row(grad_rows[instr.op1]);
+        auto grad2 = grads.row(grad_rows[instr.op2]);
+        if (adjoints[i] != T(0))
+          lower.rankUpdate(grad1.transpose(), grad2.transpose(), adjoints[i]);
+        grad = values[instr.op2] * grad1 + values[instr.op1] * grad2;
+        break;
+      }
+      default: {
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        const OpSecondPartials<T> dd = instr_second_partials(instr, i, values);
+        const T adjoint = adjoints[i];
+        auto grad1 = grads.row(grad_rows[instr.op1]);
+        if (adjoint != T(0) && dd.aa != T(0))
+          lower.rankUpdate(grad1.transpose(), adjoint * dd.aa);
+        if (n_operands(instr.opcode) == 1) {
+          grad = d1 * grad1;
+          break;
+        }
+        auto grad2 = grads.row(grad_rows[instr.op2]);
+        if (adjoint != T(0) && dd.ab != T(0))
+          lower.rankUpdate(grad1.transpose(), grad2.transpose(),
+                           adjoint * dd.ab);
+        if (adjoint != T(0) && dd.bb != T(0))
+          lower.rankUpdate(grad2.transpose(), adjoint * dd.bb);
+        grad = d1 * grad1 + d2 * grad2;
+        break;
+      }
+    }
+  }
+
+  for (std::size_t j = 1; j < n_vars; ++j)
+    for (std::size_t i = 0; i < j; ++i) hess_out(i, j) = hess_out(j, i);
+  return values.back();
+}
+
+std::pair<float, Eigen::SparseMatrix<float>>
+CompiledGraph::eval_sparse_hessian(const Inputs& inputs) const {
+  const absl::StatusOr<std::vector<float>> var_values =
+      var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::SparseMatrix<float> hess;
+  const std::vector<std::size_t> grad_cols =
+      var_layout.gradient_columns(inputs);
+  const float value = eval_hessian_sparse<float>(*var_values, &grad_cols,
+                                                 inputs.size(), hess, ctx);
+  return {value, std::move(hess)};
+}
+
+float CompiledGraph::eval_sparse_hessian(absl::Span<const float> inputs,
+                                         Eigen::SparseMatrix<float>& hess_out,
+                                         EvalContext& ctx) const {
+  return eval_hessian_sparse<float>(inputs, /*columns=*/nullptr,
+                                    var_layout.size(), hess_out, ctx);
+}
+
+template <typename T>
+T CompiledGraph::eval_hessian_sparse(absl::Span<const T> var_values,
+                                     const std::vector<std::size_t>* columns,
+                                     std::size_t size,
+                                     Eigen::SparseMatrix<T>& hess_out,
+                                     BasicEvalContext<T>& ctx) const {
+  assert(var_values.size() == var_layout.size());
+  eval_adjoints<T>(var_values, ctx);
+  eval_sparse_grads<T>(/*selection=*/nullptr, ctx);
+  const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives);
+
+  // same terms as in eval_hessian_dense, restricted to the nonzero
+  // derivatives of the operands
+  const std::vector<std::uint32_t>& begin = ctx.sparse_begin;
+  const std::vector<std::uint32_t>& slots = ctx.sparse_slots;
+  const std::vector<T>& grads = ctx.sparse_grads;
+  std::vector<Eigen::Triplet<T>>& terms = ctx.hessian_terms;
+  terms.clear();
+  const auto column = [columns, &slots](std::uint32_t j) -> std::size_t {
+    return columns ? (*columns)[slots[j]] : slots[j];
+  };
+  // the lower triangle of coeff * grad(a)^T grad(a) for an operand a
+  const auto add_square = [&](std::uint32_t a, T coeff) {
+    for (std::uint32_t j = begin[a]; j < begin[a + 1]; ++j)
+      for (std::uint32_t k = begin[a]; k <= j; ++k)
+        terms.emplace_back(std::max(column(j), column(k)),
+                           std::min(column(j), column(k)),
+                           coeff * grads[j] * grads[k]);
+  };
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    const T adjoint = ctx.adjoints[i];
+    if (n_operands(instr.opcode) == 0 || adjoint == T(0)) continue;
+    const OpSecondPartials<T> dd =
+        instr_second_partials(instr, i, ctx.values);
+    if (dd.aa != T(0)) add_square(instr.op1, adjoint * dd.aa);
+    if (n_operands(instr.opcode) == 1) continue;
+    if (dd.bb != T(0)) add_square(instr.op2, adjoint * dd.bb);
+    if (dd.ab == T(0)) continue;
+    const std::uint32_t end1 = begin[instr.op1 + 1];
+    const std::uint32_t end2 = begin[instr.op2 + 1];
+    for (std::uint32_t j1 = begin[instr.op1]; j1 < end1; ++j1) {
+      for (std::uint32_t j2 = begin[instr.op2]; j2 < end2; ++j2) {
+        // the (p, q) element of grad1^T grad2 is the (q, p) element of
+        // grad2^T grad1: both end up in the same element of the lower
+        // triangle, which on the diagonal then gets the term twice
+        const std::size_t p = column(j1);
+        const std::size_t q = column(j2);
+        const T term = adjoint * dd.ab * grads[j1] * grads[j2];
+        if (p == q)
+          terms.emplace_back(p, p, 2 * term);
+        else
+          terms.emplace_back(std::max(p, q), std::min(p, q), term);
+      }
+    }
+  }
+
+  Eigen::SparseMatrix<T> lower(size, size);
+  lower.setFromTriplets(terms.begin(), terms.end());
+  hess_out = lower.template selfadjointView<Eigen::Lower>();
+  return ctx.values.back();
+}
+
+Eigen::RowVectorXf CompiledGraph::hvp(
+    const Inputs& inputs, const Eigen::Ref<const Eigen::RowVectorXf>& v) const {
+  assert(std::size_t(v.size()) == inputs.size());
+  const absl::StatusOr<std::vector<float>> var_values =
+      var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  const std::vector<std::size_t> grad_cols =
+      var_layout.gradient_columns(inputs);
+  std::vector<float> var_v(var_layout.size());
+  for (std::size_t i = 0; i < grad_cols.size(); ++i) var_v[i] = v[grad_cols[i]];
+
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::RowVectorXf var_hvp(var_layout.size());
+  hvp(*var_values, var_v, var_hvp, ctx);
+
+  Eigen::RowVectorXf result = Eigen::RowVectorXf::Zero(inputs.size());
+  for (std::size_t i = 0; i < grad_cols.size(); ++i)
+    result[grad_cols[i]] = var_hvp[i];
+  return result;
+}
+
+float CompiledGraph::hvp(absl::Span<const float> inputs,
+                         absl::Span<const float> v,
+                         Eigen::Ref<Eigen::RowVectorXf> hvp_out,
+                         EvalContext& ctx) const noexcept {
+  return eval_hvp<float>(inputs, v, hvp_out, ctx);
+}
+
+template <typename T>
+T CompiledGraph::eval_hvp(absl::Span<const T> var_values,
+                          absl::Span<const T> v,
+                          Eigen::Ref<Eigen::RowVectorX<T>> hvp_out,
+                          BasicEvalContext<T>& ctx) const noexcept {
+  assert(var_values.size() == var_layout.size());
+  assert(v.size() == var_layout.size());
+  assert(std::size_t(hvp_out.size()) == var_layout.size());
+  const ProfileScope<T> scope(*this, ctx, Pass::kValuesAndDerivatives);
+
+  // forward pass: the values and their derivatives along v
+  std::vector<T>& values = ctx.values;
+  std::vector<T>& tangents = ctx.tangents;
+  values.resize(tape.size());
+  tangents.resize(tape.size());
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        values[i] = T(constants[instr.op1]);
+        tangents[i] = T(0);
+        break;
+      case OpCode::kVar:
+        values[i] = var_values[instr.op1];
+        tangents[i] = v[instr.op1];
+        break;
+      case OpCode::kSum:
+        values[i] = values[instr.op1] + values[instr.op2];
+        tangents[i] = tangents[instr.op1] + tangents[instr.op2];
+        break;
+      case OpCode::kMul:
+        values[i] = values[instr.op1] * values[instr.op2];
+        tangents[i] = tangents[instr.op1] * values[instr.op2] +
+                      values[instr.op1] * tangents[instr.op2];
+        break;
+      default: {
+        values[i] = apply_op(instr, values[instr.op1], operand2(instr, values));
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        tangents[i] = d1 * tangents[instr.op1] +
+                      d2 * operand2(instr, tangents);
+        break;
+      }
+    }
+  }
+
+  // reverse pass: the adjoints and their derivatives along v. Those of the
+  // variables are the elements of the gradient and of the product.
+  std::vector<T>& adjoints = ctx.adjoints;
+  std::vector<T>& adjoint_tangents = ctx.adjoint_tangents;
+  adjoints.assign(tape.size(), T(0));
+  adjoint_tangents.assign(tape.size(), T(0));
+  adjoints.back() = T(1);
+  hvp_out.setZero();
+  for (std::size_t i = tape.size(); i-- > 0;) {
+    const Instruction& instr = tape[i];
+    const T adjoint = adjoints[i];
+    const T adjoint_tangent = adjoint_tangents[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        break;
+      case OpCode::kVar:
+        hvp_out[instr.op1] += adjoint_tangent;
+        break;
+      case OpCode::kSum:
+        adjoints[instr.op1] += adjoint;
+        adjoints[instr.op2] += adjoint;
+        adjoint_tangents[instr.op1] += adjoint_tangent;
+        adjoint_tangents[instr.op2] += adjoint_tangent;
+        break;
+      case OpCode::kMul:
+        adjoints[instr.op1] += adjoint * values[instr.op2];
+        adjoints[instr.op2] += adjoint * values[instr.op1];
+        adjoint_tangents[instr.op1] += adjoint_tangent * values[instr.op2] +
+                                       adjoint * tangents[instr.op2];
+        adjoint_tangents[instr.op2] += adjoint_tangent * values[instr.op1] +
+                                       adjoint * tangents[instr.op1];
+        break;
+      default: {
+        // the derivatives of the adjoint contributions d1 * adjoint and
+        // d2 * adjoint along v, with t1 and t2 the operands' tangents
+        const auto [d1, d2] = instr_partials(instr, i, values);
+        const OpSecondPartials<T> dd = instr_second_partials(instr, i, values);
+        const T t1 = tangents[instr.op1];
+        const T t2 = operand2(instr, tangents);
+        adjoints[instr.op1] += adjoint * d1;
+        adjoint_tangents[instr.op1] +=
+            adjoint_tangent * d1 + adjoint * (dd.aa * t1 + dd.ab * t2);
+        if (n_operands(instr.opcode) == 1) break;
+        adjoints[instr.op2] += adjoint * d2;
+        adjoint_tangents[instr.op2] +=
+            adjoint_tangent * d2 + adjoint * (dd.ab * t1 + dd.bb * t2);
+        break;
+      }
+    }
+  }
+
+  return values.back();
+}
+
+std::size_t CompiledGraph::batch_block_size() const noexcept {
+  // large enough to amortize the dispatch of each instruction, small enough
+  // that the buffers of large graphs do not grow unbounded
+  constexpr std::size_t kMaxBlockSize = 256;
+  constexpr std::size_t kMaxBufferSize = std::size_t(1) << 22;
+  return std::clamp<std::size_t>(kMaxBufferSize / tape.size(), 1,
+                                 kMaxBlockSize);
+}
+
+template <typename T>
+Eigen::Map<Eigen::ArrayXX<T>> CompiledGraph::eval_values_block(
+    const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,
+    BasicEvalContext<T>& ctx) const noexcept {
+  assert(std::size_t(inputs.rows()) <= batch_block_size());
+  assert(std::size_t(inputs.cols()) == var_layout.size());
+  const ProfileScope<T> scope(*this, ctx, Pass::kValues, inputs.rows());
+
+  ctx.batch_values.resize(inputs.rows() * tape.size());
+  Eigen::Map<Eigen::ArrayXX<T>> values(ctx.batch_values.data(),
+                                       inputs.rows(), tape.size());
+
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        values.col(i).setConstant(T(constants[instr.op1]));
+        break;
+      case OpCode::kVar:
+        values.col(i) = inputs.col(instr.op1).array();
+        break;
+      case OpCode::kSum:
+        values.col(i) = values.col(instr.op1) + values.col(instr.op2);
+        break;
+      case OpCode::kMul:
+        values.col(i) = values.col(instr.op1) * values.col(instr.op2);
+        break;
+      case OpCode::kSub:
+        values.col(i) = values.col(instr.op1) - values.col(instr.op2);
+        break;
+      case OpCode::kDiv:
+        values.col(i) = values.col(instr.op1) / values.col(instr.op2);
+        break;
+      case OpCode::kNeg:
+        values.col(i) = -values.col(instr.op1);
+        break;
+      case OpCode::kPow: {
+        const std::int32_t n = pow_exponent(instr);
+        values.col(i) =
+            values.col(instr.op1).unaryExpr([n](T x) { return ipow(x, n); });
+        break;
+      }
+      case OpCode::kExp:
+        values.col(i) = values.col(instr.op1).exp();
+        break;
+      case OpCode::kLog:
+        values.col(i) = values.col(instr.op1).log();
+        break;
+    }
+  }
+
+  return values;
+}
+
+Eigen::VectorXf CompiledGraph::eval_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs) const {
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::VectorXf values(inputs.rows());
+  eval_batch(inputs, values, ctx);
+  return values;
+}
+
+void CompiledGraph::eval_batch(const Eigen::Ref<const Eigen::MatrixXf>& inputs,
+                               Eigen::Ref<Eigen::VectorXf> values_out,
+                               EvalContext& ctx) const noexcept {
+  eval_batch<float>(inputs, values_out, ctx);
+}
+
+template <typename T>
+void CompiledGraph::eval_batch(
+    const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,
+    Eigen::Ref<Eigen::VectorX<T>> values_out,
+    BasicEvalContext<T>& ctx) const noexcept {
+  assert(values_out.size() == inputs.rows());
+
+  const std::size_t block_size = batch_block_size();
+  for (Eigen::Index start = 0; start < inputs.rows(); start += block_size) {
+    const Eigen::Index n = std::min<Eigen::Index>(block_size,
+                                                  inputs.rows() - start);
+    const auto values =
+        eval_values_block<T>(inputs.middleRows(start, n), ctx);
+    values_out.segment(start, n) = values.col(tape.size() - 1).matrix();
+  }
+}
+
+std::pair<Eigen::VectorXf, Eigen::MatrixXf> CompiledGraph::eval_grad_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs) const {
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::VectorXf values(inputs.rows());
+  Eigen::MatrixXf grads(inputs.rows(), inputs.cols());
+  eval_grad_batch(inputs, values, grads, ctx);
+  return {values, grads};
+}
+
+void CompiledGraph::eval_grad_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs,
+    Eigen::Ref<Eigen::VectorXf> values_out,
+    Eigen::Ref<Eigen::MatrixXf> grads_out, EvalContext& ctx) const noexcept {
+  eval_grad_batch<float>(inputs, values_out, grads_out, ctx);
+}
+
+template <typename T>
+void CompiledGraph::eval_grad_batch(
+    const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,
+    Eigen::Ref<Eigen::VectorX<T>> values_out,
+    Eigen::Ref<Eigen::MatrixX<T>> grads_out,
+    BasicEvalContext<T>& ctx) const noexcept {
+  assert(values_out.size() == inputs.rows());
+  assert(grads_out.rows() == inputs.rows());
+  assert(grads_out.cols() == inputs.cols());
+
+  grads_out.setZero();
+  const std::size_t block_size = batch_block_size();
+  for (Eigen::Index start = 0; start < inputs.rows(); start += block_size) {
+    const Eigen::Index n = std::min<Eigen::Index>(block_size,
+                                                  inputs.rows() - start);
+    const auto values =
+        eval_values_block<T>(inputs.middleRows(start, n), ctx);
+    values_out.segment(start, n) = values.col(tape.size() - 1).matrix();
+
+    // same as eval_grad_reverse, one point per row
+    const ProfileScope<T> scope(*this, ctx, Pass::kDerivatives, n);
+    ctx.batch_adjoints.resize(n * tape.size());
+    Eigen::Map<Eigen::ArrayXX<T>> adjoints(ctx.batch_adjoints.data(), n,
+                                           tape.size());
+    adjoints.setZero();
+    adjoints.col(tape.size() - 1).setOnes();
+    auto grads = grads_out.middleRows(start, n).array();
+
+    for (std::size_t i = tape.size(); i-- > 0;) {
+      const Instruction& instr = tape[i];
+      switch (instr.opcode) {
+        case OpCode::kConst:
+          break;
+        case OpCode::kVar:
+          grads.col(instr.op1) += adjoints.col(i);
+          break;
+        case OpCode::kSum:
+          adjoints.col(instr.op1) += adjoints.col(i);
+          adjoints.col(instr.op2) += adjoints.col(i);
+          break;
+        case OpCode::kMul:
+          adjoints.col(instr.op1) += adjoints.col(i) * values.col(instr.op2);
+          adjoints.col(instr.op2) += adjoints.col(i) * values.col(instr.op1);
+          break;
+        case OpCode::kSub:
+          adjoints.col(instr.op1) += adjoints.col(i);
+          adjoints.col(instr.op2) -= adjoints.col(i);
+          break;
+        case OpCode::kDiv:
+          adjoints.col(instr.op1) += adjoints.col(i) / values.col(instr.op2);
+          adjoints.col(instr.op2) -=
+              adjoints.col(i) * values.col(i) / values.col(instr.op2);
+          break;
+        case OpCode::kNeg:
+          adjoints.col(instr.op1) -= adjoints.col(i);
+          break;
+        case OpCode::kPow: {
+          const std::int32_t n = pow_exponent(instr);
+          if (n == 0) break;
+          adjoints.col(instr.op1) +=
+              adjoints.col(i) * T(n) *
+              values.col(instr.op1).unaryExpr(
+                  [n](T x) { return ipow(x, std::int64_t(n) - 1); });
+          break;
+        }
+        case OpCode::kExp:
+          adjoints.col(instr.op1) += adjoints.col(i) * values.col(i);
+          break;
+        case OpCode::kLog:
+          adjoints.col(instr.op1) += adjoints.col(i) / values.col(instr.op1);
+          break;
+      }
+    }
+  }
+}
+
+std::size_t CompiledGraph::batch_chunk_size(
+    std::size_t n_points, std::size_t n_threads) const noexcept {
+  // several chunks per thread so that stealing can even out the load, but
+  // always a whole number of blocks so that no block is evaluated partially
+  constexpr std::size_t kChunksPerThread = 8;
+  const std::size_t block_size = batch_block_size();
+  const std::size_t n_chunks = n_threads * kChunksPerThread;
+  const std::size_t n_blocks = (n_points + block_size - 1) / block_size;
+  const std::size_t blocks_per_chunk =
+      std::max<std::size_t>((n_blocks + n_chunks - 1) / n_chunks, 1);
+  return blocks_per_chunk * block_size;
+}
+
+Eigen::VectorXf CompiledGraph::eval_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs, ThreadPool& pool) const {
+  Eigen::VectorXf values(inputs.rows());
+  std::vector<EvalContext> contexts(pool.size() + 1);
+  const std::size_t chunk_size = batch_chunk_size(inputs.rows(), pool.size());
+  const std::size_t n_chunks = (inputs.rows() + chunk_size - 1) / chunk_size;
+
+  pool.parallel_for(n_chunks, [&](std::size_t worker, std::size_t chunk) {
+    const Eigen::Index start = chunk * chunk_size;
+    const Eigen::Index n =
+        std::min<Eigen::Index>(chunk_size, inputs.rows() - start);
+    eval_batch(inputs.middleRows(start, n), values.segment(start, n),
+               contexts[worker]);
+  });
+
+  return values;
+}
+
+std::pair<Eigen::VectorXf, Eigen::MatrixXf> CompiledGraph::eval_grad_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs, ThreadPool& pool) const {
+  Eigen::VectorXf values(inputs.rows());
+  Eigen::MatrixXf grads(inputs.rows(), inputs.cols());
+  std::vector<EvalContext> contexts(pool.size() + 1);
+  const std::size_t chunk_size = batch_chunk_size(inputs.rows(), pool.size());
+  const std::size_t n_chunks = (inputs.rows() + chunk_size - 1) / chunk_size;
+
+  pool.parallel_for(n_chunks, [&](std::size_t worker, std::size_t chunk) {
+    const Eigen::Index start = chunk * chunk_size;
+    const Eigen::Index n =
+        std::min<Eigen::Index>(chunk_size, inputs.rows() - start);
+    eval_grad_batch(inputs.middleRows(start, n), values.segment(start, n),
+                    grads.middleRows(start, n), contexts[worker]);
+  });
+
+  return {values, grads};
+}
+
+// The scalar types that the evaluation engine is instantiated for. Other
+// types with the usual arithmetic operators (e.g. Eigen::half) only need to
+// be added here.
+#define GRAPH_AUTODIFF_INSTANTIATE_EVAL(T)                                    \
+  template absl::StatusOr<std::vector<T>> VariableLayout::bind(               \
+      const BasicInputs<T>& inputs) const;                                    \
+  template std::vector<std::size_t> VariableLayout::gradient_columns(         \
+      const BasicInputs<T>& inputs) const;                                    \
+  template T CompiledGraph::eval(const BasicInputs<T>& inputs) const noexcept; \
+  template T CompiledGraph::eval(absl::Span<const T> inputs,                  \
+                                 BasicEvalContext<T>& ctx) const noexcept;    \
+  template std::pair<T, Eigen::RowVectorX<T>> CompiledGraph::eval_grad(       \
+      const BasicInputs<T>& inputs, GradMode mode) const noexcept;            \
+  template T CompiledGraph::eval_grad(                                        \
+      absl::Span<const T> inputs, Eigen::Ref<Eigen::RowVectorX<T>> grad_out,  \
+      BasicEvalContext<T>& ctx, GradMode mode) const noexcept;                \
+  template T CompiledGraph::eval_grad(                                        \
+      absl::Span<const T> inputs, const VariableSelection& selection,         \
+      Eigen::Ref<Eigen::RowVectorX<T>> grad_out, BasicEvalContext<T>& ctx,    \
+      GradMode mode) const noexcept;                                          \
+  template void CompiledGraph::eval_batch(                                    \
+      const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,                      \
+      Eigen::Ref<Eigen::VectorX<T>> values_out, BasicEvalContext<T>& ctx)     \
+      const noexcept;                                                         \
+  template void CompiledGraph::eval_grad_batch(                               \
+      const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,                      \
+      Eigen::Ref<Eigen::VectorX<T>> values_out,                               \
+      Eigen::Ref<Eigen::MatrixX<T>> grads_out, BasicEvalContext<T>& ctx)      \
+      const noexcept;
+
+GRAPH_AUTODIFF_INSTANTIATE_EVAL(float)
+GRAPH_AUTODIFF_INSTANTIATE_EVAL(double)
+#undef GRAPH_AUTODIFF_INSTANTIATE_EVAL
+
+CompiledMultiGraph::CompiledMultiGraph(CompiledGraph graph,
+                                       std::vector<std::uint32_t> outputs)
+    : cg(std::move(graph)),
+      output_instrs(std::move(outputs)),
+      output_order(output_instrs.size()) {
+  assert(!output_instrs.empty());
+  assert(*absl::c_max_element(output_instrs) == cg.tape.size() - 1);
+  for (std::uint32_t k = 0; k < output_order.size(); ++k) output_order[k] = k;
+  absl::c_stable_sort(output_order, [this](std::uint32_t k1, std::uint32_t k2) {
+    return output_instrs[k1] < output_instrs[k2];
+  });
+}
+
+Eigen::VectorXf CompiledMultiGraph::eval(const Inputs& inputs) const noexcept {
+  const absl::StatusOr<std::vector<float>> var_values =
+      cg.var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::VectorXf values(n_outputs());
+  eval(*var_values, values, ctx);
+  return values;
+}
+
+void CompiledMultiGraph::eval(absl::Span<const float> inputs,
+                              Eigen::Ref<Eigen::VectorXf> values_out,
+                              EvalContext& ctx) const noexcept {
+  assert(inputs.size() == cg.var_layout.size());
+  assert(std::size_t(values_out.size()) == n_outputs());
+  cg.eval_values<float>(inputs, ctx);
+  for (std::size_t k = 0; k < n_outputs(); ++k)
+    values_out[k] = ctx.values[output_instrs[k]];
+}
+
+std::pair<Eigen::VectorXf, Eigen::MatrixXf> CompiledMultiGraph::eval_jacobian(
+    const Inputs& inputs, GradMode mode) const noexcept {
+  const VariableLayout& layout = cg.var_layout;
+  const absl::StatusOr<std::vector<float>> var_values = layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  EvalContext& ctx = this_thread_context<float>();
+  Eigen::VectorXf values(n_outputs());
+  Eigen::MatrixXf var_jac(n_outputs(), layout.size());
+  eval_jacobian(*var_values, values, var_jac, ctx, mode);
+
+  // derivatives w.r.t. inputs that do not appear in any output are zero
+  Eigen::MatrixXf jac = Eigen::MatrixXf::Zero(n_outputs(), inputs.size());
+  const std::vector<std::size_t> grad_cols = layout.gradient_columns(inputs);
+  for (std::size_t i = 0; i < grad_cols.size(); ++i)
+    jac.col(grad_cols[i]) = var_jac.col(i);
+
+  return {values, jac};
+}
+
+void CompiledMultiGraph::eval_jacobian(absl::Span<const float> inputs,
+                                       Eigen::Ref<Eigen::VectorXf> values_out,
+                                       Eigen::Ref<Eigen::MatrixXf> jac_out,
+                                       EvalContext& ctx,
+                                       GradMode mode) const noexcept {
+  assert(inputs.size() == cg.var_layout.size());
+  assert(std::size_t(values_out.size()) == n_outputs());
+  assert(std::size_t(jac_out.rows()) == n_outputs());
+  assert(std::size_t(jac_out.cols()) == cg.var_layout.size());
+  if (mode == GradMode::kAuto)
+    mode = choose_grad_mode(cg.var_layout.size(), n_outputs());
+
+  switch (mode) {
+    case GradMode::kForward:
+      eval_jacobian_forward(inputs, values_out, jac_out, ctx);
+      break;
+    case GradMode::kSparseForward:
+      eval_jacobian_sparse_forward(inputs, values_out, jac_out, ctx);
+      break;
+    default:
+      eval_jacobian_reverse(inputs, values_out, jac_out, ctx);
+  }
+}
+
+void CompiledMultiGraph::eval_jacobian_forward(
+    absl::Span<const float> inputs, Eigen::Ref<Eigen::VectorXf> values_out,
+    Eigen::Ref<Eigen::MatrixXf> jac_out, EvalContext& ctx) const noexcept {
+  // each output's gradient is copied out before its row is reused
+  std::size_t next = 0;
+  cg.forward_pass<float>(inputs, ctx, [&](std::size_t i, const auto& grad) {
+    for (; next < output_order.size() &&
+           output_instrs[output_order[next]] == i;
+         ++next) {
+      const std::uint32_t k = output_order[next];
+      values_out[k] = ctx.values[i];
+      jac_out.row(k) = grad;
+    }
+  });
+}
+
+void CompiledMultiGraph::eval_jacobian_sparse_forward(
+    absl::Span<const float> inputs, Eigen::Ref<Eigen::VectorXf> values_out,
+    Eigen::Ref<Eigen::MatrixXf> jac_out, EvalContext& ctx) const noexcept {
+  cg.eval_values<float>(inputs, ctx);
+  cg.eval_sparse_grads<float>(/*selection=*/nullptr, ctx);
+
+  const std::vector<std::uint32_t>& begin = ctx.sparse_begin;
+  jac_out.setZero();
+  for (std::size_t k = 0; k < n_outputs(); ++k) {
+    const std::uint32_t i = output_instrs[k];
+    values_out[k] = ctx.values[i];
+    for (std::uint32_t j = begin[i]; j < begin[i + 1]; ++j)
+      jac_out(k, ctx.sparse_slots[j]) = ctx.sparse_grads[j];
+  }
+}
+
+void CompiledMultiGraph::eval_jacobian_reverse(
+    absl::Span<const float> inputs, Eigen::Ref<Eigen::VectorXf> values_out,
+    Eigen::Ref<Eigen::MatrixXf> jac_out, EvalContext& ctx) const noexcept {
+  cg.eval_values<float>(inputs, ctx);
+
+  // one reverse pass per output, each only over the instructions that
+  // precede it. The rows of jac_out are not contiguous, so each pass writes
+  // into the (otherwise unused) forward-mode gradient buffer first.
+  ctx.grads.resize(cg.var_layout.size());
+  Eigen::Map<Eigen::RowVectorXf> grad(ctx.grads.data(), ctx.grads.size());
+  for (std::size_t k = 0; k < n_outputs(); ++k) {
+    cg.reverse_pass<float>(output_instrs[k], grad, ctx);
+    values_out[k] = ctx.values[output_instrs[k]];
+    jac_out.row(k) = grad;
+  }
+}
+
+namespace {
+// The binary format written by to_binary_file(): a FileHeader followed by
+// the tables it refers to, each starting at a multiple of kTableAlignment.
+// Variable names are stored as n_vars lengths followed by the characters.
+constexpr char kFileMagic[8] = {'G', 'A', 'D', 'C', 'G', 'R', 'P', 'H'};
+constexpr std::uint32_t kFileVersion = 1;
+constexpr std::uint32_t kByteOrderMark = 0x01020304;
+constexpr std::size_t kTableAlignment = 64;
+
+struct FileHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint64_t file_size;
+  std::uint32_t n_instructions;
+  std::uint32_t n_constants;
+  std::uint32_t n_vars;
+  std::uint32_t n_grad_rows;
+  std::uint64_t tape_offset;
+  std::uint64_t constants_offset;
+  std::uint64_t grad_rows_offset;
+  std::uint64_t names_offset;
+};
+
+// instructions are used in place, so their layout is part of the format
+static_assert(std::is_trivially_copyable_v<Instruction>);
+static_assert(sizeof(Instruction) == 12 && offsetof(Instruction, op1) == 4 &&
+              offsetof(Instruction, op2) == 8);
+
+std::uint64_t align_up(std::uint64_t offset) {
+  return (offset + kTableAlignment - 1) / kTableAlignment * kTableAlignment;
+}
+
+// the range [offset, offset + size) lies within a file of size file_size
+bool in_bounds(std::uint64_t offset, std::uint64_t size,
+               std::uint64_t file_size) {
+  return offset <= file_size && size <= file_size - offset;
+}
+}  // end of anonymous namespace
+
+absl::Status graph_autodiff::to_binary_file(const CompiledGraph& graph,
+                                            fs::path path) {
+  const absl::Span<const Instruction> tape = graph.tape;
+  const absl::Span<const float> constants = graph.constants;
+  const std::vector<std::string>& names = graph.var_layout.names();
+
+  FileHeader header{};
+  std::copy(std::begin(kFileMagic), std::end(kFileMagic), header.magic);
+  header.version = kFileVersion;
+  header.byte_order = kByteOrderMark;
+  header.n_instructions = tape.size();
+  header.n_constants = constants.size();
+  header.n_vars = names.size();
+  header.n_grad_rows = graph.n_grad_rows;
+  header.tape_offset = align_up(sizeof(FileHeader));
+  header.constants_offset =
+      align_up(header.tape_offset + tape.size() * sizeof(Instruction));
+  header.grad_rows_offset =
+      align_up(header.constants_offset + constants.size() * sizeof(float));
+  header.names_offset = align_up(header.grad_rows_offset +
+                                 tape.size() * sizeof(std::uint32_t));
+  header.file_size = header.names_offset + names.size() * sizeof(std::uint32_t);
+  for (const std::string& name : names) header.file_size += name.size();
+
+  std::ofstream out_file(path, std::ios::binary);
+  if (!out_file.good()) {
+    return absl::InvalidArgumentError(
+        fmt::format("Could not open file {} for writing.", path.string()));
+  }
+
+  std::uint64_t written = 0;
+  const auto write = [&](const void* data, std::size_t size) {
+    out_file.write(static_cast<const char*>(data), size);
+    written += size;
+  };
+  const auto pad_to = [&](std::uint64_t offset) {
+    static constexpr char zeros[kTableAlignment] = {};
+    write(zeros, offset - written);
+  };
+
+  write(&header, sizeof(header));
+  pad_to(header.tape_offset);
+  for (const Instruction& instr : tape) {
+    // field by field, so that padding bytes are written as zeros
+    char record[sizeof(Instruction)] = {};
+    std::memcpy(record, &instr.opcode, sizeof(instr.opcode));
+    std::memcpy(record + offsetof(Instruction, op1), &instr.op1,
+                sizeof(instr.op1));
+    std::memcpy(record + offsetof(Instruction, op2), &instr.op2,
+                sizeof(instr.op2));
+    write(record, sizeof(record));
+  }
+  pad_to(header.constants_offset);
+  write(constants.data(), constants.size() * sizeof(float));
+  pad_to(header.grad_rows_offset);
+  write(graph.grad_rows.data(), graph.grad_rows.size() * sizeof(std::uint32_t));
+  pad_to(header.names_offset);
+  for (const std::string& name : names) {
+    const std::uint32_t length = name.size();
+    write(&length, sizeof(length));
+  }
+  for (const std::string& name : names) write(name.data(), name.size());
+
+  if (!out_file.good()) {
+    return absl::AbortedError(fmt::format(
+        "Something went wrong while writing CompiledGraph to file {}",
+        path.string()));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<CompiledGraph> graph_autodiff::map_binary_file(fs::path path) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::InvalidArgumentError(
+        fmt::format("Could not open file {} for reading.", path.string()));
+  }
+  struct stat file_stat;
+  const bool stat_ok = ::fstat(fd, &file_stat) == 0;
+  const std::uint64_t file_size = stat_ok ? file_stat.st_size : 0;
+  void* addr = MAP_FAILED;
+  if (file_size >= sizeof(FileHeader))
+    addr = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after the file is closed
+  ::close(fd);
+
+  const auto invalid = [&path](std::string_view reason) {
+    return absl::InvalidArgumentError(
+        fmt::format("File {} is not a valid compiled graph: {}", path.string(),
+                    reason));
+  };
+  if (addr == MAP_FAILED) return invalid("could not map the file");
+  std::shared_ptr<const void> storage(addr, [file_size](const void* p) {
+    ::munmap(const_cast<void*>(p), file_size);
+  });
+
+  const char* data = static_cast<const char*>(addr);
+  FileHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (!std::equal(std::begin(kFileMagic), std::end(kFileMagic), header.magic))
+    return invalid("unknown file type");
+  if (header.version != kFileVersion) return invalid("unsupported version");
+  if (header.byte_order != kByteOrderMark)
+    return invalid("written on a machine with a different byte order");
+  if (header.file_size != file_size) return invalid("unexpected file size");
+  if (header.n_instructions == 0) return invalid("the graph is empty");
+
+  const bool tables_ok =
+      in_bounds(header.tape_offset,
+                std::uint64_t(header.n_instructions) * sizeof(Instruction),
+                file_size) &&
+      in_bounds(header.constants_offset,
+                std::uint64_t(header.n_constants) * sizeof(float),
+                file_size) &&
+      in_bounds(header.grad_rows_offset,
+                std::uint64_t(header.n_instructions) * sizeof(std::uint32_t),
+                file_size) &&
+      in_bounds(header.names_offset,
+                std::uint64_t(header.n_vars) * sizeof(std::uint32_t),
+                file_size) &&
+      header.tape_offset % kTableAlignment == 0 &&
+      header.constants_offset % kTableAlignment == 0 &&
+      header.grad_rows_offset % kTableAlignment == 0 &&
+      header.names_offset % kTableAlignment == 0;
+  if (!tables_ok) return invalid("corrupted table offsets");
+
+  std::vector<std::string> names;
+  names.reserve(header.n_vars);
+  const char* name_lengths = data + header.names_offset;
+  std::uint64_t name_offset =
+      header.names_offset + header.n_vars * sizeof(std::uint32_t);
+  for (std::uint32_t i = 0; i < header.n_vars; ++i) {
+    std::uint32_t length = 0;
+    std::memcpy(&length, name_lengths + i * sizeof(length), sizeof(length));
+    if (!in_bounds(name_offset, length, file_size))
+      return invalid("corrupted variable names");
+    names.emplace_back(data + name_offset, length);
+    name_offset += length;
+    if (i > 0 && names[i - 1] >= names[i])
+      return invalid("variable names are not sorted");
+  }
+
+  const auto* tape =
+      reinterpret_cast<const Instruction*>(data + header.tape_offset);
+  const auto* constants =
+      reinterpret_cast<const float*>(data + header.constants_offset);
+  const auto* grad_rows =
+      reinterpret_cast<const std::uint32_t*>(data + header.grad_rows_offset);
+  return CompiledGraph(std::move(storage), {tape, header.n_instructions},
+                       {constants, header.n_constants},
+                       VariableLayout(std::move(names)),
+                       {grad_rows, header.n_instructions}, header.n_grad_rows);
+}
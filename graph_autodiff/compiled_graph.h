@@ -0,0 +1,715 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>  // std::size_t
+#include <cstdint>
+#include <filesystem>  // std::path
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>  // std::pair
+#include <vector>
+
+#include "Eigen/Core"
+#include "Eigen/SparseCore"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+namespace graph_autodiff {
+
+namespace fs = std::filesystem;
+
+class ThreadPool;
+
+/// Inputs to a graph's eval function: a mapping from variable name to value.
+/// The value type is the scalar type of the evaluation.
+template <typename T>
+using BasicInputs = absl::flat_hash_map<std::string, T>;
+using Inputs = BasicInputs<float>;
+
+/// The automatic differentiation strategy used to evaluate gradients.
+enum class GradMode {
+  kAuto,     // pick forward or reverse mode via choose_grad_mode()
+  kForward,  // propagate derivatives from the variables to the output
+  kReverse,  // propagate adjoints from the output back to the variables
+  // forward mode that only propagates the nonzero derivatives of each
+  // instruction, i.e. those w.r.t. the variables it depends on. Never picked
+  // by kAuto: it pays off over kForward when most instructions depend on few
+  // of many variables, e.g. to compute gradients of wide graphs w.r.t. many
+  // outputs at once.
+  kSparseForward,
+};
+
+/// Choose the cheapest differentiation mode for a graph with `n_vars`
+/// variables and `n_outputs` outputs. Forward mode costs about one pass per
+/// variable, reverse mode about one pass per output (plus the pass that
+/// computes the values). Never returns GradMode::kAuto.
+GradMode choose_grad_mode(std::size_t n_vars, std::size_t n_outputs) noexcept;
+
+/// The kind of operation performed by an Instruction.
+enum class OpCode : std::uint8_t {
+  kConst,  // the constant at index `op1` in the constant table
+  kVar,    // the variable at index `op1` in the variable table
+  kSum,    // the sum of the results of instructions `op1` and `op2`
+  kMul,    // the product of the results of instructions `op1` and `op2`
+  kSub,    // the result of instruction `op1` minus that of `op2`
+  kDiv,    // the result of instruction `op1` divided by that of `op2`
+  kNeg,    // the opposite of the result of instruction `op1`
+  kPow,    // the result of instruction `op1` to the integer power `op2`,
+           // stored as the bits of an int32
+  kExp,    // the exponential of the result of instruction `op1`
+  kLog,    // the natural logarithm of the result of instruction `op1`
+};
+
+/// The layout of a graph's variables in dense input and gradient vectors:
+/// variable names are mapped to consecutive slots in alphabetical order.
+class VariableLayout {
+  std::vector<std::string> var_names;
+
+ public:
+  VariableLayout() = default;
+
+  /// Build a layout from variable names, which must be sorted and unique.
+  explicit VariableLayout(std::vector<std::string> var_names);
+
+  /// The number of variables (and slots).
+  std::size_t size() const noexcept { return var_names.size(); }
+
+  /// The variable names, in slot order.
+  const std::vector<std::string>& names() const noexcept { return var_names; }
+
+  /// The slot of the variable with the given name, if it is part of the
+  /// layout.
+  std::optional<std::size_t> slot(std::string_view name) const noexcept;
+
+  /// Gather the values of the variables in the layout into a dense vector.
+  /// Inputs that are not part of the layout are ignored.
+  absl::StatusOr<std::vector<float>> bind(const Inputs& inputs) const;
+
+  /// For each variable in the layout, the index of its derivative in
+  /// gradients that have one element per input, in alphabetical order (see
+  /// Graph::eval_grad()). All variables must be part of `inputs`.
+  std::vector<std::size_t> gradient_columns(const Inputs& inputs) const;
+
+  /// Same as bind(const Inputs&), for scalar type `T` (float or double).
+  template <typename T>
+  absl::StatusOr<std::vector<T>> bind(const BasicInputs<T>& inputs) const;
+
+  /// Same as gradient_columns(const Inputs&), for scalar type `T` (float or
+  /// double).
+  template <typename T>
+  std::vector<std::size_t> gradient_columns(
+      const BasicInputs<T>& inputs) const;
+};
+
+/// A subset of variables w.r.t. which a CompiledGraph is differentiated,
+/// produced by CompiledGraph::select(). The selection also records which
+/// instructions depend on the selected variables, so that gradient
+/// evaluations can skip all others. It can only be used with the graph that
+/// produced it.
+class VariableSelection {
+  friend class CompiledGraph;
+
+  static constexpr std::uint32_t kNotSelected = -1;
+
+  /// For each slot of the graph's layout, the gradient column of the
+  /// variable, or kNotSelected.
+  std::vector<std::uint32_t> columns;
+  /// For each instruction, whether it depends on a selected variable.
+  std::vector<bool> depends;
+  std::size_t n_selected = 0;
+
+ public:
+  /// The number of selected variables, i.e. of elements of the gradients.
+  std::size_t size() const noexcept { return n_selected; }
+};
+
+/// A single step of a CompiledGraph.
+/// Operands of operations (all opcodes other than kConst and kVar) always
+/// refer to earlier instructions: see n_operands() in ops.h for how many
+/// each opcode has.
+struct Instruction {
+  OpCode opcode;
+  std::uint32_t op1;
+  std::uint32_t op2;
+};
+
+/// Whether the library was built with GRAPH_AUTODIFF_PROFILING defined, i.e.
+/// whether evaluations record EvalProfiles. With Bazel, profiling is enabled
+/// by building with `--define graph_autodiff_profiling=true`.
+#ifdef GRAPH_AUTODIFF_PROFILING
+inline constexpr bool kProfilingEnabled = true;
+#else
+inline constexpr bool kProfilingEnabled = false;
+#endif
+
+/// Counters recorded by the evaluations that use an EvalContext to which the
+/// profile is attached, see BasicEvalContext::set_profile(). Counters are
+/// accumulated over evaluations until the profile is reset.
+/// Profiles are only recorded if kProfilingEnabled: otherwise the
+/// instrumentation is compiled away and attached profiles are not updated.
+struct EvalProfile {
+  /// The number of instructions of the last graph evaluated.
+  std::size_t tape_size = 0;
+  /// The number of passes over the tape that only computed values.
+  std::uint64_t value_passes = 0;
+  /// The number of passes over the tape that computed derivatives: gradients
+  /// in forward mode, adjoints in reverse mode, second derivatives...
+  std::uint64_t derivative_passes = 0;
+  /// The time spent in value passes and in derivative passes. Forward-mode
+  /// passes compute values and derivatives together: they count as
+  /// derivative passes.
+  std::chrono::nanoseconds value_time{0};
+  std::chrono::nanoseconds derivative_time{0};
+  /// The number of bytes by which the scratch buffers of the EvalContext
+  /// grew. Zero once the context has been used with a graph.
+  std::uint64_t bytes_allocated = 0;
+  /// For each instruction, the number of points at which its value (and
+  /// its derivatives, respectively) were computed. Derivatives w.r.t. a
+  /// VariableSelection are only computed for the instructions that depend on
+  /// the selected variables. These are resized to the tape size if the
+  /// profile is used with a graph of a different size.
+  std::vector<std::uint64_t> value_counts;
+  std::vector<std::uint64_t> derivative_counts;
+
+  /// Reset all counters to zero.
+  void reset() { *this = EvalProfile(); }
+};
+
+/// Scratch buffers for the evaluation of CompiledGraphs.
+/// Evaluations that are passed an EvalContext reuse its buffers instead of
+/// allocating new ones, so once a context has been used with a given graph,
+/// further evaluations of that graph through it perform no heap allocations.
+/// A context can be reused with different graphs, but it must not be used by
+/// several evaluations at the same time: threads that evaluate concurrently
+/// each need their own. Evaluations that are not passed a context use one
+/// that belongs to the calling thread, so they only allocate the first time
+/// a thread evaluates a graph of a given size, and its buffers stay
+/// allocated until the thread exits.
+/// `T` is the scalar type of the evaluations that use the context.
+template <typename T>
+class BasicEvalContext {
+  friend class CompiledGraph;
+  friend class CompiledMultiGraph;
+
+  std::vector<T> values;
+  std::vector<T> adjoints;
+  // the row-major gradient buffer used by forward mode
+  std::vector<T> grads;
+  // sparse forward mode: the nonzero derivatives of instruction i are
+  // sparse_grads[sparse_begin[i]:sparse_begin[i+1]], w.r.t. the variables in
+  // the same range of sparse_slots (sorted)
+  std::vector<std::uint32_t> sparse_begin;
+  std::vector<std::uint32_t> sparse_slots;
+  std::vector<T> sparse_grads;
+  // column-major buffers with one column per instruction and one row per
+  // point, used by batched evaluation
+  std::vector<T> batch_values;
+  std::vector<T> batch_adjoints;
+  // Hessian-vector products: the derivatives of values and adjoints along
+  // the direction of the product
+  std::vector<T> tangents;
+  std::vector<T> adjoint_tangents;
+  // sparse Hessians: the contributions to the lower triangle, not yet summed
+  std::vector<Eigen::Triplet<T>> hessian_terms;
+  EvalProfile* profile = nullptr;
+
+ public:
+  /// Record the evaluations that use this context into `profile`, which
+  /// must outlive them, or stop recording if it is null. Only has an effect
+  /// if kProfilingEnabled.
+  void set_profile(EvalProfile* profile_) noexcept { profile = profile_; }
+
+  /// The current size of the scratch buffers, in bytes.
+  std::size_t buffer_bytes() const noexcept;
+};
+
+using EvalContext = BasicEvalContext<float>;
+
+template <typename T>
+std::size_t BasicEvalContext<T>::buffer_bytes() const noexcept {
+  return sizeof(T) * (values.capacity() + adjoints.capacity() +
+                      grads.capacity() + sparse_grads.capacity() +
+                      batch_values.capacity() + batch_adjoints.capacity() +
+                      tangents.capacity() + adjoint_tangents.capacity()) +
+         sizeof(std::uint32_t) *
+             (sparse_begin.capacity() + sparse_slots.capacity()) +
+         sizeof(Eigen::Triplet<T>) * hessian_terms.capacity();
+}
+
+/// A compute graph lowered to a flat, topologically-sorted instruction tape.
+/// Each node of the original graph appears exactly once in the tape, even if
+/// it is shared by several operations. The last instruction is the result.
+/// CompiledGraph instances are usually produced by Graph::compile().
+///
+/// Thread safety: a CompiledGraph is immutable once built, and evaluating it
+/// does not modify it, so any number of threads can evaluate the same
+/// instance (or copies of it) at the same time without locking. All mutable
+/// state lives in EvalContexts, which must not be shared by concurrent
+/// evaluations: pass each thread its own, or use the overloads without a
+/// context, which use one per thread.
+class CompiledGraph {
+  friend absl::Status to_binary_file(const CompiledGraph& graph,
+                                     fs::path path);
+  friend absl::StatusOr<CompiledGraph> map_binary_file(fs::path path);
+  friend class CompiledMultiGraph;
+
+  /// Owns the memory that `tape`, `constants` and `grad_rows` point to:
+  /// either buffers allocated by the constructor or a memory-mapped file.
+  /// Copies of a CompiledGraph share it.
+  std::shared_ptr<const void> storage;
+  absl::Span<const Instruction> tape;
+  absl::Span<const float> constants;
+  /// The variables used in the graph. The operand of a kVar instruction is
+  /// the variable's slot in this layout.
+  VariableLayout var_layout;
+  /// For each instruction, the row of the gradient buffer that holds its
+  /// gradient during forward-mode evaluation. Rows are reused as soon as the
+  /// instruction that last needs them has executed.
+  absl::Span<const std::uint32_t> grad_rows;
+  std::uint32_t n_grad_rows = 0;
+
+  /// Build a CompiledGraph that views pre-computed tables owned by
+  /// `storage`, without copying them.
+  CompiledGraph(std::shared_ptr<const void> storage,
+                absl::Span<const Instruction> tape,
+                absl::Span<const float> constants, VariableLayout layout,
+                absl::Span<const std::uint32_t> grad_rows,
+                std::uint32_t n_grad_rows);
+
+  // The evaluation engine. Its scalar type `T` is a template parameter: see
+  // the public templates for the supported types.
+
+  /// The kinds of passes over the tape that EvalProfiles distinguish.
+  enum class Pass { kValues, kDerivatives, kValuesAndDerivatives };
+
+  /// Records a pass over the tape into the profile attached to an
+  /// EvalContext, if any, when it goes out of scope. Defined in
+  /// compiled_graph.cpp: it does nothing unless kProfilingEnabled.
+  template <typename T>
+  class ProfileScope;
+
+  /// Evaluate all instructions, filling `ctx.values`.
+  template <typename T>
+  void eval_values(absl::Span<const T> var_values,
+                   BasicEvalContext<T>& ctx) const noexcept;
+
+  /// Evaluate all instructions and their gradients in forward mode, filling
+  /// `ctx.values`. Right after instruction i is evaluated, `visit(i, grad)`
+  /// is called with its gradient, a row of a buffer whose rows are reused
+  /// once no later instruction needs them.
+  template <typename T, typename Visitor>
+  void forward_pass(absl::Span<const T> var_values, BasicEvalContext<T>& ctx,
+                    Visitor&& visit) const noexcept;
+
+  /// Propagate adjoints from instruction `root` back to the variables, given
+  /// the values in `ctx.values`. The derivatives of `root` w.r.t. all
+  /// variables are written into `grad_out`.
+  template <typename T>
+  void reverse_pass(std::size_t root, Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                    BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  T eval_grad_forward(absl::Span<const T> var_values,
+                      Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                      BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  T eval_grad_reverse(absl::Span<const T> var_values,
+                      Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                      BasicEvalContext<T>& ctx) const noexcept;
+
+  /// Sparse forward mode w.r.t. all variables if `selection` is null, or
+  /// w.r.t. the selected ones.
+  template <typename T>
+  T eval_grad_sparse_forward(absl::Span<const T> var_values,
+                             const VariableSelection* selection,
+                             Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                             BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  T eval_grad_forward(absl::Span<const T> var_values,
+                      const VariableSelection& selection,
+                      Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                      BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  T eval_grad_reverse(absl::Span<const T> var_values,
+                      const VariableSelection& selection,
+                      Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+                      BasicEvalContext<T>& ctx) const noexcept;
+
+  /// Evaluate all instructions, filling `ctx.values`, and the derivative of
+  /// the output w.r.t. the result of each of them, filling `ctx.adjoints`.
+  template <typename T>
+  void eval_adjoints(absl::Span<const T> var_values,
+                     BasicEvalContext<T>& ctx) const noexcept;
+
+  /// Fill the sparse derivative buffers of `ctx` with the nonzero
+  /// derivatives of each instruction, given the values in `ctx.values`.
+  /// See eval_grad_sparse_forward() for the meaning of `selection`.
+  template <typename T>
+  void eval_sparse_grads(const VariableSelection* selection,
+                         BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  T eval_hessian_dense(absl::Span<const T> var_values,
+                       Eigen::Ref<Eigen::MatrixX<T>> hess_out,
+                       BasicEvalContext<T>& ctx) const noexcept;
+
+  /// The rows and columns of `hess_out` are the elements of `columns` at the
+  /// variables' slots, and there are `size` of them. If `columns` is null,
+  /// they are the slots themselves.
+  template <typename T>
+  T eval_hessian_sparse(absl::Span<const T> var_values,
+                        const std::vector<std::size_t>* columns,
+                        std::size_t size, Eigen::SparseMatrix<T>& hess_out,
+                        BasicEvalContext<T>& ctx) const;
+
+  template <typename T>
+  T eval_hvp(absl::Span<const T> var_values, absl::Span<const T> v,
+             Eigen::Ref<Eigen::RowVectorX<T>> hvp_out,
+             BasicEvalContext<T>& ctx) const noexcept;
+
+  /// The number of points that batched evaluation processes at once.
+  std::size_t batch_block_size() const noexcept;
+
+  /// The number of points per task of multi-threaded batched evaluation.
+  std::size_t batch_chunk_size(std::size_t n_points,
+                               std::size_t n_threads) const noexcept;
+
+  /// Evaluate all instructions on a block of at most batch_block_size()
+  /// points. Returns a view over the values, one column per instruction.
+  template <typename T>
+  Eigen::Map<Eigen::ArrayXX<T>> eval_values_block(
+      const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,
+      BasicEvalContext<T>& ctx) const noexcept;
+
+ public:
+  /// Build a CompiledGraph from its tape, constant table and variables.
+  /// The tape must be non-empty and topologically sorted.
+  CompiledGraph(std::vector<Instruction> tape, std::vector<float> constants,
+                VariableLayout layout);
+
+  /// Evaluate the graph at the given point.
+  float eval(const Inputs& inputs) const noexcept;
+
+  /// Evaluate the graph at the given point, passed as one value per variable
+  /// in the order given by layout().
+  float eval(absl::Span<const float> inputs) const noexcept;
+
+  /// Same as eval(absl::Span<const float>), using the scratch buffers in
+  /// `ctx`. Performs no heap allocations once `ctx` has been used with this
+  /// graph.
+  float eval(absl::Span<const float> inputs, EvalContext& ctx) const noexcept;
+
+  /// Evaluate the graph and its gradient at the given point.
+  /// See Graph::eval_grad() for the layout of the gradient.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      const Inputs& inputs, GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Evaluate the graph and its gradient at the given point, passed as one
+  /// value per variable in the order given by layout().
+  /// The gradient has the same layout as the inputs. This is the fastest way
+  /// to evaluate gradients: it involves no variable name lookups at all.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      absl::Span<const float> inputs,
+      GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Same as eval_grad(absl::Span<const float>, GradMode), but the gradient
+  /// is written into `grad_out`, which must have one element per variable,
+  /// and the scratch buffers in `ctx` are used. Performs no heap allocations
+  /// once `ctx` has been used with this graph. Returns the graph's value.
+  float eval_grad(absl::Span<const float> inputs,
+                  Eigen::Ref<Eigen::RowVectorXf> grad_out, EvalContext& ctx,
+                  GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Select the variables w.r.t. which to differentiate with the overloads
+  /// of eval_grad() that take a VariableSelection. The gradient elements
+  /// follow the order of `names`, which must be unique. Names that are not
+  /// part of layout() are allowed: the corresponding derivatives are zero.
+  VariableSelection select(absl::Span<const std::string_view> names) const;
+
+  /// Evaluate the graph and its derivatives w.r.t. the variables in
+  /// `selection` at the given point. Only the instructions that depend on
+  /// the selected variables are differentiated.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      const Inputs& inputs, const VariableSelection& selection,
+      GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Same as eval_grad(const Inputs&, const VariableSelection&, GradMode),
+  /// with the inputs passed as one value per variable in the order given by
+  /// layout(). The derivatives are written into `grad_out`, which must have
+  /// one element per selected variable, and the scratch buffers in `ctx` are
+  /// used. Returns the graph's value.
+  float eval_grad(absl::Span<const float> inputs,
+                  const VariableSelection& selection,
+                  Eigen::Ref<Eigen::RowVectorXf> grad_out, EvalContext& ctx,
+                  GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Evaluate the graph and its Hessian at the given point. Rows and columns
+  /// follow the layout of the gradient of eval_grad(const Inputs&, GradMode).
+  /// The Hessian is the sum, over all operations f(a, b) in the tape with
+  /// nonzero second derivatives (products, divisions, powers, exponentials
+  /// and logarithms), of the operation's adjoint times
+  /// `f_aa grad(a)^T grad(a) + f_ab (grad(a)^T grad(b) + grad(b)^T grad(a))
+  /// + f_bb grad(b)^T grad(b)`. It is computed forward-over-reverse: a
+  /// reverse pass computes the adjoints, then a forward pass computes the
+  /// gradients of the operands and adds each operation's term. Only the
+  /// lower triangle is accumulated and it is mirrored at the end. The cost is
+  /// about that of a forward-mode gradient plus a rank-1 or rank-2 update of
+  /// the lower triangle per such operation: see eval_sparse_hessian() for
+  /// graphs with many variables but few nonzero second derivatives.
+  std::pair<float, Eigen::MatrixXf> eval_hessian(
+      const Inputs& inputs) const noexcept;
+
+  /// Same as eval_hessian(const Inputs&), with the inputs passed as one value
+  /// per variable in the order given by layout(). The Hessian is written
+  /// into `hess_out`, which must have one row and one column per variable,
+  /// and the scratch buffers in `ctx` are used. Returns the graph's value.
+  float eval_hessian(absl::Span<const float> inputs,
+                     Eigen::Ref<Eigen::MatrixXf> hess_out,
+                     EvalContext& ctx) const noexcept;
+
+  /// Same as eval_hessian(const Inputs&), but the Hessian is a sparse matrix
+  /// that only stores the nonzero second derivatives. Operand gradients are
+  /// propagated as in GradMode::kSparseForward, so the cost depends on the
+  /// number of nonzero derivatives rather than on the number of variables.
+  std::pair<float, Eigen::SparseMatrix<float>> eval_sparse_hessian(
+      const Inputs& inputs) const;
+
+  /// Same as eval_sparse_hessian(const Inputs&), with the inputs passed as
+  /// one value per variable in the order given by layout(). The Hessian is
+  /// written into `hess_out`, with one row and one column per variable, and
+  /// the scratch buffers in `ctx` are used. Returns the graph's value.
+  float eval_sparse_hessian(absl::Span<const float> inputs,
+                            Eigen::SparseMatrix<float>& hess_out,
+                            EvalContext& ctx) const;
+
+  /// Evaluate the product of the graph's Hessian at the given point and the
+  /// vector `v`, which has the same layout as the gradient of
+  /// eval_grad(const Inputs&, GradMode). The result has the same layout.
+  /// The product is computed forward-over-reverse, without forming the
+  /// Hessian: a forward pass propagates the derivatives of all values along
+  /// `v` and a reverse pass propagates the adjoints together with their
+  /// derivatives along `v`. The cost is about that of two reverse-mode
+  /// gradients, independently of the number of variables.
+  Eigen::RowVectorXf hvp(const Inputs& inputs,
+                         const Eigen::Ref<const Eigen::RowVectorXf>& v) const;
+
+  /// Same as hvp(const Inputs&, const Eigen::Ref<const Eigen::RowVectorXf>&),
+  /// with the inputs and `v` passed as one value per variable in the order
+  /// given by layout(). The product is written into `hvp_out`, which must
+  /// have one element per variable, and the scratch buffers in `ctx` are
+  /// used. Returns the graph's value.
+  float hvp(absl::Span<const float> inputs, absl::Span<const float> v,
+            Eigen::Ref<Eigen::RowVectorXf> hvp_out,
+            EvalContext& ctx) const noexcept;
+
+  /// Evaluate the graph at many points at once.
+  /// `inputs` has one row per point and one column per variable, in the
+  /// order given by layout(). Returns one value per point.
+  /// Each instruction is evaluated on blocks of points at a time with
+  /// vectorized operations.
+  Eigen::VectorXf eval_batch(
+      const Eigen::Ref<const Eigen::MatrixXf>& inputs) const;
+
+  /// Same as eval_batch(const Eigen::Ref<const Eigen::MatrixXf>&), but the
+  /// values are written into `values_out`, which must have one element per
+  /// point, and the scratch buffers in `ctx` are used.
+  void eval_batch(const Eigen::Ref<const Eigen::MatrixXf>& inputs,
+                  Eigen::Ref<Eigen::VectorXf> values_out,
+                  EvalContext& ctx) const noexcept;
+
+  /// Evaluate the graph and its gradient at many points at once.
+  /// `inputs` has one row per point and one column per variable, in the
+  /// order given by layout(). Returns one value per point and a gradient
+  /// matrix with the same shape as `inputs`.
+  /// Gradients are evaluated in reverse mode, on blocks of points at a time
+  /// with vectorized operations.
+  std::pair<Eigen::VectorXf, Eigen::MatrixXf> eval_grad_batch(
+      const Eigen::Ref<const Eigen::MatrixXf>& inputs) const;
+
+  /// Same as eval_grad_batch(const Eigen::Ref<const Eigen::MatrixXf>&), but
+  /// the results are written into `values_out` and `grads_out`, which must
+  /// have the right sizes, and the scratch buffers in `ctx` are used.
+  void eval_grad_batch(const Eigen::Ref<const Eigen::MatrixXf>& inputs,
+                       Eigen::Ref<Eigen::VectorXf> values_out,
+                       Eigen::Ref<Eigen::MatrixXf> grads_out,
+                       EvalContext& ctx) const noexcept;
+
+  // Evaluation with scalar types other than float.
+  // The following templates are the equivalent of the overloads above for
+  // scalar type `T`: inputs, results, gradients and all intermediate values
+  // are of type T, while constants are stored as floats and converted to T.
+  // They are instantiated for float and double, e.g.
+  // `cg.eval_grad<double>(inputs_d, grad_d, ctx_d)`.
+
+  template <typename T>
+  T eval(const BasicInputs<T>& inputs) const noexcept;
+
+  template <typename T>
+  T eval(absl::Span<const T> inputs, BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  std::pair<T, Eigen::RowVectorX<T>> eval_grad(
+      const BasicInputs<T>& inputs,
+      GradMode mode = GradMode::kAuto) const noexcept;
+
+  template <typename T>
+  T eval_grad(absl::Span<const T> inputs,
+              Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+              BasicEvalContext<T>& ctx,
+              GradMode mode = GradMode::kAuto) const noexcept;
+
+  template <typename T>
+  T eval_grad(absl::Span<const T> inputs, const VariableSelection& selection,
+              Eigen::Ref<Eigen::RowVectorX<T>> grad_out,
+              BasicEvalContext<T>& ctx,
+              GradMode mode = GradMode::kAuto) const noexcept;
+
+  template <typename T>
+  void eval_batch(const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,
+                  Eigen::Ref<Eigen::VectorX<T>> values_out,
+                  BasicEvalContext<T>& ctx) const noexcept;
+
+  template <typename T>
+  void eval_grad_batch(const Eigen::Ref<const Eigen::MatrixX<T>>& inputs,
+                       Eigen::Ref<Eigen::VectorX<T>> values_out,
+                       Eigen::Ref<Eigen::MatrixX<T>> grads_out,
+                       BasicEvalContext<T>& ctx) const noexcept;
+
+  /// Same as eval_batch(const Eigen::Ref<const Eigen::MatrixXf>&), but the
+  /// batch is split in chunks that are evaluated in parallel by `pool`.
+  /// Each worker uses its own scratch buffers. Results do not depend on the
+  /// number of threads or on scheduling.
+  Eigen::VectorXf eval_batch(const Eigen::Ref<const Eigen::MatrixXf>& inputs,
+                             ThreadPool& pool) const;
+
+  /// Same as eval_grad_batch(const Eigen::Ref<const Eigen::MatrixXf>&), but
+  /// the batch is split in chunks that are evaluated in parallel by `pool`.
+  /// Each worker uses its own scratch buffers. Results do not depend on the
+  /// number of threads or on scheduling.
+  std::pair<Eigen::VectorXf, Eigen::MatrixXf> eval_grad_batch(
+      const Eigen::Ref<const Eigen::MatrixXf>& inputs, ThreadPool& pool) const;
+
+  absl::Span<const Instruction> instructions() const noexcept { return tape; }
+
+  /// The constants that kConst instructions refer to.
+  absl::Span<const float> constant_table() const noexcept { return constants; }
+
+  /// The variables used in the graph and their slots in dense input and
+  /// gradient vectors.
+  const VariableLayout& layout() const noexcept { return var_layout; }
+};
+
+/// Several compute graphs (outputs) lowered to a single instruction tape, in
+/// which subexpressions shared between outputs appear once.
+/// All outputs are evaluated in one pass over the tape, and their Jacobian
+/// w.r.t. the variables in the cheapest mode for the number of outputs and
+/// variables (see choose_grad_mode()).
+/// CompiledMultiGraph instances are usually produced by MultiGraph::compile().
+/// Like CompiledGraph, it is immutable and can be evaluated by several
+/// threads at the same time.
+class CompiledMultiGraph {
+  CompiledGraph cg;
+  /// The instruction that holds the result of each output.
+  std::vector<std::uint32_t> output_instrs;
+  /// The outputs, sorted by instruction.
+  std::vector<std::uint32_t> output_order;
+
+  void eval_jacobian_forward(absl::Span<const float> inputs,
+                             Eigen::Ref<Eigen::VectorXf> values_out,
+                             Eigen::Ref<Eigen::MatrixXf> jac_out,
+                             EvalContext& ctx) const noexcept;
+
+  void eval_jacobian_sparse_forward(absl::Span<const float> inputs,
+                                    Eigen::Ref<Eigen::VectorXf> values_out,
+                                    Eigen::Ref<Eigen::MatrixXf> jac_out,
+                                    EvalContext& ctx) const noexcept;
+
+  void eval_jacobian_reverse(absl::Span<const float> inputs,
+                             Eigen::Ref<Eigen::VectorXf> values_out,
+                             Eigen::Ref<Eigen::MatrixXf> jac_out,
+                             EvalContext& ctx) const noexcept;
+
+ public:
+  /// Build a CompiledMultiGraph from a tape and the index of the instruction
+  /// that holds each output. The last instruction of the tape must be one of
+  /// the outputs.
+  CompiledMultiGraph(CompiledGraph graph, std::vector<std::uint32_t> outputs);
+
+  /// The number of outputs.
+  std::size_t n_outputs() const noexcept { return output_instrs.size(); }
+
+  /// Evaluate all outputs at the given point.
+  Eigen::VectorXf eval(const Inputs& inputs) const noexcept;
+
+  /// Same as eval(const Inputs&), with the inputs passed as one value per
+  /// variable in the order given by layout(). The values are written into
+  /// `values_out`, which must have one element per output, and the scratch
+  /// buffers in `ctx` are used.
+  void eval(absl::Span<const float> inputs,
+            Eigen::Ref<Eigen::VectorXf> values_out,
+            EvalContext& ctx) const noexcept;
+
+  /// Evaluate all outputs and their Jacobian at the given point. The
+  /// Jacobian has one row per output and one column per input, in
+  /// alphabetical order as for the gradient of Graph::eval_grad().
+  /// By default the mode is picked by choose_grad_mode(): forward and sparse
+  /// forward mode compute all rows in a single pass, reverse mode needs one
+  /// pass per output.
+  std::pair<Eigen::VectorXf, Eigen::MatrixXf> eval_jacobian(
+      const Inputs& inputs, GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Same as eval_jacobian(const Inputs&, GradMode), with the inputs passed
+  /// as one value per variable in the order given by layout(). The values
+  /// and the Jacobian are written into `values_out` and `jac_out`, which
+  /// must have one row per output (and one column per variable), and the
+  /// scratch buffers in `ctx` are used.
+  void eval_jacobian(absl::Span<const float> inputs,
+                     Eigen::Ref<Eigen::VectorXf> values_out,
+                     Eigen::Ref<Eigen::MatrixXf> jac_out, EvalContext& ctx,
+                     GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// The shared instruction tape.
+  absl::Span<const Instruction> instructions() const noexcept {
+    return cg.instructions();
+  }
+
+  /// The index of the instruction that holds each output.
+  absl::Span<const std::uint32_t> outputs() const noexcept {
+    return output_instrs;
+  }
+
+  /// The variables used by any of the outputs and their slots in dense
+  /// inputs and Jacobian columns.
+  const VariableLayout& layout() const noexcept { return cg.layout(); }
+};
+
+/// Write a compiled graph to a binary file that map_binary_file() can load
+/// without deserialization. The file contains the instruction tape, the
+/// constants and the other tables needed for evaluation, each aligned so
+/// that it can be used in place. The format is specific to the byte order
+/// of the machine that writes it.
+absl::Status to_binary_file(const CompiledGraph& graph, fs::path path);
+
+/// Load a file written by to_binary_file() by mapping it into memory.
+/// Only the header and variable names are read eagerly: the instructions
+/// and constants are used directly from the mapped pages, so loading time
+/// and memory use do not depend on the size of the graph but on the parts
+/// of the file that evaluations touch. The contents of the tables are not
+/// validated, so only files from trusted sources should be loaded.
+absl::StatusOr<CompiledGraph> map_binary_file(fs::path path);
+
+}  // namespace graph_autodiff
@@ -0,0 +1,575 @@
+#include "graph_autodiff/compiled_graph.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cmath>  // std::abs
+#include <cstddef>  // std::size_t
+#include <cstdlib>  // std::malloc, std::free
+#include <filesystem>
+#include <new>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+// Eigen allocates with malloc rather than operator new: allocations are only
+// caught with its runtime checks, see the graph_autodiff_malloc_checks target
+#ifndef EIGEN_RUNTIME_NO_MALLOC
+#error "compiled_graph_test requires EIGEN_RUNTIME_NO_MALLOC"
+#endif
+
+// count heap allocations, to check that evaluations do not perform any
+static std::atomic<std::size_t> n_allocations = 0;
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC does not realize that the replacements below are a matching pair
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size) {
+  ++n_allocations;
+  if (void *p = std::malloc(size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+TEST(CompiledGraph, SharedNodesAreLoweredOnce) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph xy = x * y;
+  const Graph g = xy + xy;
+
+  const CompiledGraph cg = g.compile();
+  // x, y, x*y, xy + xy
+  ASSERT_EQ(cg.instructions().size(), 4);
+  EXPECT_EQ(cg.instructions().back().opcode, OpCode::kSum);
+  EXPECT_EQ(cg.instructions().back().op1, cg.instructions().back().op2);
+
+  const auto &[value, grads] = cg.eval_grad({{"x", 2.}, {"y", 3.}});
+  EXPECT_FLOAT_EQ(value, 12.);
+  EXPECT_FLOAT_EQ(grads(0), 6.);
+  EXPECT_FLOAT_EQ(grads(1), 4.);
+}
+
+TEST(CompiledGraph, VariablesAreSorted) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Graph g = z + y * x;
+
+  const CompiledGraph cg = g.compile();
+  const std::vector<std::string> expected{"x", "y", "z"};
+  EXPECT_EQ(cg.layout().names(), expected);
+  EXPECT_EQ(cg.layout().slot("y"), 1);
+  EXPECT_EQ(cg.layout().slot("w"), std::nullopt);
+}
+
+TEST(CompiledGraph, DenseInputs) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = y * x * x;
+
+  const CompiledGraph cg = g.compile();
+  const std::vector<float> inputs{2., 3.};  // x, y
+  EXPECT_FLOAT_EQ(cg.eval(inputs), 12.);
+  for (GradMode mode : {GradMode::kForward, GradMode::kReverse,
+                        GradMode::kSparseForward}) {
+    const auto &[value, grads] = cg.eval_grad(inputs, mode);
+    EXPECT_FLOAT_EQ(value, 12.);
+    ASSERT_EQ(grads.size(), 2);
+    EXPECT_FLOAT_EQ(grads(0), 12.);
+    EXPECT_FLOAT_EQ(grads(1), 4.);
+  }
+}
+
+TEST(CompiledGraph, BindInputs) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const VariableLayout layout = (x + y).compile().layout();
+
+  const absl::StatusOr<std::vector<float>> values =
+      layout.bind({{"y", 2.}, {"x", 1.}, {"z", 3.}});
+  ASSERT_TRUE(values.ok());
+  EXPECT_EQ(*values, std::vector<float>({1., 2.}));
+
+  EXPECT_FALSE(layout.bind({{"x", 1.}}).ok());
+}
+
+TEST(CompiledGraph, GradientCoversAllInputs) {
+  const Var x{"x"};
+  const Graph g = x * x;
+
+  // "a" does not appear in the graph but still gets a gradient element
+  const auto &[value, grads] = g.compile().eval_grad({{"x", 3.}, {"a", 1.}});
+  EXPECT_FLOAT_EQ(value, 9.);
+  ASSERT_EQ(grads.size(), 2);
+  EXPECT_FLOAT_EQ(grads(0), 0.);
+  EXPECT_FLOAT_EQ(grads(1), 6.);
+}
+
+TEST(CompiledGraph, LongChain) {
+  const Var x{"x"};
+  const Const c{1.};
+  Graph g = x + c;
+  for (int i = 0; i < 1000; ++i) g = g * x + c;
+
+  // g(1) = 1002, dg/dx(1) = sum_{i=1}^{1001} i
+  const auto &[value, grads] = g.compile().eval_grad({{"x", 1.}});
+  EXPECT_FLOAT_EQ(value, 1002.);
+  EXPECT_FLOAT_EQ(grads(0), 1001. * 1002. / 2.);
+}
+
+TEST(CompiledGraph, ForwardAndReverseModeAgree) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{10.};
+  const Graph xy = x * y;
+  const Graph g = x * xy + xy * z + c * z * (x + y) + c;
+
+  const CompiledGraph cg = g.compile();
+  const Inputs inputs = {{"x", 2.}, {"y", 3.}, {"z", 4.}, {"w", 5.}};
+  const auto &[fvalue, fgrads] = cg.eval_grad(inputs, GradMode::kForward);
+  const auto &[rvalue, rgrads] = cg.eval_grad(inputs, GradMode::kReverse);
+  const auto &[svalue, sgrads] =
+      cg.eval_grad(inputs, GradMode::kSparseForward);
+
+  EXPECT_FLOAT_EQ(fvalue, rvalue);
+  EXPECT_FLOAT_EQ(svalue, rvalue);
+  ASSERT_EQ(fgrads.size(), 4);
+  ASSERT_EQ(rgrads.size(), 4);
+  ASSERT_EQ(sgrads.size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_FLOAT_EQ(fgrads(i), rgrads(i));
+    EXPECT_FLOAT_EQ(sgrads(i), rgrads(i));
+  }
+  EXPECT_FLOAT_EQ(rgrads(0), 0.);  // w does not appear in the graph
+}
+
+TEST(CompiledGraph, SparseForwardModeOnWideGraph) {
+  // a sum of many products of neighboring variables: each product depends on
+  // two of the variables only
+  std::vector<Var> vars;
+  for (int i = 0; i < 100; ++i)
+    vars.emplace_back("x" + std::to_string(1000 + i));
+  Graph g = vars[0] * vars[1];
+  for (int i = 1; i < 99; ++i) g = g + vars[i] * vars[i + 1];
+
+  const CompiledGraph cg = g.compile();
+  std::vector<float> inputs(100);
+  for (int i = 0; i < 100; ++i) inputs[i] = float(i);
+
+  const auto &[svalue, sgrads] =
+      cg.eval_grad(inputs, GradMode::kSparseForward);
+  const auto &[rvalue, rgrads] = cg.eval_grad(inputs, GradMode::kReverse);
+  EXPECT_FLOAT_EQ(svalue, rvalue);
+  for (int i = 0; i < 100; ++i) EXPECT_FLOAT_EQ(sgrads(i), rgrads(i));
+  // d/dx_i = x_{i-1} + x_{i+1}
+  EXPECT_FLOAT_EQ(sgrads(0), 1.);
+  EXPECT_FLOAT_EQ(sgrads(50), 49. + 51.);
+  EXPECT_FLOAT_EQ(sgrads(99), 98.);
+}
+
+TEST(CompiledGraph, SelectedGradient) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{10.};
+  const Graph g = x * x * y + c * z * (x + y) + z * z;
+
+  const CompiledGraph cg = g.compile();
+  const std::vector<float> inputs{2., 3., 4.};  // x, y, z
+  const auto &[value, full_grads] = cg.eval_grad(inputs);
+
+  // derivatives w.r.t. z and y, in this order, and w.r.t. a variable that
+  // does not appear in the graph
+  const VariableSelection selection = cg.select({"z", "w", "y"});
+  ASSERT_EQ(selection.size(), 3);
+  Eigen::RowVectorXf grads(3);
+  EvalContext ctx;
+  for (GradMode mode : {GradMode::kAuto, GradMode::kForward, GradMode::kReverse,
+                        GradMode::kSparseForward}) {
+    EXPECT_FLOAT_EQ(cg.eval_grad(inputs, selection, grads, ctx, mode), value);
+    EXPECT_FLOAT_EQ(grads(0), full_grads(2));
+    EXPECT_FLOAT_EQ(grads(1), 0.);
+    EXPECT_FLOAT_EQ(grads(2), full_grads(1));
+  }
+
+  // no selected variable: all derivatives are zero
+  const VariableSelection none = cg.select({"w"});
+  for (GradMode mode :
+       {GradMode::kForward, GradMode::kReverse, GradMode::kSparseForward}) {
+    Eigen::RowVectorXf grad(1);
+    EXPECT_FLOAT_EQ(cg.eval_grad(inputs, none, grad, ctx, mode), value);
+    EXPECT_FLOAT_EQ(grad(0), 0.);
+  }
+}
+
+TEST(CompiledGraph, ChooseGradMode) {
+  EXPECT_EQ(choose_grad_mode(1, 1), GradMode::kForward);
+  EXPECT_EQ(choose_grad_mode(2, 10), GradMode::kForward);
+  EXPECT_EQ(choose_grad_mode(1000, 1), GradMode::kReverse);
+}
+
+TEST(CompiledGraph, NoAllocationsWithEvalContext) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{10.};
+  const Graph g = x * x * x * y + x * y * z + c * z * (x + y) + c;
+
+  const CompiledGraph cg = g.compile();
+  const std::vector<float> inputs{2., 3., 4.};
+  Eigen::RowVectorXf grads(3);
+  EvalContext ctx;
+
+  // the first evaluations size the buffers in ctx...
+  for (GradMode mode : {GradMode::kForward, GradMode::kReverse,
+                        GradMode::kSparseForward})
+    cg.eval_grad(inputs, grads, ctx, mode);
+  Eigen::MatrixXf hess(3, 3);
+  cg.eval_hessian(inputs, hess, ctx);
+  cg.hvp(inputs, inputs, grads, ctx);
+
+  // ...then no further allocations should happen, neither via operator new
+  // nor via Eigen, which asserts if it allocates
+  const std::size_t n_allocations_before = n_allocations;
+  Eigen::internal::set_is_malloc_allowed(false);
+  for (int i = 0; i < 10; ++i) {
+    for (GradMode mode : {GradMode::kForward, GradMode::kReverse,
+                        GradMode::kSparseForward}) {
+      EXPECT_FLOAT_EQ(cg.eval_grad(inputs, grads, ctx, mode), 258.);
+      EXPECT_FLOAT_EQ(grads(0), 88.);
+      EXPECT_FLOAT_EQ(grads(1), 56.);
+      EXPECT_FLOAT_EQ(grads(2), 56.);
+    }
+    EXPECT_FLOAT_EQ(cg.eval(inputs, ctx), 258.);
+    EXPECT_FLOAT_EQ(cg.eval_hessian(inputs, hess, ctx), 258.);
+    EXPECT_FLOAT_EQ(cg.hvp(inputs, inputs, grads, ctx), 258.);
+  }
+  Eigen::internal::set_is_malloc_allowed(true);
+  EXPECT_EQ(n_allocations - n_allocations_before, 0);
+}
+
+TEST(CompiledGraph, Profile) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Graph g = x * y + z;
+  const CompiledGraph cg = g.compile();
+  const std::vector<float> inputs{2., 3., 4.};
+
+  EvalProfile profile;
+  EvalContext ctx;
+  ctx.set_profile(&profile);
+  EXPECT_FLOAT_EQ(cg.eval(inputs, ctx), 10.);
+  Eigen::RowVectorXf grad(1);
+  const std::string_view wrt[] = {"z"};
+  cg.eval_grad(inputs, cg.select(wrt), grad, ctx, GradMode::kReverse);
+  Eigen::VectorXf values(2);
+  cg.eval_batch(Eigen::MatrixXf::Ones(2, 3), values, ctx);
+
+  if constexpr (!kProfilingEnabled) {
+    // the instrumentation is compiled away: the rest of this test runs in
+    // compiled_graph_profiling_test
+    EXPECT_EQ(profile.tape_size, 0);
+    EXPECT_EQ(profile.value_passes + profile.derivative_passes, 0);
+    return;
+  }
+
+  // x, y, z, x*y, x*y + z
+  ASSERT_EQ(profile.tape_size, 5);
+  EXPECT_EQ(profile.value_passes, 3);
+  EXPECT_EQ(profile.derivative_passes, 1);
+  EXPECT_GT(profile.bytes_allocated, 0);
+  // one point in each of eval and eval_grad, two in eval_batch
+  for (std::uint64_t count : profile.value_counts) EXPECT_EQ(count, 4);
+  // only z and the result depend on z
+  for (std::size_t i = 0; i < cg.instructions().size(); ++i) {
+    const Instruction &instr = cg.instructions()[i];
+    const bool is_z = instr.opcode == OpCode::kVar && instr.op1 == 2;
+    const bool is_root = i + 1 == cg.instructions().size();
+    EXPECT_EQ(profile.derivative_counts[i], is_z || is_root ? 1 : 0);
+  }
+
+  // no more allocations once the context has been used
+  profile.reset();
+  cg.eval(inputs, ctx);
+  EXPECT_EQ(profile.value_passes, 1);
+  EXPECT_EQ(profile.bytes_allocated, 0);
+}
+
+TEST(CompiledGraph, BatchedEvaluation) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{10.};
+  const Graph xy = x * y;
+  const Graph g = x * xy + xy * z + c * z * (x + y) + c;
+  const CompiledGraph cg = g.compile();
+
+  // more points than fit in a single block
+  const Eigen::MatrixXf inputs = Eigen::MatrixXf::Random(1000, 3);
+  const Eigen::VectorXf values = cg.eval_batch(inputs);
+  const auto &[grad_values, grads] = cg.eval_grad_batch(inputs);
+  ASSERT_EQ(values.size(), 1000);
+  ASSERT_EQ(grad_values.size(), 1000);
+  ASSERT_EQ(grads.rows(), 1000);
+  ASSERT_EQ(grads.cols(), 3);
+
+  for (Eigen::Index i = 0; i < inputs.rows(); ++i) {
+    const std::vector<float> point{inputs(i, 0), inputs(i, 1), inputs(i, 2)};
+    const auto &[value, grad] = cg.eval_grad(point);
+    EXPECT_FLOAT_EQ(values(i), value);
+    EXPECT_FLOAT_EQ(grad_values(i), value);
+    for (int j = 0; j < 3; ++j) EXPECT_FLOAT_EQ(grads(i, j), grad(j));
+  }
+}
+
+TEST(CompiledGraph, Hessian) {
+  const Var w{"w"};
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{3.};
+  // w is an input that does not appear in the graph
+  const Graph g = x * x * y + y * z + c * x * z;
+  const CompiledGraph cg = g.compile();
+  const Inputs inputs = {{"w", 1.}, {"x", 2.}, {"y", 3.}, {"z", 4.}};
+
+  // (d2g/dx2, d2g/dxdy, d2g/dxdz) = (2y, 2x, c), d2g/dydz = 1
+  Eigen::MatrixXf expected(4, 4);
+  expected << 0., 0., 0., 0.,  //
+      0., 6., 4., 3.,          //
+      0., 4., 0., 1.,          //
+      0., 3., 1., 0.;
+
+  const auto &[value, hess] = cg.eval_hessian(inputs);
+  EXPECT_FLOAT_EQ(value, 48.);
+  EXPECT_EQ(hess, expected);
+
+  const auto &[sparse_value, sparse_hess] = cg.eval_sparse_hessian(inputs);
+  EXPECT_FLOAT_EQ(sparse_value, 48.);
+  EXPECT_EQ(sparse_hess.nonZeros(), 7);
+  EXPECT_EQ(Eigen::MatrixXf(sparse_hess), expected);
+
+  const Eigen::RowVectorXf v{{5., 1., 2., 3.}};
+  const Eigen::RowVectorXf hv = cg.hvp(inputs, v);
+  EXPECT_EQ(hv, v * expected);
+}
+
+TEST(CompiledGraph, HessianMethodsAgree) {
+  std::vector<Var> vars;
+  for (int i = 0; i < 6; ++i) vars.emplace_back("x" + std::to_string(i));
+  Graph g = vars[0] * vars[1];
+  for (int i = 1; i < 20; ++i)
+    g = g * vars[i % 6] + vars[(3 * i) % 6] * Const(0.5f) * vars[i % 4];
+
+  const CompiledGraph cg = g.compile();
+  const std::vector<float> inputs{0.9, -1.1, 1.2, 0.8, -0.7, 1.05};
+  EvalContext ctx;
+  Eigen::MatrixXf hess(6, 6);
+  const float value = cg.eval_hessian(inputs, hess, ctx);
+  EXPECT_FLOAT_EQ(value, cg.eval(inputs));
+  EXPECT_TRUE(hess.isApprox(hess.transpose()));
+
+  Eigen::SparseMatrix<float> sparse_hess;
+  EXPECT_FLOAT_EQ(cg.eval_sparse_hessian(inputs, sparse_hess, ctx), value);
+  EXPECT_TRUE(Eigen::MatrixXf(sparse_hess).isApprox(hess));
+
+  // each Hessian-vector product with a unit vector is a column
+  std::vector<float> v(6, 0.);
+  Eigen::RowVectorXf hv(6);
+  for (int j = 0; j < 6; ++j) {
+    v.assign(6, 0.);
+    v[j] = 1.;
+    EXPECT_FLOAT_EQ(cg.hvp(inputs, v, hv, ctx), value);
+    EXPECT_TRUE(hv.isApprox(hess.col(j).transpose())) << "column " << j;
+  }
+
+  // the Hessian is the Jacobian of the gradient
+  const float eps = 1e-2;
+  Eigen::RowVectorXf grad_plus(6);
+  Eigen::RowVectorXf grad_minus(6);
+  std::vector<float> shifted = inputs;
+  for (int j = 0; j < 6; ++j) {
+    shifted[j] = inputs[j] + eps;
+    cg.eval_grad(shifted, grad_plus, ctx);
+    shifted[j] = inputs[j] - eps;
+    cg.eval_grad(shifted, grad_minus, ctx);
+    shifted[j] = inputs[j];
+    for (int i = 0; i < 6; ++i)
+      EXPECT_NEAR((grad_plus[i] - grad_minus[i]) / (2 * eps), hess(i, j),
+                  1e-2 * (1. + std::abs(hess(i, j))));
+  }
+}
+
+TEST(CompiledGraph, OtherOps) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Graph xy = x * y;
+  const Graph g = exp(-xy) / pow(x - z, 3) + log(xy + Const(2.f)) * z -
+                  pow(y, -2) + sum({x + y, z * z, xy});
+  const CompiledGraph cg = g.compile();
+  const std::vector<float> inputs{0.7, -1.3, 2.1};
+
+  // all gradient modes agree with finite differences
+  const float value = cg.eval(inputs);
+  const float eps = 1e-2;
+  std::vector<float> shifted = inputs;
+  for (GradMode mode : {GradMode::kForward, GradMode::kReverse,
+                        GradMode::kSparseForward}) {
+    const auto &[mode_value, grads] = cg.eval_grad(inputs, mode);
+    EXPECT_FLOAT_EQ(mode_value, value);
+    for (int j = 0; j < 3; ++j) {
+      shifted[j] = inputs[j] + eps;
+      const float plus = cg.eval(shifted);
+      shifted[j] = inputs[j] - eps;
+      const float minus = cg.eval(shifted);
+      shifted[j] = inputs[j];
+      EXPECT_NEAR((plus - minus) / (2 * eps), grads(j),
+                  1e-2 * (1. + std::abs(grads(j))));
+    }
+  }
+
+  // second-order methods agree with each other and with the gradient
+  EvalContext ctx;
+  Eigen::MatrixXf hess(3, 3);
+  EXPECT_FLOAT_EQ(cg.eval_hessian(inputs, hess, ctx), value);
+  EXPECT_TRUE(hess.isApprox(hess.transpose()));
+  Eigen::SparseMatrix<float> sparse_hess;
+  cg.eval_sparse_hessian(inputs, sparse_hess, ctx);
+  EXPECT_TRUE(Eigen::MatrixXf(sparse_hess).isApprox(hess));
+  std::vector<float> v(3, 0.);
+  Eigen::RowVectorXf hv(3);
+  Eigen::RowVectorXf grad_plus(3);
+  Eigen::RowVectorXf grad_minus(3);
+  for (int j = 0; j < 3; ++j) {
+    v.assign(3, 0.);
+    v[j] = 1.;
+    cg.hvp(inputs, v, hv, ctx);
+    EXPECT_TRUE(hv.isApprox(hess.col(j).transpose())) << "column " << j;
+
+    shifted[j] = inputs[j] + eps;
+    cg.eval_grad(shifted, grad_plus, ctx);
+    shifted[j] = inputs[j] - eps;
+    cg.eval_grad(shifted, grad_minus, ctx);
+    shifted[j] = inputs[j];
+    for (int i = 0; i < 3; ++i)
+      EXPECT_NEAR((grad_plus[i] - grad_minus[i]) / (2 * eps), hess(i, j),
+                  1e-2 * (1. + std::abs(hess(i, j))));
+  }
+
+  // batches
+  Eigen::MatrixXf batch(2, 3);
+  batch << 0.7, -1.3, 2.1, 1.5, 0.4, -0.6;
+  const auto &[batch_values, batch_grads] = cg.eval_grad_batch(batch);
+  for (Eigen::Index i = 0; i < batch.rows(); ++i) {
+    const std::vector<float> point{batch(i, 0), batch(i, 1), batch(i, 2)};
+    const auto &[point_value, point_grad] = cg.eval_grad(point);
+    EXPECT_FLOAT_EQ(batch_values(i), point_value);
+    for (int j = 0; j < 3; ++j)
+      EXPECT_FLOAT_EQ(batch_grads(i, j), point_grad(j));
+  }
+
+  // binary format
+  ASSERT_TRUE(to_binary_file(cg, "other_ops_test.cg").ok());
+  const absl::StatusOr<CompiledGraph> mapped =
+      map_binary_file("other_ops_test.cg");
+  ASSERT_TRUE(mapped.ok()) << mapped.status();
+  EXPECT_FLOAT_EQ(mapped->eval(inputs), value);
+}
+
+TEST(CompiledGraph, DoublePrecision) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x * y + x * x + y;
+  const CompiledGraph cg = g.compile();
+
+  // exact in double precision, but 1e7 + 1 is not representable as a float
+  const BasicInputs<double> inputs = {{"x", 1e7}, {"y", 1.}};
+  EXPECT_EQ(cg.eval(inputs), 1e14 + 1e7 + 1.);
+  EXPECT_EQ(g.eval(inputs), 1e14 + 1e7 + 1.);
+  for (GradMode mode : {GradMode::kForward, GradMode::kReverse,
+                        GradMode::kSparseForward}) {
+    const auto &[value, grads] = cg.eval_grad(inputs, mode);
+    EXPECT_EQ(value, 1e14 + 1e7 + 1.);
+    ASSERT_EQ(grads.size(), 2);
+    EXPECT_EQ(grads(0), 2e7 + 1.);  // y + 2x
+    EXPECT_EQ(grads(1), 1e7 + 1.);  // x + 1
+  }
+
+  // dense inputs and selections
+  BasicEvalContext<double> ctx;
+  const std::vector<double> dense{1e7, 1.};
+  EXPECT_EQ(cg.eval<double>(dense, ctx), 1e14 + 1e7 + 1.);
+  const std::string_view wrt[] = {"y"};
+  const VariableSelection selection = cg.select(wrt);
+  Eigen::RowVectorXd grad(1);
+  cg.eval_grad<double>(dense, selection, grad, ctx);
+  EXPECT_EQ(grad(0), 1e7 + 1.);
+
+  // batches
+  const Eigen::MatrixXd points{{1e7, 1.}, {1., 1e7}};
+  Eigen::VectorXd values(2);
+  Eigen::MatrixXd grads(2, 2);
+  cg.eval_grad_batch<double>(points, values, grads, ctx);
+  EXPECT_EQ(values(0), 1e14 + 1e7 + 1.);
+  EXPECT_EQ(values(1), 1e7 + 1. + 1e7);
+  EXPECT_EQ(grads(0, 0), 2e7 + 1.);
+  EXPECT_EQ(grads(1, 1), 2.);
+}
+
+TEST(CompiledGraph, BinaryFile) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{10.};
+  const Graph g = x * x * y + c * z * (x + y) + c;
+  const CompiledGraph cg = g.compile();
+  ASSERT_TRUE(to_binary_file(cg, "binary_test.cg").ok());
+
+  const absl::StatusOr<CompiledGraph> mapped =
+      map_binary_file("binary_test.cg");
+  ASSERT_TRUE(mapped.ok()) << mapped.status();
+  EXPECT_EQ(mapped->layout().names(), cg.layout().names());
+  ASSERT_EQ(mapped->instructions().size(), cg.instructions().size());
+
+  const std::vector<float> inputs{2., 3., 4.};
+  EXPECT_FLOAT_EQ(mapped->eval(inputs), cg.eval(inputs));
+  for (GradMode mode : {GradMode::kForward, GradMode::kReverse}) {
+    const auto &[value, grads] = cg.eval_grad(inputs, mode);
+    const auto &[mapped_value, mapped_grads] = mapped->eval_grad(inputs, mode);
+    EXPECT_FLOAT_EQ(mapped_value, value);
+    for (int i = 0; i < 3; ++i) EXPECT_FLOAT_EQ(mapped_grads(i), grads(i));
+  }
+
+  // copies share the mapping, which outlives the original
+  std::optional<CompiledGraph> copy;
+  {
+    const absl::StatusOr<CompiledGraph> tmp = map_binary_file("binary_test.cg");
+    ASSERT_TRUE(tmp.ok());
+    copy = *tmp;
+  }
+  EXPECT_FLOAT_EQ(copy->eval(inputs), cg.eval(inputs));
+}
+
+TEST(CompiledGraph, InvalidBinaryFile) {
+  EXPECT_EQ(map_binary_file("does_not_exist.cg").status().code(),
+            absl::StatusCode::kInvalidArgument);
+
+  const Var x{"x"};
+  const Graph g = x * x;
+  ASSERT_TRUE(to_binary_file(g.compile(), "truncated_test.cg").ok());
+  const std::uintmax_t size = std::filesystem::file_size("truncated_test.cg");
+  std::filesystem::resize_file("truncated_test.cg", size - 1);
+  EXPECT_EQ(map_binary_file("truncated_test.cg").status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
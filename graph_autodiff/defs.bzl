@@ -0,0 +1,33 @@
+"""Build rules that generate C++ code from serialized compute graphs."""
+
+def graph_autodiff_cc_library(name, src, namespace = None, **kwargs):
+    """A header-only C++ library that evaluates a compute graph.
+
+    The graph is read from `src`, a file written by `graph_autodiff::to_file`,
+    and translated at build time into straight-line code with a fixed-size
+    `Eigen::Matrix<float, 1, N>` gradient. See `generate_header` in
+    graph_autodiff/codegen.h for the generated API.
+
+    Args:
+      name: the name of the library. The generated header is `<name>.h`.
+      src: the serialized graph.
+      namespace: the C++ namespace of the generated code. Defaults to `name`.
+      **kwargs: passed to the underlying cc_library, e.g. `visibility`.
+    """
+    header = name + ".h"
+    native.genrule(
+        name = name + "_codegen",
+        srcs = [src],
+        outs = [header],
+        cmd = "$(location {tool}) $< $@ {ns}".format(
+            tool = Label("//graph_autodiff:codegen"),
+            ns = namespace or name,
+        ),
+        tools = [Label("//graph_autodiff:codegen")],
+    )
+    native.cc_library(
+        name = name,
+        hdrs = [header],
+        deps = [Label("@eigen//:eigen")],
+        **kwargs
+    )
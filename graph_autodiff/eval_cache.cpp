@@ -0,0 +1,121 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "eval_cache.h"
+
+#include <algorithm>  // std::min
+#include <cassert>
+#include <utility>  // std::move
+
+#include "absl/status/statusor.h"
+#include "graph_autodiff/fail.h"
+
+using namespace graph_autodiff;
+
+namespace {
+/// The bytes of a point's inputs, by which it is looked up.
+std::string_view as_key(absl::Span<const float> inputs) {
+  return {reinterpret_cast<const char*>(inputs.data()),
+          inputs.size() * sizeof(float)};
+}
+}  // end of anonymous namespace
+
+EvalCache::EvalCache(CompiledGraph graph_, EvalCacheOptions options)
+    : cg(std::move(graph_)) {
+  using IndexSlot = std::pair<std::string_view, std::list<Entry>::iterator>;
+  // the inputs and gradient, a list node (two pointers and the entry) and
+  // an index slot
+  bytes_per_entry = 2 * cg.layout().size() * sizeof(float) +
+                    2 * sizeof(void*) + sizeof(Entry) + sizeof(IndexSlot);
+  capacity = std::min(options.max_entries, options.max_bytes / bytes_per_entry);
+}
+
+bool EvalCache::lookup(absl::Span<const float> inputs, float& value,
+                       Eigen::Ref<Eigen::RowVectorXf> grad_out) {
+  const std::lock_guard<std::mutex> lock(mutex);
+  const auto it = index.find(as_key(inputs));
+  if (it == index.end()) {
+    ++counters.misses;
+    return false;
+  }
+  ++counters.hits;
+  entries.splice(entries.begin(), entries, it->second);
+  value = it->second->value;
+  grad_out = it->second->grad;
+  return true;
+}
+
+void EvalCache::insert(absl::Span<const float> inputs, float value,
+                       Eigen::RowVectorXf grad) {
+  if (capacity == 0) return;
+  // the entry is built before taking the lock, and spliced in under it
+  std::list<Entry> node;
+  node.push_back({std::vector<float>(inputs.begin(), inputs.end()), value,
+                  std::move(grad)});
+
+  const std::lock_guard<std::mutex> lock(mutex);
+  // another thread might have cached the same point in the meantime
+  if (index.contains(as_key(inputs))) return;
+  while (entries.size() >= capacity) {
+    index.erase(as_key(entries.back().inputs));
+    entries.pop_back();
+    ++counters.evictions;
+  }
+  entries.splice(entries.begin(), node);
+  index.emplace(as_key(entries.front().inputs), entries.begin());
+}
+
+float EvalCache::eval_grad(absl::Span<const float> inputs,
+                           Eigen::Ref<Eigen::RowVectorXf> grad_out) {
+  assert(inputs.size() == cg.layout().size());
+  assert(std::size_t(grad_out.size()) == cg.layout().size());
+  float value;
+  if (lookup(inputs, value, grad_out)) return value;
+
+  // evaluated without holding the lock
+  auto [new_value, grad] = cg.eval_grad(inputs);
+  grad_out = grad;
+  insert(inputs, new_value, std::move(grad));
+  return new_value;
+}
+
+std::pair<float, Eigen::RowVectorXf> EvalCache::eval_grad(
+    absl::Span<const float> inputs) {
+  Eigen::RowVectorXf grads(cg.layout().size());
+  const float value = eval_grad(inputs, grads);
+  return {value, grads};
+}
+
+std::pair<float, Eigen::RowVectorXf> EvalCache::eval_grad(
+    const Inputs& inputs) {
+  const absl::StatusOr<std::vector<float>> var_values =
+      cg.layout().bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  const auto [value, var_grads] = eval_grad(*var_values);
+
+  // derivatives w.r.t. inputs that do not appear in the graph are zero
+  Eigen::RowVectorXf grads = Eigen::RowVectorXf::Zero(inputs.size());
+  const std::vector<std::size_t> grad_cols =
+      cg.layout().gradient_columns(inputs);
+  for (std::size_t i = 0; i < grad_cols.size(); ++i)
+    grads[grad_cols[i]] = var_grads[i];
+
+  return {value, grads};
+}
+
+EvalCacheStats EvalCache::stats() const {
+  const std::lock_guard<std::mutex> lock(mutex);
+  EvalCacheStats stats = counters;
+  stats.entries = entries.size();
+  stats.bytes = entries.size() * bytes_per_entry;
+  return stats;
+}
+
+void EvalCache::clear() {
+  const std::lock_guard<std::mutex> lock(mutex);
+  index.clear();
+  entries.clear();
+}
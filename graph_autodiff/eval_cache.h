@@ -0,0 +1,121 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <cstddef>  // std::size_t
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string_view>
+#include <utility>  // std::pair
+#include <vector>
+
+#include "Eigen/Core"
+#include "absl/container/flat_hash_map.h"
+#include "absl/types/span.h"
+#include "graph_autodiff/compiled_graph.h"
+
+namespace graph_autodiff {
+
+/// Limits on the size of an EvalCache. When a new point would exceed either
+/// of them, the least recently used points are evicted first.
+struct EvalCacheOptions {
+  /// The maximum number of cached points.
+  std::size_t max_entries = 1024;
+  /// The maximum memory used by cached points, in bytes, as counted by
+  /// EvalCacheStats::bytes.
+  std::size_t max_bytes = std::size_t(64) << 20;
+};
+
+/// Counters of an EvalCache.
+struct EvalCacheStats {
+  /// The number of evaluations that found their point in the cache, and of
+  /// those that did not and evaluated the graph.
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  /// The number of points evicted to respect the limits.
+  std::uint64_t evictions = 0;
+  /// The number of cached points and the memory they use: their inputs and
+  /// gradients, plus a fixed bookkeeping cost per point.
+  std::size_t entries = 0;
+  std::size_t bytes = 0;
+};
+
+/// Memoizes the value and gradient of a graph at the points it is evaluated
+/// at, for workloads that evaluate the same points over and over, e.g. line
+/// searches that revisit points. The cache holds a bounded number of points
+/// and evicts the least recently used ones first (see EvalCacheOptions).
+/// Points are looked up by a hash of their inputs in layout order, and only
+/// match if they are bitwise identical: 0 and -0 are different points, while
+/// a NaN input matches the same NaN.
+/// An EvalCache can be used by several threads at the same time. A mutex
+/// guards the cached points, but the graph is evaluated without holding it,
+/// so misses on different threads are evaluated in parallel (and concurrent
+/// misses on the same point may each evaluate it).
+class EvalCache {
+  struct Entry {
+    std::vector<float> inputs;
+    float value;
+    Eigen::RowVectorXf grad;
+  };
+
+  CompiledGraph cg;
+  /// The cost of each point, as counted by EvalCacheStats::bytes.
+  std::size_t bytes_per_entry;
+  /// The maximum number of points, which respects both limits.
+  std::size_t capacity;
+
+  mutable std::mutex mutex;
+  // the most recently used point first
+  std::list<Entry> entries;  // guarded by mutex
+  // maps the bytes of the inputs of each point to its entry
+  absl::flat_hash_map<std::string_view, std::list<Entry>::iterator>
+      index;                // guarded by mutex
+  EvalCacheStats counters;  // guarded by mutex; entries and bytes unused
+
+  /// If the point `inputs` is cached, mark it as the most recently used,
+  /// copy its gradient to `grad_out` and return true.
+  bool lookup(absl::Span<const float> inputs, float& value,
+              Eigen::Ref<Eigen::RowVectorXf> grad_out);
+
+  /// Cache the value and gradient of the graph at `inputs`.
+  void insert(absl::Span<const float> inputs, float value,
+              Eigen::RowVectorXf grad);
+
+ public:
+  explicit EvalCache(CompiledGraph graph, EvalCacheOptions options = {});
+
+  EvalCache(const EvalCache&) = delete;
+  EvalCache& operator=(const EvalCache&) = delete;
+
+  /// Same as CompiledGraph::eval_grad(const Inputs&, GradMode), through the
+  /// cache: the gradient has one element per input, in alphabetical order.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(const Inputs& inputs);
+
+  /// Same as CompiledGraph::eval_grad(absl::Span<const float>, GradMode),
+  /// through the cache.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      absl::Span<const float> inputs);
+
+  /// Return the value of the graph at the given point and write its
+  /// gradient into `grad_out`, which must have one element per variable.
+  /// Hits perform no heap allocations.
+  float eval_grad(absl::Span<const float> inputs,
+                  Eigen::Ref<Eigen::RowVectorXf> grad_out);
+
+  /// The current counters.
+  EvalCacheStats stats() const;
+
+  /// Remove all cached points. Counters are not reset.
+  void clear();
+
+  /// The graph being evaluated.
+  const CompiledGraph& graph() const noexcept { return cg; }
+};
+
+}  // namespace graph_autodiff
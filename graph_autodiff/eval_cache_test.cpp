@@ -0,0 +1,137 @@
+#include "graph_autodiff/eval_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+namespace {
+Graph test_graph() {
+  const Var x{"x"};
+  const Var y{"y"};
+  return x * x * y + exp(-y) * x;
+}
+}  // end of anonymous namespace
+
+TEST(EvalCache, HitsAndMisses) {
+  const CompiledGraph cg = test_graph().compile();
+  EvalCache cache(cg);
+
+  const std::vector<float> p1{1., 2.};
+  const std::vector<float> p2{3., -1.};
+  for (int i = 0; i < 3; ++i) {
+    for (const std::vector<float>& p : {p1, p2}) {
+      const auto &[value, grad] = cache.eval_grad(p);
+      const auto &[expected_value, expected_grad] = cg.eval_grad(p);
+      EXPECT_FLOAT_EQ(value, expected_value);
+      ASSERT_EQ(grad.size(), 2);
+      for (int j = 0; j < 2; ++j) EXPECT_FLOAT_EQ(grad(j), expected_grad(j));
+    }
+  }
+  EvalCacheStats stats = cache.stats();
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.hits, 4);
+  EXPECT_EQ(stats.entries, 2);
+  EXPECT_GT(stats.bytes, 0);
+
+  // named inputs share the same cached points
+  const auto &[value, grad] =
+      cache.eval_grad({{"w", 0.}, {"x", 1.}, {"y", 2.}});
+  EXPECT_FLOAT_EQ(value, cg.eval(p1));
+  ASSERT_EQ(grad.size(), 3);
+  EXPECT_FLOAT_EQ(grad(0), 0.);
+  EXPECT_EQ(cache.stats().hits, 5);
+
+  // points only match if they are bitwise identical
+  cache.eval_grad(std::vector<float>{-0., 2.});
+  cache.eval_grad(std::vector<float>{0., 2.});
+  EXPECT_EQ(cache.stats().misses, 4);
+
+  cache.clear();
+  stats = cache.stats();
+  EXPECT_EQ(stats.entries, 0);
+  EXPECT_EQ(stats.bytes, 0);
+  EXPECT_EQ(stats.hits, 5);
+}
+
+TEST(EvalCache, LeastRecentlyUsedPointsAreEvicted) {
+  EvalCacheOptions options;
+  options.max_entries = 2;
+  EvalCache cache(test_graph().compile(), options);
+  const std::vector<float> a{1., 1.};
+  const std::vector<float> b{2., 2.};
+  const std::vector<float> c{3., 3.};
+
+  cache.eval_grad(a);
+  cache.eval_grad(b);
+  cache.eval_grad(a);  // b is now the least recently used
+  cache.eval_grad(c);  // evicts b
+  EXPECT_EQ(cache.stats().evictions, 1);
+  EXPECT_EQ(cache.stats().entries, 2);
+
+  const std::uint64_t misses = cache.stats().misses;
+  cache.eval_grad(a);
+  cache.eval_grad(c);
+  EXPECT_EQ(cache.stats().misses, misses);
+  cache.eval_grad(b);
+  EXPECT_EQ(cache.stats().misses, misses + 1);
+}
+
+TEST(EvalCache, MemoryLimit) {
+  const CompiledGraph cg = test_graph().compile();
+  // room for a single point
+  EvalCache one(cg);
+  one.eval_grad(std::vector<float>{1., 1.});
+  const std::size_t bytes_per_entry = one.stats().bytes;
+  EvalCacheOptions options;
+  options.max_bytes = bytes_per_entry;
+  EvalCache cache(cg, options);
+  cache.eval_grad(std::vector<float>{1., 1.});
+  cache.eval_grad(std::vector<float>{2., 2.});
+  EXPECT_EQ(cache.stats().entries, 1);
+  EXPECT_LE(cache.stats().bytes, bytes_per_entry);
+
+  // too small for any point: everything is a miss
+  options.max_bytes = 1;
+  EvalCache none(cg, options);
+  for (int i = 0; i < 2; ++i) none.eval_grad(std::vector<float>{1., 1.});
+  EXPECT_EQ(none.stats().misses, 2);
+  EXPECT_EQ(none.stats().entries, 0);
+}
+
+TEST(EvalCache, ConcurrentUse) {
+  const CompiledGraph cg = test_graph().compile();
+  EvalCacheOptions options;
+  options.max_entries = 8;
+  EvalCache cache(cg, options);
+
+  // more distinct points than fit in the cache, so threads also evict
+  constexpr int n_threads = 8;
+  constexpr int n_evaluations = 500;
+  std::vector<int> n_mismatches(n_threads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t] {
+      Eigen::RowVectorXf grad(2);
+      for (int i = 0; i < n_evaluations; ++i) {
+        const std::vector<float> p{float((t + i) % 12), 0.5f};
+        const float value = cache.eval_grad(p, grad);
+        const auto &[expected_value, expected_grad] = cg.eval_grad(p);
+        if (value != expected_value || grad != expected_grad)
+          ++n_mismatches[t];
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  for (int t = 0; t < n_threads; ++t)
+    EXPECT_EQ(n_mismatches[t], 0) << "thread " << t;
+  const EvalCacheStats stats = cache.stats();
+  EXPECT_EQ(stats.hits + stats.misses, n_threads * n_evaluations);
+  EXPECT_LE(stats.entries, 8);
+}
@@ -0,0 +1,32 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <cstdio>   // std::fprintf
+#include <cstdlib>  // std::abort
+#include <string_view>
+
+#include "absl/status/status.h"
+
+namespace graph_autodiff {
+
+/// Report an error on stderr and abort. For errors that cannot be returned
+/// to the caller, e.g. missing inputs to a noexcept evaluation or operations
+/// between tensors of incompatible shapes.
+[[noreturn]] inline void fail(std::string_view message) noexcept {
+  std::fprintf(stderr, "graph_autodiff: %.*s\n", int(message.size()),
+               message.data());
+  std::abort();
+}
+
+/// Same as fail(std::string_view), with the message of `status`.
+[[noreturn]] inline void fail(const absl::Status& status) noexcept {
+  fail(std::string_view(status.message().data(), status.message().size()));
+}
+
+}  // namespace graph_autodiff
@@ -6,161 +6,1237 @@ under certain conditions: see LICENSE.
 */
 #include "graph.h"
 
+#include <algorithm>  // std::min, std::max
+#include <array>
 #include <cassert>
-#include <cstddef>  // std::size_t
+#include <cstddef>  // std::size_t, std::byte
+#include <exception>   // std::current_exception
 #include <fstream>
-#include <iterator>
+#include <functional>  // std::less
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>  // std::swap
+#include <vector>
 
+#include "absl/algorithm/container.h"
+#include "absl/base/casts.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "fmt/core.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "graph_autodiff/fail.h"
 #include "graph_autodiff/graph.pb.h"
+#include "graph_autodiff/ops.h"
+#include "graph_autodiff/thread_pool.h"
 
 using namespace graph_autodiff;
 namespace gpb = graph_proto;
 
 namespace {
-std::unique_ptr<const Op> op_from_proto(const gpb::Graph& gproto) {
-  std::unique_ptr<const Op> op;
+/// Build a graph of Ops from an instruction tape (with the constants and
+/// variable names its instructions refer to): each instruction becomes a
+/// single node, shared by all the operations that use it.
+Graph raise_tape(absl::Span<const Instruction> tape,
+                 absl::Span<const float> constants,
+                 absl::Span<const VarId> var_ids) {
+  std::vector<std::shared_ptr<const Op>> nodes(tape.size());
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        nodes[i] = std::make_shared<const Const>(constants[instr.op1]);
+        break;
+      case OpCode::kVar:
+        nodes[i] = std::make_shared<const Var>(var_ids[instr.op1]);
+        break;
+      case OpCode::kSum:
+        nodes[i] =
+            std::make_shared<const Sum>(nodes[instr.op1], nodes[instr.op2]);
+        break;
+      case OpCode::kMul:
+        nodes[i] =
+            std::make_shared<const Mul>(nodes[instr.op1], nodes[instr.op2]);
+        break;
+      case OpCode::kSub:
+        nodes[i] =
+            std::make_shared<const Sub>(nodes[instr.op1], nodes[instr.op2]);
+        break;
+      case OpCode::kDiv:
+        nodes[i] =
+            std::make_shared<const Div>(nodes[instr.op1], nodes[instr.op2]);
+        break;
+      case OpCode::kNeg:
+        nodes[i] = std::make_shared<const Neg>(nodes[instr.op1]);
+        break;
+      case OpCode::kPow:
+        nodes[i] =
+            std::make_shared<const Pow>(nodes[instr.op1], pow_exponent(instr));
+        break;
+      case OpCode::kExp:
+        nodes[i] = std::make_shared<const Exp>(nodes[instr.op1]);
+        break;
+      case OpCode::kLog:
+        nodes[i] = std::make_shared<const Log>(nodes[instr.op1]);
+        break;
+    }
+  }
+  return Graph(nodes.back());
+}
+
+/// The distinct nodes of the graph rooted at `root` in post-order, so that
+/// the root comes last and operands before their users. `idxs` is filled
+/// with the position of each node. Like TapeBuilder::lower(), the traversal
+/// uses an explicit stack so that deep graphs cannot overflow the call
+/// stack.
+std::vector<const Op*> post_order(
+    const Op& root, absl::flat_hash_map<const Op*, std::uint32_t>& idxs) {
+  std::vector<const Op*> nodes;
+  std::vector<const Op*> stack{&root};
+  while (!stack.empty()) {
+    const Op* op = stack.back();
+    if (idxs.contains(op)) {
+      stack.pop_back();
+      continue;
+    }
+    bool ready = true;
+    for (const std::shared_ptr<const Op>& operand : op->operands()) {
+      if (!idxs.contains(operand.get())) {
+        stack.push_back(operand.get());
+        ready = false;
+      }
+    }
+    if (!ready) continue;
+    stack.pop_back();
+    idxs.emplace(op, std::uint32_t(nodes.size()));
+    nodes.push_back(op);
+  }
+  return nodes;
+}
+}  // end of anonymous namespace
+
+/// Lowers a graph of Ops into the instruction tape of a CompiledGraph.
+/// Operands are always lowered before the operations that use them, so the
+/// resulting tape is topologically sorted.
+/// Unless disabled, the graph is also optimized while it is lowered:
+/// - structurally identical subgraphs are merged (common subexpression
+///   elimination): each is emitted once even if it is not shared in the
+///   original graph
+/// - the graph is simplified via constant folding, removal of identity and
+///   absorbing elements (`x + 0`, `x * 1`, `x * 0`, `x - 0`, `x / 1`,
+///   `pow(x, 1)`, `pow(x, 0)`, `-(-x)`) and merging of chained constant terms
+///   and coefficients (`2 * (3 * x)` becomes `6 * x`)
+class graph_autodiff::TapeBuilder {
+  using InstructionKey = std::tuple<OpCode, std::uint32_t, std::uint32_t>;
+
+  bool merge_identical;
+  bool simplify;
+
+  std::vector<Instruction> tape;
+  std::vector<float> constants;
+  // variable indices are provisional (in order of appearance) until build()
+  std::vector<VarId> var_ids;
+  absl::flat_hash_map<VarId, std::uint32_t> var_idxs;
+  // operations that appear in the graph more than once are lowered once
+  absl::flat_hash_map<const Op*, std::uint32_t> lowered;
+  // the instructions emitted so far, for merge_identical: constants are
+  // identified by their bit pattern, variables by their index
+  absl::flat_hash_map<InstructionKey, std::uint32_t> emitted;
+
+  /// The value of instruction `idx` if it is a constant.
+  std::optional<float> constant_value(std::uint32_t idx) const {
+    if (tape[idx].opcode != OpCode::kConst) return std::nullopt;
+    return constants[tape[idx].op1];
+  }
+
+  /// Emit the simplest equivalent of the operation `instr`.
+  /// Returns std::nullopt if no simplification applies.
+  std::optional<std::uint32_t> emit_simplified(const Instruction& instr) {
+    if (const std::optional<float> c1 = constant_value(instr.op1)) {
+      if (n_operands(instr.opcode) == 1)
+        return emit_const(apply_op(instr, *c1, 0.f));
+      if (const std::optional<float> c2 = constant_value(instr.op2))
+        return emit_const(apply_op(instr, *c1, *c2));
+    }
+
+    switch (instr.opcode) {
+      case OpCode::kSum:
+      case OpCode::kMul:
+        return emit_simplified_commutative(instr.opcode, instr.op1, instr.op2);
+      case OpCode::kSub:
+        if (constant_value(instr.op2) == 0.f) return instr.op1;
+        break;
+      case OpCode::kDiv:
+        if (constant_value(instr.op2) == 1.f) return instr.op1;
+        break;
+      case OpCode::kNeg:
+        if (tape[instr.op1].opcode == OpCode::kNeg) return tape[instr.op1].op1;
+        break;
+      case OpCode::kPow:
+        // (like ipow(), x^0 is 1 even if x is zero, infinite or NaN)
+        if (pow_exponent(instr) == 1) return instr.op1;
+        if (pow_exponent(instr) == 0) return emit_const(1.f);
+        break;
+      default:
+        break;
+    }
+    return std::nullopt;
+  }
+
+  /// Emit the simplest equivalent of `op1 + op2` or `op1 * op2`, at most one
+  /// of which is a constant. Returns std::nullopt if no simplification
+  /// applies.
+  std::optional<std::uint32_t> emit_simplified_commutative(OpCode opcode,
+                                                           std::uint32_t op1,
+                                                           std::uint32_t op2) {
+    const bool is_sum = opcode == OpCode::kSum;
+    std::optional<float> c1 = constant_value(op1);
+    std::optional<float> c2 = constant_value(op2);
+
+    // from here on, the constant operand (if any) is op1
+    if (c2) {
+      std::swap(op1, op2);
+      std::swap(c1, c2);
+    }
+    if (!c1) return std::nullopt;
+
+    // identity and absorbing elements
+    // (note that x * 0 is folded to 0 even if x could be infinite or NaN)
+    if (is_sum && *c1 == 0.f) return op2;
+    if (!is_sum && *c1 == 1.f) return op2;
+    if (!is_sum && *c1 == 0.f) return emit_const(0.f);
+
+    // c1 + (c2 + x) -> (c1 + c2) + x, and the same for products
+    const Instruction& inner = tape[op2];
+    if (inner.opcode != opcode) return std::nullopt;
+    std::uint32_t inner_const = inner.op1;
+    std::uint32_t inner_other = inner.op2;
+    if (!constant_value(inner_const)) std::swap(inner_const, inner_other);
+    if (const std::optional<float> c3 = constant_value(inner_const)) {
+      const std::uint32_t merged = emit_const(is_sum ? *c1 + *c3 : *c1 * *c3);
+      return emit({opcode, merged, inner_other});
+    }
+
+    return std::nullopt;
+  }
+
+ public:
+  explicit TapeBuilder(bool merge_identical = true, bool simplify = true)
+      : merge_identical(merge_identical), simplify(simplify) {}
+
+  /// Lower `root` and all operations it depends on, unless they have been
+  /// lowered before. Returns the index of the instruction that holds the
+  /// result of `root`.
+  std::uint32_t lower(const Op& root) {
+    if (auto it = lowered.find(&root); it != lowered.end()) return it->second;
+
+    // post-order traversal with an explicit stack, so that deep graphs cannot
+    // overflow the call stack: an operation is only lowered once all of its
+    // operands are, so its own calls to lower() return immediately
+    std::vector<const Op*> stack{&root};
+    while (!stack.empty()) {
+      const Op* op = stack.back();
+      if (lowered.contains(op)) {
+        stack.pop_back();
+        continue;
+      }
+      bool ready = true;
+      for (const std::shared_ptr<const Op>& operand : op->operands()) {
+        if (!lowered.contains(operand.get())) {
+          stack.push_back(operand.get());
+          ready = false;
+        }
+      }
+      if (!ready) continue;
+      stack.pop_back();
+      lowered.emplace(op, op->lower(*this));
+    }
+
+    return lowered.at(&root);
+  }
+
+  std::uint32_t emit_const(float value) {
+    const InstructionKey key{OpCode::kConst,
+                             absl::bit_cast<std::uint32_t>(value), 0};
+    if (merge_identical)
+      if (auto it = emitted.find(key); it != emitted.end()) return it->second;
+
+    constants.push_back(value);
+    tape.push_back({OpCode::kConst, std::uint32_t(constants.size() - 1), 0});
+    const std::uint32_t idx = tape.size() - 1;
+    if (merge_identical) emitted.emplace(key, idx);
+    return idx;
+  }
+
+  std::uint32_t emit_var(VarId id) {
+    auto [it, inserted] =
+        var_idxs.try_emplace(id, std::uint32_t(var_ids.size()));
+    if (inserted) var_ids.push_back(id);
+    return emit({OpCode::kVar, it->second, 0});
+  }
 
-  switch (gproto.Op_case()) {
+  std::uint32_t emit(Instruction instr) {
+    if (simplify && n_operands(instr.opcode) > 0)
+      if (auto idx = emit_simplified(instr)) return *idx;
+
+    if (merge_identical) {
+      InstructionKey key{instr.opcode, instr.op1, instr.op2};
+      // sums and products are commutative: x*y and y*x are the same
+      if (instr.opcode == OpCode::kSum || instr.opcode == OpCode::kMul)
+        key = {instr.opcode, std::min(instr.op1, instr.op2),
+               std::max(instr.op1, instr.op2)};
+      auto [it, inserted] =
+          emitted.try_emplace(key, std::uint32_t(tape.size()));
+      if (!inserted) return it->second;
+    }
+
+    tape.push_back(instr);
+    return std::uint32_t(tape.size() - 1);
+  }
+
+  /// Emit the sum or the product (depending on `opcode`) of the results of
+  /// instructions `idxs` as a balanced tree of binary instructions:
+  /// neighbours are combined pairwise until one result is left, so the
+  /// depth of the tree is logarithmic in the number of operands.
+  std::uint32_t emit_reduction(OpCode opcode,
+                               std::vector<std::uint32_t> idxs) {
+    assert(!idxs.empty());
+    while (idxs.size() > 1) {
+      std::size_t n = 0;
+      for (std::size_t k = 0; k + 1 < idxs.size(); k += 2)
+        idxs[n++] = emit({opcode, idxs[k], idxs[k + 1]});
+      if (idxs.size() % 2 == 1) idxs[n++] = idxs.back();
+      idxs.resize(n);
+    }
+    return idxs.front();
+  }
+
+  /// Remove the instructions (and constants) that `root` does not depend on,
+  /// which simplifications might have left behind, and move `root` to the
+  /// end of the tape. No more instructions can be emitted afterwards.
+  void finish(std::uint32_t root) { finish(absl::MakeConstSpan(&root, 1)); }
+
+  /// Same as finish(std::uint32_t), for a tape with several roots: only the
+  /// instructions that none of them depend on are removed, and the root
+  /// that comes last is moved to the end of the tape. Returns the new index
+  /// of each root.
+  std::vector<std::uint32_t> finish(absl::Span<const std::uint32_t> roots) {
+    assert(!roots.empty());
+    const std::uint32_t root = *absl::c_max_element(roots);
+    std::vector<bool> live(tape.size(), false);
+    for (std::uint32_t r : roots) live[r] = true;
+    for (std::uint32_t i = root + 1; i-- > 0;) {
+      if (!live[i]) continue;
+      const Instruction& instr = tape[i];
+      const int n_ops = n_operands(instr.opcode);
+      if (n_ops >= 1) live[instr.op1] = true;
+      if (n_ops == 2) live[instr.op2] = true;
+    }
+
+    std::vector<std::uint32_t> new_idxs(tape.size());
+    std::vector<Instruction> live_tape;
+    std::vector<float> live_constants;
+    for (std::uint32_t i = 0; i <= root; ++i) {
+      if (!live[i]) continue;
+      Instruction instr = tape[i];
+      switch (instr.opcode) {
+        case OpCode::kConst:
+          live_constants.push_back(constants[instr.op1]);
+          instr.op1 = live_constants.size() - 1;
+          break;
+        case OpCode::kVar:
+          break;
+        default:
+          instr.op1 = new_idxs[instr.op1];
+          if (n_operands(instr.opcode) == 2) instr.op2 = new_idxs[instr.op2];
+          break;
+      }
+      new_idxs[i] = live_tape.size();
+      live_tape.push_back(instr);
+    }
+
+    tape = std::move(live_tape);
+    constants = std::move(live_constants);
+    emitted.clear();
+    lowered.clear();
+
+    std::vector<std::uint32_t> new_roots;
+    new_roots.reserve(roots.size());
+    for (std::uint32_t r : roots) new_roots.push_back(new_idxs[r]);
+    return new_roots;
+  }
+
+  /// Build a graph of Ops equivalent to the finished tape: each instruction
+  /// becomes a single node, shared by all the operations that use it.
+  Graph raise() && { return raise_tape(tape, constants, var_ids); }
+
+  /// Build a CompiledGraph from the finished tape.
+  /// All variables that were lowered are part of its layout, including those
+  /// that simplifications removed from the tape.
+  CompiledGraph build() && {
+    // CompiledGraph expects variables in alphabetical order
+    std::vector<std::uint32_t> order(var_ids.size());
+    for (std::uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+    absl::c_sort(order, [this](std::uint32_t i1, std::uint32_t i2) {
+      return var_ids[i1].name() < var_ids[i2].name();
+    });
+
+    std::vector<std::uint32_t> new_idxs(var_ids.size());
+    std::vector<std::string> sorted_names(var_ids.size());
+    for (std::uint32_t i = 0; i < order.size(); ++i) {
+      new_idxs[order[i]] = i;
+      sorted_names[i] = std::string(var_ids[order[i]].name());
+    }
+
+    for (Instruction& instr : tape)
+      if (instr.opcode == OpCode::kVar) instr.op1 = new_idxs[instr.op1];
+
+    return CompiledGraph(std::move(tape), std::move(constants),
+                         VariableLayout(std::move(sorted_names)));
+  }
+};
+
+/// Writes the node table of a graph (see Graph::to_proto()), which can be
+/// written in pieces. Each node of the graph is one node of the table: nodes
+/// shared by several operations are written once, and sums and products
+/// keep all their operands.
+class graph_autodiff::NodeTableWriter {
+  absl::flat_hash_map<const Op*, std::uint32_t> idxs;
+  std::vector<const Op*> nodes;
+  std::vector<VarId> var_ids;
+  absl::flat_hash_map<VarId, std::uint32_t> var_idxs;
+
+ public:
+  explicit NodeTableWriter(const Op& root) : nodes(post_order(root, idxs)) {}
+
+  /// The number of nodes of the table.
+  std::size_t size() const noexcept { return nodes.size(); }
+
+  /// The index of `op` in the table.
+  std::uint32_t index(const Op& op) const { return idxs.at(&op); }
+
+  /// The index of the variable `id` in the variable table. Variables are
+  /// numbered in order of first appearance in the node table.
+  std::uint32_t var_index(VarId id) {
+    const auto [it, inserted] =
+        var_idxs.try_emplace(id, std::uint32_t(var_ids.size()));
+    if (inserted) var_ids.push_back(id);
+    return it->second;
+  }
+
+  /// The variables referred to by the nodes written so far.
+  absl::Span<const VarId> variables() const noexcept { return var_ids; }
+
+  /// Append nodes [begin, end) of the table to `out`.
+  void write(std::size_t begin, std::size_t end,
+             google::protobuf::RepeatedPtrField<gpb::Node>& out) {
+    out.Reserve(out.size() + (end - begin));
+    for (std::size_t i = begin; i < end; ++i)
+      nodes[i]->to_node(*this, *out.Add());
+  }
+
+  /// The whole table, with its variable table.
+  gpb::Dag to_dag_proto() {
+    gpb::Dag dag;
+    write(0, size(), *dag.mutable_nodes());
+    for (VarId id : var_ids) dag.add_var_names(std::string(id.name()));
+    return dag;
+  }
+};
+
+namespace {
+/// The operands of a protobuf message in the nested format.
+absl::InlinedVector<const gpb::Graph*, 2> msg_operands(const gpb::Graph& msg) {
+  switch (msg.Op_case()) {
     case gpb::Graph::OpCase::kSum:
-      op = Sum::from_proto(gproto.sum());
-      break;
+      return {&msg.sum().op1(), &msg.sum().op2()};
     case gpb::Graph::OpCase::kMul:
-      op = Mul::from_proto(gproto.mul());
-      break;
-    case gpb::Graph::OpCase::kVar:
-      op = Var::from_proto(gproto.var());
-      break;
-    case gpb::Graph::OpCase::kConst:
-      op = Const::from_proto(gproto.const_());
-      break;
-    case gpb::Graph::OpCase::OP_NOT_SET:
-      std::abort();  // TODO and log: this should never happen
-      break;
+      return {&msg.mul().op1(), &msg.mul().op2()};
+    case gpb::Graph::OpCase::kSub:
+      return {&msg.sub().op1(), &msg.sub().op2()};
+    case gpb::Graph::OpCase::kDiv:
+      return {&msg.div().op1(), &msg.div().op2()};
+    case gpb::Graph::OpCase::kNeg:
+      return {&msg.neg().op()};
+    case gpb::Graph::OpCase::kPow:
+      return {&msg.pow().op()};
+    case gpb::Graph::OpCase::kExp:
+      return {&msg.exp().op()};
+    case gpb::Graph::OpCase::kLog:
+      return {&msg.log().op()};
+    case gpb::Graph::OpCase::kNarySum:
+      return {msg.nary_sum().ops().pointer_begin(),
+              msg.nary_sum().ops().pointer_end()};
+    case gpb::Graph::OpCase::kNaryMul:
+      return {msg.nary_mul().ops().pointer_begin(),
+              msg.nary_mul().ops().pointer_end()};
+    default:
+      return {};
+  }
+}
+
+/// The indices of the operands of a node of a node table.
+absl::InlinedVector<std::uint32_t, 2> node_operands(const gpb::Node& node) {
+  switch (node.Op_case()) {
+    case gpb::Node::OpCase::kSum:
+      return {node.sum().op1(), node.sum().op2()};
+    case gpb::Node::OpCase::kMul:
+      return {node.mul().op1(), node.mul().op2()};
+    case gpb::Node::OpCase::kSub:
+      return {node.sub().op1(), node.sub().op2()};
+    case gpb::Node::OpCase::kDiv:
+      return {node.div().op1(), node.div().op2()};
+    case gpb::Node::OpCase::kNeg:
+      return {node.neg()};
+    case gpb::Node::OpCase::kPow:
+      return {node.pow().op()};
+    case gpb::Node::OpCase::kExp:
+      return {node.exp()};
+    case gpb::Node::OpCase::kLog:
+      return {node.log()};
+    case gpb::Node::OpCase::kNarySum:
+      return {node.nary_sum().ops().begin(), node.nary_sum().ops().end()};
+    case gpb::Node::OpCase::kNaryMul:
+      return {node.nary_mul().ops().begin(), node.nary_mul().ops().end()};
+    default:
+      return {};
+  }
+}
+
+/// Build the graph of Ops described by a protobuf message in the nested
+/// format. Messages are visited in post-order with an explicit stack rather
+/// than recursively, so that arbitrarily deep graphs can be read.
+std::shared_ptr<const Op> op_from_proto(const gpb::Graph& gproto) {
+  // the second element is whether the operands of the message have already
+  // been pushed onto the stack
+  std::vector<std::pair<const gpb::Graph*, bool>> stack{{&gproto, false}};
+  // the operations built so far whose parent has not been built yet
+  std::vector<std::shared_ptr<const Op>> built;
+
+  while (!stack.empty()) {
+    auto& [msg, expanded] = stack.back();
+    const absl::InlinedVector<const gpb::Graph*, 2> operands =
+        msg_operands(*msg);
+    if (!operands.empty() && !expanded) {
+      expanded = true;
+      // the first operand is on top, so it is built first
+      for (auto it = operands.rbegin(); it != operands.rend(); ++it)
+        stack.push_back({*it, false});
+      continue;
+    }
+
+    Op::Operands ops(operands.size());
+    for (std::size_t k = operands.size(); k-- > 0;) {
+      ops[k] = std::move(built.back());
+      built.pop_back();
+    }
+    switch (msg->Op_case()) {
+      case gpb::Graph::OpCase::kSum:
+        built.push_back(
+            std::make_shared<const Sum>(std::move(ops[0]), std::move(ops[1])));
+        break;
+      case gpb::Graph::OpCase::kMul:
+        built.push_back(
+            std::make_shared<const Mul>(std::move(ops[0]), std::move(ops[1])));
+        break;
+      case gpb::Graph::OpCase::kNarySum:
+        if (ops.size() < 2)
+          fail("invalid graph: a sum of fewer than two terms");
+        built.push_back(std::make_shared<const Sum>(std::move(ops)));
+        break;
+      case gpb::Graph::OpCase::kNaryMul:
+        if (ops.size() < 2)
+          fail("invalid graph: a product of fewer than two factors");
+        built.push_back(std::make_shared<const Mul>(std::move(ops)));
+        break;
+      case gpb::Graph::OpCase::kSub:
+        built.push_back(
+            std::make_shared<const Sub>(std::move(ops[0]), std::move(ops[1])));
+        break;
+      case gpb::Graph::OpCase::kDiv:
+        built.push_back(
+            std::make_shared<const Div>(std::move(ops[0]), std::move(ops[1])));
+        break;
+      case gpb::Graph::OpCase::kNeg:
+        built.push_back(std::make_shared<const Neg>(std::move(ops[0])));
+        break;
+      case gpb::Graph::OpCase::kPow:
+        built.push_back(std::make_shared<const Pow>(std::move(ops[0]),
+                                                    msg->pow().exponent()));
+        break;
+      case gpb::Graph::OpCase::kExp:
+        built.push_back(std::make_shared<const Exp>(std::move(ops[0])));
+        break;
+      case gpb::Graph::OpCase::kLog:
+        built.push_back(std::make_shared<const Log>(std::move(ops[0])));
+        break;
+      case gpb::Graph::OpCase::kVar:
+        built.push_back(Var::from_proto(msg->var()));
+        break;
+      case gpb::Graph::OpCase::kConst:
+        built.push_back(Const::from_proto(msg->const_()));
+        break;
+      case gpb::Graph::OpCase::kDag:  // only valid at the top level
+        fail("invalid graph: a node table nested in another graph");
+      case gpb::Graph::OpCase::OP_NOT_SET:
+        fail("invalid graph: a message has no operation");
+    }
+    stack.pop_back();
   }
 
-  return op;
+  assert(built.size() == 1);
+  return std::move(built.back());
 }
 
-std::size_t find_var_idx(std::string_view name, const Inputs& inputs) {
-  // TODO this should _not_ be in the hot loop. do it once at the beginning.
-  std::vector<std::string> var_names;
-  var_names.reserve(inputs.size());
-  absl::c_transform(inputs, std::back_inserter(var_names),
-                    [](const auto& p) { return p.first; });
-  absl::c_sort(var_names);
+/// Builds a graph of Ops from a node table, which can be passed in pieces.
+/// Each node of the table becomes a single node of the graph.
+class NodeTableReader {
+  std::vector<std::shared_ptr<const Op>> nodes;
+  std::vector<VarId> var_ids;
+
+  absl::Status invalid_operand(std::size_t node) const {
+    return absl::InvalidArgumentError(fmt::format(
+        "Node {} refers to a node that does not precede it.", node));
+  }
+
+ public:
+  /// Append variables to the variable table.
+  void add_vars(const google::protobuf::RepeatedPtrField<std::string>& names) {
+    var_ids.reserve(var_ids.size() + names.size());
+    for (const std::string& name : names) var_ids.emplace_back(name);
+  }
+
+  /// Append nodes to the node table. They can refer to all nodes and
+  /// variables added so far.
+  absl::Status add_nodes(
+      const google::protobuf::RepeatedPtrField<gpb::Node>& new_nodes) {
+    nodes.reserve(nodes.size() + new_nodes.size());
+    for (const gpb::Node& node : new_nodes) {
+      const std::size_t i = nodes.size();
+      const absl::InlinedVector<std::uint32_t, 2> operands =
+          node_operands(node);
+      for (std::uint32_t operand : operands)
+        if (operand >= i) return invalid_operand(i);
+      const auto operand = [&](std::size_t k) { return nodes[operands[k]]; };
+      switch (node.Op_case()) {
+        case gpb::Node::OpCase::kSum:
+          nodes.push_back(std::make_shared<const Sum>(operand(0), operand(1)));
+          break;
+        case gpb::Node::OpCase::kMul:
+          nodes.push_back(std::make_shared<const Mul>(operand(0), operand(1)));
+          break;
+        case gpb::Node::OpCase::kNarySum:
+        case gpb::Node::OpCase::kNaryMul: {
+          if (operands.size() < 2) {
+            return absl::InvalidArgumentError(fmt::format(
+                "Node {} has fewer than two operands.", i));
+          }
+          Op::Operands ops;
+          ops.reserve(operands.size());
+          for (std::uint32_t operand : operands) ops.push_back(nodes[operand]);
+          if (node.has_nary_sum())
+            nodes.push_back(std::make_shared<const Sum>(std::move(ops)));
+          else
+            nodes.push_back(std::make_shared<const Mul>(std::move(ops)));
+          break;
+        }
+        case gpb::Node::OpCase::kSub:
+          nodes.push_back(std::make_shared<const Sub>(operand(0), operand(1)));
+          break;
+        case gpb::Node::OpCase::kDiv:
+          nodes.push_back(std::make_shared<const Div>(operand(0), operand(1)));
+          break;
+        case gpb::Node::OpCase::kNeg:
+          nodes.push_back(std::make_shared<const Neg>(operand(0)));
+          break;
+        case gpb::Node::OpCase::kPow:
+          nodes.push_back(
+              std::make_shared<const Pow>(operand(0), node.pow().exponent()));
+          break;
+        case gpb::Node::OpCase::kExp:
+          nodes.push_back(std::make_shared<const Exp>(operand(0)));
+          break;
+        case gpb::Node::OpCase::kLog:
+          nodes.push_back(std::make_shared<const Log>(operand(0)));
+          break;
+        case gpb::Node::OpCase::kVar:
+          if (node.var() >= var_ids.size()) {
+            return absl::InvalidArgumentError(fmt::format(
+                "Node {} refers to a variable that does not exist.", i));
+          }
+          nodes.push_back(std::make_shared<const Var>(var_ids[node.var()]));
+          break;
+        case gpb::Node::OpCase::kConst:
+          nodes.push_back(std::make_shared<const Const>(node.const_()));
+          break;
+        case gpb::Node::OpCase::OP_NOT_SET:
+          return absl::InvalidArgumentError(
+              fmt::format("Node {} has no operation.", i));
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  /// The graph whose result is the last node added.
+  absl::StatusOr<Graph> finish() && {
+    if (nodes.empty())
+      return absl::InvalidArgumentError("The graph has no nodes.");
+    return Graph(nodes.back());
+  }
+};
+
+/// Build the protobuf message in the nested format that describes `root`.
+/// Operations that are shared by several others are repeated once per use.
+gpb::Graph nested_proto(const Op& root) {
+  const gpb::Dag dag = NodeTableWriter(root).to_dag_proto();
+
+  // the message of each node is built from those of its operands, which are
+  // moved rather than copied into their last user
+  std::vector<std::uint32_t> remaining_uses(dag.nodes_size(), 0);
+  for (const gpb::Node& node : dag.nodes())
+    for (std::uint32_t operand : node_operands(node)) ++remaining_uses[operand];
+  std::vector<gpb::Graph> msgs(dag.nodes_size());
+  const auto take = [&](std::uint32_t idx, gpb::Graph& out) {
+    if (--remaining_uses[idx] == 0)
+      out = std::move(msgs[idx]);
+    else
+      out = msgs[idx];
+  };
 
-  auto it = absl::c_find(var_names, name);
-  return std::distance(var_names.begin(), it);
+  for (std::size_t i = 0; i < msgs.size(); ++i) {
+    const gpb::Node& node = dag.nodes(i);
+    switch (node.Op_case()) {
+      case gpb::Node::OpCase::kSum:
+        take(node.sum().op1(), *msgs[i].mutable_sum()->mutable_op1());
+        take(node.sum().op2(), *msgs[i].mutable_sum()->mutable_op2());
+        break;
+      case gpb::Node::OpCase::kMul:
+        take(node.mul().op1(), *msgs[i].mutable_mul()->mutable_op1());
+        take(node.mul().op2(), *msgs[i].mutable_mul()->mutable_op2());
+        break;
+      case gpb::Node::OpCase::kNarySum:
+        for (std::uint32_t operand : node.nary_sum().ops())
+          take(operand, *msgs[i].mutable_nary_sum()->add_ops());
+        break;
+      case gpb::Node::OpCase::kNaryMul:
+        for (std::uint32_t operand : node.nary_mul().ops())
+          take(operand, *msgs[i].mutable_nary_mul()->add_ops());
+        break;
+      case gpb::Node::OpCase::kSub:
+        take(node.sub().op1(), *msgs[i].mutable_sub()->mutable_op1());
+        take(node.sub().op2(), *msgs[i].mutable_sub()->mutable_op2());
+        break;
+      case gpb::Node::OpCase::kDiv:
+        take(node.div().op1(), *msgs[i].mutable_div()->mutable_op1());
+        take(node.div().op2(), *msgs[i].mutable_div()->mutable_op2());
+        break;
+      case gpb::Node::OpCase::kNeg:
+        take(node.neg(), *msgs[i].mutable_neg()->mutable_op());
+        break;
+      case gpb::Node::OpCase::kPow:
+        take(node.pow().op(), *msgs[i].mutable_pow()->mutable_op());
+        msgs[i].mutable_pow()->set_exponent(node.pow().exponent());
+        break;
+      case gpb::Node::OpCase::kExp:
+        take(node.exp(), *msgs[i].mutable_exp()->mutable_op());
+        break;
+      case gpb::Node::OpCase::kLog:
+        take(node.log(), *msgs[i].mutable_log()->mutable_op());
+        break;
+      case gpb::Node::OpCase::kVar:
+        msgs[i].mutable_var()->set_name(dag.var_names(node.var()));
+        break;
+      case gpb::Node::OpCase::kConst:
+        msgs[i].mutable_const_()->set_value(node.const_());
+        break;
+      case gpb::Node::OpCase::OP_NOT_SET:
+        break;
+    }
+  }
+
+  return std::move(msgs.back());
+}
+
+absl::StatusOr<Graph> graph_from_dag_proto(const gpb::Dag& dag) {
+  NodeTableReader reader;
+  reader.add_vars(dag.var_names());
+  if (absl::Status status = reader.add_nodes(dag.nodes()); !status.ok())
+    return status;
+  return std::move(reader).finish();
 }
+
 }  // end of anonymous namespace
 
-float Sum::eval(const Inputs& inputs) const noexcept {
-  assert(op1 && op2);
-  return op1->eval(inputs) + op2->eval(inputs);
+void Op::release(absl::Span<std::shared_ptr<const Op>> operands) noexcept {
+  // operations whose destruction is in progress on this thread, if any: the
+  // outermost release() destroys them one at a time, and the releases they
+  // trigger only append their own operands
+  thread_local std::vector<std::shared_ptr<const Op>>* pending = nullptr;
+
+  // nothing to do if no operand is destroyed with this operation, e.g.
+  // because they are shared with others or do not own their node (see
+  // GraphBuilder)
+  if (absl::c_none_of(operands, [](const std::shared_ptr<const Op>& operand) {
+        return operand.use_count() == 1;
+      }))
+    return;
+
+  if (pending) {
+    for (std::shared_ptr<const Op>& operand : operands)
+      pending->push_back(std::move(operand));
+    return;
+  }
+
+  std::vector<std::shared_ptr<const Op>> to_release;
+  for (std::shared_ptr<const Op>& operand : operands)
+    to_release.push_back(std::move(operand));
+  pending = &to_release;
+  while (!to_release.empty()) {
+    // move out first: the destructor might append to to_release
+    std::shared_ptr<const Op> op = std::move(to_release.back());
+    to_release.pop_back();
+  }
+  pending = nullptr;
 }
 
-float Sum::eval_grad(const Inputs& inputs,
-                     Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept {
-  // row-major so we can give out views over the different rows to callees
-  Eigen::Matrix<float, 2, Eigen::Dynamic, Eigen::RowMajorBit> jacobian(
-      2, inputs.size());
+struct GraphBuilder::Arena {
+  std::size_t block_size;
+  std::vector<std::unique_ptr<std::byte[]>> blocks;
+  // the unused part of the last block
+  void* free = nullptr;
+  std::size_t free_size = 0;
+  // all nodes, in order of construction
+  std::vector<const Op*> nodes;
 
-  Eigen::Map<Eigen::RowVectorXf> first_row_view(jacobian.data(),
-                                                jacobian.cols());
-  const float value1 = op1->eval_grad(inputs, first_row_view);
+  explicit Arena(std::size_t block_size) : block_size(block_size) {}
 
-  Eigen::Map<Eigen::RowVectorXf> second_row_view(
-      jacobian.data() + jacobian.rowStride(), jacobian.cols());
-  const float value2 = op2->eval_grad(inputs, second_row_view);
+  ~Arena() {
+    // nodes only own operands outside of the arena, so they can be destroyed
+    // in any order: reverse order destroys users before what they use
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) (*it)->~Op();
+  }
+};
 
-  // the vector in the vector-jacobian product is just Ones() for a Sum
-  grad_out = Eigen::RowVector2f::Ones() * jacobian;
+namespace {
+thread_local GraphBuilder* active_builder = nullptr;
+}  // end of anonymous namespace
 
-  return value1 + value2;
+GraphBuilder::GraphBuilder(std::size_t block_size)
+    : arena(active_builder ? active_builder->arena
+                           : std::make_shared<Arena>(block_size)),
+      outer(active_builder) {
+  active_builder = this;
 }
 
-gpb::Graph Sum::to_proto() const noexcept {
-  gpb::Sum sum;
-  *sum.mutable_op1() = op1->to_proto();
-  *sum.mutable_op2() = op2->to_proto();
+GraphBuilder::~GraphBuilder() {
+  assert(active_builder == this && "GraphBuilders must be destroyed in "
+                                   "reverse order of construction");
+  active_builder = outer;
+}
 
-  gpb::Graph ret;
-  *ret.mutable_sum() = std::move(sum);
+GraphBuilder* GraphBuilder::active() noexcept { return active_builder; }
 
-  return ret;
+void* GraphBuilder::allocate(std::size_t size, std::size_t alignment) {
+  if (std::align(alignment, size, arena->free, arena->free_size) == nullptr) {
+    // does not fit in the current block: start a new one
+    const std::size_t block_size =
+        std::max(arena->block_size, size + alignment);
+    // not value-initialized: the memory is overwritten by the nodes anyway
+    arena->blocks.emplace_back(new std::byte[block_size]);
+    arena->free = arena->blocks.back().get();
+    arena->free_size = block_size;
+    std::align(alignment, size, arena->free, arena->free_size);
+  }
+  void* memory = arena->free;
+  arena->free = static_cast<std::byte*>(arena->free) + size;
+  arena->free_size -= size;
+  return memory;
+}
+
+void GraphBuilder::adopt(const Op* node) { arena->nodes.push_back(node); }
+
+std::uint32_t Sum::lower(TapeBuilder& builder) const {
+  std::vector<std::uint32_t> idxs;
+  idxs.reserve(ops.size());
+  for (const std::shared_ptr<const Op>& op : ops)
+    idxs.push_back(builder.lower(*op));
+  return builder.emit_reduction(OpCode::kSum, std::move(idxs));
+}
+
+void Sum::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  if (ops.size() == 2) {
+    node.mutable_sum()->set_op1(writer.index(*ops[0]));
+    node.mutable_sum()->set_op2(writer.index(*ops[1]));
+    return;
+  }
+  gpb::NaryOperands& nary = *node.mutable_nary_sum();
+  nary.mutable_ops()->Reserve(ops.size());
+  for (const std::shared_ptr<const Op>& op : ops)
+    nary.add_ops(writer.index(*op));
 }
 
+gpb::Graph Sum::to_proto() const noexcept { return nested_proto(*this); }
+
 std::unique_ptr<Sum> Sum::from_proto(const gpb::Sum& sproto) noexcept {
   return std::make_unique<Sum>(op_from_proto(sproto.op1()),
                                op_from_proto(sproto.op2()));
 }
 
-float Mul::eval(const Inputs& inputs) const noexcept {
-  assert(op1 && op2);
-  return op1->eval(inputs) * op2->eval(inputs);
+std::unique_ptr<Sum> Sum::from_proto(const gpb::NarySum& sproto) noexcept {
+  if (sproto.ops_size() < 2) fail("invalid graph: a sum of fewer than two terms");
+  Operands ops;
+  ops.reserve(sproto.ops_size());
+  for (const gpb::Graph& op : sproto.ops()) ops.push_back(op_from_proto(op));
+  return std::make_unique<Sum>(std::move(ops));
 }
 
-float Mul::eval_grad(const Inputs& inputs,
-                     Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept {
-  // row-major so we can give out views over the different rows to callees
-  Eigen::Matrix<float, 2, Eigen::Dynamic, Eigen::RowMajorBit> jacobian(
-      2, inputs.size());
+std::uint32_t Mul::lower(TapeBuilder& builder) const {
+  std::vector<std::uint32_t> idxs;
+  idxs.reserve(ops.size());
+  for (const std::shared_ptr<const Op>& op : ops)
+    idxs.push_back(builder.lower(*op));
+  return builder.emit_reduction(OpCode::kMul, std::move(idxs));
+}
 
-  Eigen::Map<Eigen::RowVectorXf> first_row_view(jacobian.data(),
-                                                jacobian.cols());
-  const float value1 = op1->eval_grad(inputs, first_row_view);
+void Mul::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  if (ops.size() == 2) {
+    node.mutable_mul()->set_op1(writer.index(*ops[0]));
+    node.mutable_mul()->set_op2(writer.index(*ops[1]));
+    return;
+  }
+  gpb::NaryOperands& nary = *node.mutable_nary_mul();
+  nary.mutable_ops()->Reserve(ops.size());
+  for (const std::shared_ptr<const Op>& op : ops)
+    nary.add_ops(writer.index(*op));
+}
 
-  Eigen::Map<Eigen::RowVectorXf> second_row_view(
-      jacobian.data() + jacobian.rowStride(), jacobian.cols());
-  const float value2 = op2->eval_grad(inputs, second_row_view);
+gpb::Graph Mul::to_proto() const noexcept { return nested_proto(*this); }
 
-  // dMul/dvalue_i for value1*value2 is (value2, value1)
-  Eigen::RowVector2f dmul_dops;
-  dmul_dops << value2, value1;
-  grad_out = dmul_dops * jacobian;
+std::unique_ptr<Mul> Mul::from_proto(const gpb::Mul& mproto) noexcept {
+  return std::make_unique<Mul>(op_from_proto(mproto.op1()),
+                               op_from_proto(mproto.op2()));
+}
 
-  return value1 * value2;
+std::unique_ptr<Mul> Mul::from_proto(const gpb::NaryMul& mproto) noexcept {
+  if (mproto.ops_size() < 2) fail("invalid graph: a product of fewer than two factors");
+  Operands ops;
+  ops.reserve(mproto.ops_size());
+  for (const gpb::Graph& op : mproto.ops()) ops.push_back(op_from_proto(op));
+  return std::make_unique<Mul>(std::move(ops));
 }
 
-gpb::Graph Mul::to_proto() const noexcept {
-  gpb::Mul mul;
-  *mul.mutable_op1() = op1->to_proto();
-  *mul.mutable_op2() = op2->to_proto();
+std::uint32_t Sub::lower(TapeBuilder& builder) const {
+  const std::uint32_t idx1 = builder.lower(*ops[0]);
+  const std::uint32_t idx2 = builder.lower(*ops[1]);
+  return builder.emit({OpCode::kSub, idx1, idx2});
+}
 
-  gpb::Graph ret;
-  *ret.mutable_mul() = std::move(mul);
+void Sub::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.mutable_sub()->set_op1(writer.index(*ops[0]));
+  node.mutable_sub()->set_op2(writer.index(*ops[1]));
+}
 
-  return ret;
+gpb::Graph Sub::to_proto() const noexcept { return nested_proto(*this); }
+
+std::unique_ptr<Sub> Sub::from_proto(const gpb::Sub& sproto) noexcept {
+  return std::make_unique<Sub>(op_from_proto(sproto.op1()),
+                               op_from_proto(sproto.op2()));
 }
 
-std::unique_ptr<Mul> Mul::from_proto(const gpb::Mul& mproto) noexcept {
-  return std::make_unique<Mul>(op_from_proto(mproto.op1()),
-                               op_from_proto(mproto.op2()));
+std::uint32_t Div::lower(TapeBuilder& builder) const {
+  const std::uint32_t idx1 = builder.lower(*ops[0]);
+  const std::uint32_t idx2 = builder.lower(*ops[1]);
+  return builder.emit({OpCode::kDiv, idx1, idx2});
 }
 
-float Graph::eval(const Inputs& inputs) const noexcept {
+void Div::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.mutable_div()->set_op1(writer.index(*ops[0]));
+  node.mutable_div()->set_op2(writer.index(*ops[1]));
+}
+
+gpb::Graph Div::to_proto() const noexcept { return nested_proto(*this); }
+
+std::unique_ptr<Div> Div::from_proto(const gpb::Div& dproto) noexcept {
+  return std::make_unique<Div>(op_from_proto(dproto.op1()),
+                               op_from_proto(dproto.op2()));
+}
+
+std::uint32_t Neg::lower(TapeBuilder& builder) const {
+  return builder.emit({OpCode::kNeg, builder.lower(*ops[0]), 0});
+}
+
+void Neg::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.set_neg(writer.index(*ops[0]));
+}
+
+gpb::Graph Neg::to_proto() const noexcept { return nested_proto(*this); }
+
+std::unique_ptr<Neg> Neg::from_proto(const gpb::Neg& nproto) noexcept {
+  return std::make_unique<Neg>(op_from_proto(nproto.op()));
+}
+
+std::uint32_t Pow::lower(TapeBuilder& builder) const {
+  const std::uint32_t idx = builder.lower(*ops[0]);
+  return builder.emit({OpCode::kPow, idx, std::uint32_t(exponent)});
+}
+
+void Pow::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.mutable_pow()->set_op(writer.index(*ops[0]));
+  node.mutable_pow()->set_exponent(exponent);
+}
+
+gpb::Graph Pow::to_proto() const noexcept { return nested_proto(*this); }
+
+std::unique_ptr<Pow> Pow::from_proto(const gpb::Pow& pproto) noexcept {
+  return std::make_unique<Pow>(op_from_proto(pproto.op()), pproto.exponent());
+}
+
+std::uint32_t Exp::lower(TapeBuilder& builder) const {
+  return builder.emit({OpCode::kExp, builder.lower(*ops[0]), 0});
+}
+
+void Exp::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.set_exp(writer.index(*ops[0]));
+}
+
+gpb::Graph Exp::to_proto() const noexcept { return nested_proto(*this); }
+
+std::unique_ptr<Exp> Exp::from_proto(const gpb::Exp& eproto) noexcept {
+  return std::make_unique<Exp>(op_from_proto(eproto.op()));
+}
+
+std::uint32_t Log::lower(TapeBuilder& builder) const {
+  return builder.emit({OpCode::kLog, builder.lower(*ops[0]), 0});
+}
+
+void Log::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.set_log(writer.index(*ops[0]));
+}
+
+gpb::Graph Log::to_proto() const noexcept { return nested_proto(*this); }
+
+std::unique_ptr<Log> Log::from_proto(const gpb::Log& lproto) noexcept {
+  return std::make_unique<Log>(op_from_proto(lproto.op()));
+}
+
+Graph::Graph(const Graph& other)
+    : op(other.op), compiled_cache(std::atomic_load(&other.compiled_cache)) {}
+
+Graph& Graph::operator=(const Graph& other) {
+  op = other.op;
+  std::atomic_store(&compiled_cache, std::atomic_load(&other.compiled_cache));
+  return *this;
+}
+
+const CompiledGraph& Graph::compiled() const {
+  std::shared_ptr<const CompiledGraph> cg = std::atomic_load(&compiled_cache);
+  if (!cg) {
+    // concurrent first calls might all compile: only one result is kept
+    auto fresh = std::make_shared<const CompiledGraph>(compile());
+    if (std::atomic_compare_exchange_strong(&compiled_cache, &cg, fresh))
+      cg = std::move(fresh);
+  }
+  // the cache is never reset, so it keeps the result alive
+  return *cg;
+}
+
+CompiledGraph Graph::compile() const {
+  assert(op);
+  TapeBuilder builder;
+  builder.finish(builder.lower(*op));
+  return std::move(builder).build();
+}
+
+Graph Graph::optimize() const {
+  assert(op);
+  TapeBuilder builder;
+  builder.finish(builder.lower(*op));
+  return std::move(builder).raise();
+}
+
+Graph Graph::simplify() const {
+  assert(op);
+  TapeBuilder builder(/*merge_identical=*/false);
+  builder.finish(builder.lower(*op));
+  return std::move(builder).raise();
+}
+
+GraphStats Graph::stats() const {
+  assert(op);
+  absl::flat_hash_map<const Op*, std::uint32_t> idxs;
+  const std::vector<const Op*> nodes = post_order(*op, idxs);
+
+  GraphStats stats;
+  // per node: the longest path to a leaf, the number of nodes of the
+  // expression tree it is the root of and the number of its users
+  std::vector<std::size_t> depth(nodes.size(), 0);
+  std::vector<double> tree_size(nodes.size(), 1.);
+  std::vector<std::size_t> uses(nodes.size(), 0);
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    const Op* node = nodes[i];
+    if (dynamic_cast<const Const*>(node))
+      ++stats.n_consts;
+    else if (dynamic_cast<const Var*>(node))
+      ++stats.n_vars;
+    else if (dynamic_cast<const Sum*>(node))
+      ++stats.n_sums;
+    else if (dynamic_cast<const Mul*>(node))
+      ++stats.n_muls;
+    else
+      ++stats.n_other_ops;
+
+    for (const std::shared_ptr<const Op>& operand : node->operands()) {
+      const std::uint32_t j = idxs.at(operand.get());
+      depth[i] = std::max(depth[i], 1 + depth[j]);
+      tree_size[i] += tree_size[j];
+      ++uses[j];
+    }
+  }
+
+  stats.depth = depth.back();
+  for (std::size_t n_uses : uses) {
+    stats.max_fan_out = std::max(stats.max_fan_out, n_uses);
+    if (n_uses > 1) ++stats.n_shared;
+  }
+  stats.sharing_ratio = tree_size.back() / stats.n_nodes();
+  return stats;
+}
+
+std::size_t Graph::size() const {
   assert(op);
-  return op->eval(inputs);
+  absl::flat_hash_map<const Op*, std::uint32_t> idxs;
+  return post_order(*op, idxs).size();
+}
+
+const VariableLayout& Graph::layout() const { return compiled().layout(); }
+
+MultiGraph::MultiGraph(std::vector<Graph> outputs)
+    : outputs_(std::move(outputs)) {
+  assert(!outputs_.empty());
+}
+
+MultiGraph::MultiGraph(const MultiGraph& other)
+    : outputs_(other.outputs_),
+      compiled_cache(std::atomic_load(&other.compiled_cache)) {}
+
+MultiGraph& MultiGraph::operator=(const MultiGraph& other) {
+  outputs_ = other.outputs_;
+  std::atomic_store(&compiled_cache, std::atomic_load(&other.compiled_cache));
+  return *this;
+}
+
+const CompiledMultiGraph& MultiGraph::compiled() const {
+  std::shared_ptr<const CompiledMultiGraph> cg =
+      std::atomic_load(&compiled_cache);
+  if (!cg) {
+    // same as Graph::compiled()
+    auto fresh = std::make_shared<const CompiledMultiGraph>(compile());
+    if (std::atomic_compare_exchange_strong(&compiled_cache, &cg, fresh))
+      cg = std::move(fresh);
+  }
+  return *cg;
+}
+
+CompiledMultiGraph MultiGraph::compile() const {
+  // all outputs are lowered by the same builder, so that identical
+  // subgraphs are merged across outputs too
+  TapeBuilder builder;
+  std::vector<std::uint32_t> roots;
+  roots.reserve(outputs_.size());
+  for (const Graph& output : outputs_) {
+    assert(output.op);
+    roots.push_back(builder.lower(*output.op));
+  }
+  std::vector<std::uint32_t> outputs = builder.finish(roots);
+  return CompiledMultiGraph(std::move(builder).build(), std::move(outputs));
+}
+
+Eigen::VectorXf MultiGraph::eval(const Inputs& inputs) const noexcept {
+  return compiled().eval(inputs);
+}
+
+std::pair<Eigen::VectorXf, Eigen::MatrixXf> MultiGraph::eval_jacobian(
+    const Inputs& inputs, GradMode mode) const noexcept {
+  return compiled().eval_jacobian(inputs, mode);
+}
+
+const VariableLayout& MultiGraph::layout() const {
+  return compiled().layout();
+}
+
+Eigen::VectorXf Graph::eval_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs) const {
+  return compiled().eval_batch(inputs);
+}
+
+std::pair<Eigen::VectorXf, Eigen::MatrixXf> Graph::eval_grad_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs) const {
+  return compiled().eval_grad_batch(inputs);
+}
+
+Eigen::VectorXf Graph::eval_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs, ThreadPool& pool) const {
+  return compiled().eval_batch(inputs, pool);
+}
+
+std::pair<Eigen::VectorXf, Eigen::MatrixXf> Graph::eval_grad_batch(
+    const Eigen::Ref<const Eigen::MatrixXf>& inputs, ThreadPool& pool) const {
+  return compiled().eval_grad_batch(inputs, pool);
+}
+
+float Graph::eval(const Inputs& inputs) const noexcept {
+  return compiled().eval(inputs);
+}
+
+float Graph::eval(absl::Span<const float> inputs) const noexcept {
+  return compiled().eval(inputs);
+}
+
+std::pair<float, Eigen::RowVectorXf> Graph::eval_grad(
+    const Inputs& inputs, GradMode mode) const noexcept {
+  return compiled().eval_grad(inputs, mode);
 }
 
 std::pair<float, Eigen::RowVectorXf> Graph::eval_grad(
+    const Inputs& inputs, absl::Span<const std::string_view> wrt,
+    GradMode mode) const noexcept {
+  const CompiledGraph& cg = compiled();
+  return cg.eval_grad(inputs, cg.select(wrt), mode);
+}
+
+std::pair<float, Eigen::RowVectorXf> Graph::eval_grad(
+    absl::Span<const float> inputs, GradMode mode) const noexcept {
+  return compiled().eval_grad(inputs, mode);
+}
+
+std::pair<float, Eigen::MatrixXf> Graph::eval_hessian(
     const Inputs& inputs) const noexcept {
-  assert(op);
+  return compiled().eval_hessian(inputs);
+}
 
-  Eigen::RowVectorXf grads(inputs.size());
-  Eigen::Map<Eigen::RowVectorXf> grads_view(grads.data(), grads.size());
-  return {op->eval_grad(inputs, grads_view), grads};
+std::pair<float, Eigen::SparseMatrix<float>> Graph::eval_sparse_hessian(
+    const Inputs& inputs) const {
+  return compiled().eval_sparse_hessian(inputs);
 }
 
-float Const::eval_grad(
-    const Inputs& inputs,
-    Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept {
-  // derivatives of a constant are all zero
-  for (std::size_t i = 0; i < inputs.size(); ++i) grad_out[i] = 0;
-  return value;
+Eigen::RowVectorXf Graph::hvp(
+    const Inputs& inputs, const Eigen::Ref<const Eigen::RowVectorXf>& v) const {
+  return compiled().hvp(inputs, v);
+}
+
+std::uint32_t Const::lower(TapeBuilder& builder) const {
+  return builder.emit_const(value);
+}
+
+void Const::to_node(NodeTableWriter&, gpb::Node& node) const {
+  node.set_const_(value);
 }
 
 gpb::Graph Const::to_proto() const noexcept {
@@ -177,29 +1253,17 @@ std::unique_ptr<Const> Const::from_proto(const gpb::Const& cproto) noexcept {
   return std::make_unique<Const>(cproto.value());
 }
 
-float Var::eval(const Inputs& inputs) const noexcept {
-  auto var_it = inputs.find(name);
-  if (var_it == inputs.end()) {
-    std::abort();  // TODO also log an error
-  }
-  return var_it->second;
+std::uint32_t Var::lower(TapeBuilder& builder) const {
+  return builder.emit_var(id);
 }
 
-float Var::eval_grad(const Inputs& inputs,
-                     Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept {
-  // derivatives of a variable w.r.t. all variables is a one-hot vector:
-  // the only 1. is at the position of the variable itself
-  for (std::size_t i = 0; i < inputs.size(); ++i) grad_out[i] = 0;
-  // TODO find a way to move this out of the hot loop
-  const std::size_t var_idx = find_var_idx(name, inputs);
-  grad_out[var_idx] = 1.;
-
-  return eval(inputs);
+void Var::to_node(NodeTableWriter& writer, gpb::Node& node) const {
+  node.set_var(writer.var_index(id));
 }
 
 gpb::Graph Var::to_proto() const noexcept {
   gpb::Var var;
-  var.set_name(name);
+  var.set_name(std::string(name()));
 
   gpb::Graph ret;
   *ret.mutable_var() = std::move(var);
@@ -211,12 +1275,113 @@ std::unique_ptr<Var> Var::from_proto(const gpb::Var& vproto) noexcept {
   return std::make_unique<Var>(vproto.name());
 }
 
-gpb::Graph Graph::to_proto() const noexcept { return op->to_proto(); }
+gpb::Graph Graph::to_proto() const noexcept {
+  assert(op);
+  gpb::Graph ret;
+  *ret.mutable_dag() = NodeTableWriter(*op).to_dag_proto();
+  return ret;
+}
 
 Graph Graph::from_proto(const gpb::Graph& gproto) noexcept {
+  if (gproto.has_dag()) {
+    absl::StatusOr<Graph> graph = graph_from_dag_proto(gproto.dag());
+    if (!graph.ok()) fail(graph.status());
+    return *std::move(graph);
+  }
   return Graph(op_from_proto(gproto));
 }
 
+template <typename Node>
+Graph NodeFactory::binary(OpCode opcode, const Graph& g1, const Graph& g2) {
+  // sums and products are commutative: x*y and y*x are the same
+  const Op* op1 = g1.op.get();
+  const Op* op2 = g2.op.get();
+  if ((opcode == OpCode::kSum || opcode == OpCode::kMul) &&
+      std::less<const Op*>()(op2, op1))
+    std::swap(op1, op2);
+  auto [it, inserted] = ops.try_emplace(NodeKey{opcode, op1, op2, 0}, nullptr);
+  if (inserted) it->second = make_node<Node>(g1.op, g2.op);
+  return Graph(it->second);
+}
+
+template <typename Node>
+Graph NodeFactory::unary(OpCode opcode, const Graph& g,
+                         std::int32_t exponent) {
+  auto [it, inserted] =
+      ops.try_emplace(NodeKey{opcode, g.op.get(), nullptr, exponent}, nullptr);
+  if (inserted) {
+    if constexpr (std::is_same_v<Node, Pow>)
+      it->second = make_node<Pow>(g.op, exponent);
+    else
+      it->second = make_node<Node>(g.op);
+  }
+  return Graph(it->second);
+}
+
+Graph NodeFactory::var(std::string_view name) {
+  const VarId id(name);
+  auto [it, inserted] = vars.try_emplace(id, nullptr);
+  if (inserted) it->second = make_node<Var>(id);
+  return Graph(it->second);
+}
+
+Graph NodeFactory::constant(float value) {
+  auto [it, inserted] =
+      consts.try_emplace(absl::bit_cast<std::uint32_t>(value), nullptr);
+  if (inserted) it->second = make_node<Const>(value);
+  return Graph(it->second);
+}
+
+Graph NodeFactory::sum(const Graph& g1, const Graph& g2) {
+  return binary<Sum>(OpCode::kSum, g1, g2);
+}
+
+Graph NodeFactory::mul(const Graph& g1, const Graph& g2) {
+  return binary<Mul>(OpCode::kMul, g1, g2);
+}
+
+Graph NodeFactory::sub(const Graph& g1, const Graph& g2) {
+  return binary<Sub>(OpCode::kSub, g1, g2);
+}
+
+Graph NodeFactory::div(const Graph& g1, const Graph& g2) {
+  return binary<Div>(OpCode::kDiv, g1, g2);
+}
+
+Graph NodeFactory::neg(const Graph& g) {
+  return unary<Neg>(OpCode::kNeg, g);
+}
+
+Graph NodeFactory::pow(const Graph& g, std::int32_t n) {
+  return unary<Pow>(OpCode::kPow, g, n);
+}
+
+Graph NodeFactory::exp(const Graph& g) {
+  return unary<Exp>(OpCode::kExp, g);
+}
+
+Graph NodeFactory::log(const Graph& g) {
+  return unary<Log>(OpCode::kLog, g);
+}
+
+Graph graph_autodiff::sum(absl::Span<const Graph> terms) {
+  if (terms.empty()) return Graph(make_node<Const>(0.f));
+  if (terms.size() == 1) return terms.front();
+  Op::Operands ops;
+  ops.reserve(terms.size());
+  for (const Graph& term : terms) ops.push_back(term.op);
+  return Graph(make_node<Sum>(std::move(ops)));
+}
+
+Graph graph_autodiff::product(absl::Span<const Graph> factors) {
+  if (factors.empty()) return Graph(make_node<Const>(1.f));
+  if (factors.size() == 1) return factors.front();
+  Op::Operands ops;
+  ops.reserve(factors.size());
+  for (const Graph& factor : factors) ops.push_back(factor.op);
+  return Graph(make_node<Mul>(std::move(ops)));
+}
+
 absl::Status graph_autodiff::to_file(const Graph& graph, fs::path path) {
   absl::Status ret_status = absl::OkStatus();
 
@@ -260,6 +1425,123 @@ absl::StatusOr<Graph> graph_autodiff::from_file(fs::path path) {
     }
   }
 
-  absl::StatusOr<Graph> ret = Graph::from_proto(gproto);
+  absl::StatusOr<Graph> ret = gproto.has_dag()
+                                  ? graph_from_dag_proto(gproto.dag())
+                                  : Graph::from_proto(gproto);
+  if (!ret.ok()) {
+    return absl::InvalidArgumentError(fmt::format(
+        "File {} contains an invalid graph: {}", path.string(),
+        std::string(ret.status().message())));
+  }
   return ret;
 }
+
+std::vector<std::future<absl::StatusOr<Graph>>>
+graph_autodiff::from_files_async(absl::Span<const fs::path> paths,
+                                 ThreadPool& pool, bool compile) {
+  std::vector<std::future<absl::StatusOr<Graph>>> futures;
+  futures.reserve(paths.size());
+  for (const fs::path& path : paths) {
+    // tasks must be copyable, promises are not
+    auto promise = std::make_shared<std::promise<absl::StatusOr<Graph>>>();
+    futures.push_back(promise->get_future());
+    pool.submit([promise, path, compile] {
+      try {
+        absl::StatusOr<Graph> graph = from_file(path);
+        // compile now, caching the result for the evaluations to come
+        if (graph.ok() && compile) graph->compiled();
+        promise->set_value(std::move(graph));
+      } catch (...) {  // e.g. std::bad_alloc: not the pool's business
+        promise->set_exception(std::current_exception());
+      }
+    });
+  }
+  return futures;
+}
+
+absl::Status graph_autodiff::to_chunked_file(const Graph& graph,
+                                             fs::path path,
+                                             std::size_t nodes_per_chunk) {
+  assert(graph.op);
+  assert(nodes_per_chunk > 0);
+  NodeTableWriter writer(*graph.op);
+
+  std::ofstream out_file(path, std::ios::binary);
+  if (!out_file.good()) {
+    return absl::InvalidArgumentError(
+        fmt::format("Could not open file {} for writing.", path.string()));
+  }
+
+  {
+    google::protobuf::io::OstreamOutputStream out_stream(&out_file);
+    google::protobuf::io::CodedOutputStream out(&out_stream);
+    std::size_t n_vars_written = 0;
+    gpb::DagChunk chunk;
+    for (std::size_t begin = 0; begin < writer.size();
+         begin += nodes_per_chunk) {
+      const std::size_t end = std::min(begin + nodes_per_chunk, writer.size());
+      chunk.Clear();
+      writer.write(begin, end, *chunk.mutable_nodes());
+
+      // the variables first referred to by this chunk
+      const absl::Span<const VarId> var_ids = writer.variables();
+      for (; n_vars_written < var_ids.size(); ++n_vars_written)
+        chunk.add_var_names(std::string(var_ids[n_vars_written].name()));
+
+      out.WriteVarint32(chunk.ByteSizeLong());
+      chunk.SerializeWithCachedSizes(&out);
+    }
+  }
+
+  if (!out_file.good()) {
+    return absl::AbortedError(
+        fmt::format("Something went wrong while serializing Graph to file {}",
+                    path.string()));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<Graph> graph_autodiff::from_chunked_file(fs::path path) {
+  std::ifstream in_file(path, std::ios::binary);
+  if (!in_file.good()) {
+    return absl::InvalidArgumentError(
+        fmt::format("Could not open file {} for reading.", path.string()));
+  }
+
+  google::protobuf::io::IstreamInputStream in_stream(&in_file);
+  NodeTableReader reader;
+  gpb::DagChunk chunk;
+  while (true) {
+    // stop cleanly at the end of the file, between two chunks
+    const void* data = nullptr;
+    int size = 0;
+    if (!in_stream.Next(&data, &size)) break;
+    in_stream.BackUp(size);
+
+    // a fresh CodedInputStream per chunk, so that its byte limit applies to
+    // single chunks rather than to the whole file
+    google::protobuf::io::CodedInputStream in(&in_stream);
+    std::uint32_t chunk_size = 0;
+    if (!in.ReadVarint32(&chunk_size)) {
+      return absl::AbortedError(fmt::format(
+          "Something went wrong while reading a chunk from file {}",
+          path.string()));
+    }
+    const auto limit = in.PushLimit(chunk_size);
+    if (!chunk.ParseFromCodedStream(&in) || !in.ConsumedEntireMessage()) {
+      return absl::AbortedError(fmt::format(
+          "Something went wrong while reading a chunk from file {}",
+          path.string()));
+    }
+    in.PopLimit(limit);
+
+    reader.add_vars(chunk.var_names());
+    if (absl::Status status = reader.add_nodes(chunk.nodes()); !status.ok()) {
+      return absl::InvalidArgumentError(
+          fmt::format("File {} contains an invalid graph: {}", path.string(),
+                      std::string(status.message())));
+    }
+  }
+
+  return std::move(reader).finish();
+}
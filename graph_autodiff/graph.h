@@ -5,18 +5,33 @@ This is free software, and you are welcome to redistribute it
 under certain conditions: see LICENSE.
 */
 
+#pragma once
+
+#include <array>
 #include <cassert>
+#include <cstddef>  // std::size_t
+#include <cstdint>
 #include <filesystem>  // std::path
+#include <future>
 #include <memory>
+#include <new>  // placement new
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <utility>  // std::pair
+#include <vector>
 
 #include "Eigen/Core"
+#include "Eigen/SparseCore"
 #include "absl/container/flat_hash_map.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "graph_autodiff/compiled_graph.h"
 #include "graph_autodiff/graph.pb.h"
+#include "graph_autodiff/var_id.h"
 
 /* A note on the use of shared_ptr<const T>
 
@@ -33,106 +48,564 @@ namespace graph_autodiff {
 
 namespace gpb = graph_proto;
 
-/// Inputs to a graph's eval function: a mapping from variable name to value.
-using Inputs = absl::flat_hash_map<std::string, float>;
+class TapeBuilder;      // defined in graph.cpp
+class NodeTableWriter;  // defined in graph.cpp
 
 /// An operation in the compute graph (e.g. addition, multiplication).
+/// Operations are only used to build compute graphs: evaluation happens on
+/// the CompiledGraph they are lowered to.
 // We need a virtual base class to break dependency cycles e.g. between
 // Sum and Mul which they can point to each other.
 class Op {
+ protected:
+  /// Release the operands of an operation that is being destroyed.
+  /// Operands whose last reference this was are destroyed iteratively
+  /// rather than recursively, so that destroying deep graphs (e.g. long
+  /// chains of sums) cannot overflow the stack.
+  static void release(
+      absl::Span<std::shared_ptr<const Op>> operands) noexcept;
+
  public:
+  /// The operands of operations that have any number of them, e.g. Sum.
+  using Operands = absl::InlinedVector<std::shared_ptr<const Op>, 2>;
+
   virtual ~Op() {}
 
-  /// Evaluate this operation on the inputs provided.
-  virtual float eval(const Inputs& inputs) const noexcept = 0;
+  /// The operands of this operation: none for leaves such as Const and Var.
+  /// Graph traversals use this to visit graphs without recursion.
+  /// Operands in the same GraphBuilder arena as this operation are not owned
+  /// by it, so copies of these pointers must not outlive the operation.
+  virtual absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept {
+    return {};
+  }
+
+  /// Append the instructions that compute this operation to the tape being
+  /// built by Graph::compile(). Returns the index of the instruction that
+  /// holds the result. The builder lowers all operands() first.
+  virtual std::uint32_t lower(TapeBuilder& builder) const = 0;
 
-  /// Evaluate this operation and its gradient w.r.t. the inputs provided.
-  /// The `grad_out` argument is a buffer of sufficient size that the caller
-  /// allocated that should be filled with the values of the gradients.
-  /// See Graph::eval_grad() for more information.
-  virtual float eval_grad(
-      const Inputs& inputs,
-      Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept = 0;
+  /// Describe this operation as `node` of the node table being written by
+  /// Graph::to_proto(), as a single node whatever its number of operands.
+  /// The writer provides the indices of the operands() in the table, which
+  /// it writes first.
+  virtual void to_node(NodeTableWriter& writer, gpb::Node& node) const = 0;
 
-  /// Retrieve a protobuf representation of the operation.
+  /// Retrieve a protobuf representation of the operation, in the nested
+  /// format: shared operands are repeated once per use.
   virtual gpb::Graph to_proto() const noexcept = 0;
 };
 
-/// A sum operation, with two operands that can be operations themselves.
+/// Create a node of type `Node` from `args`: in the arena of the
+/// GraphBuilder that is active on this thread if there is one, on the heap
+/// otherwise. All operators that build graphs create their nodes this way.
+template <typename Node, typename... Args>
+std::shared_ptr<const Op> make_node(Args&&... args);
+
+/// A sum operation, with two or more operands that can be operations
+/// themselves. A sum of many terms is a single node rather than a chain of
+/// binary sums, see sum(absl::Span<const Graph>).
 class Sum : public Op {
-  std::shared_ptr<const Op> op1, op2;
+  Operands ops;
 
  public:
   Sum(std::shared_ptr<const Op> op1, std::shared_ptr<const Op> op2)
-      : op1(std::move(op1)), op2(std::move(op2)) {}
+      : ops{std::move(op1), std::move(op2)} {}
+  explicit Sum(Operands ops_) : ops(std::move(ops_)) {
+    assert(ops.size() >= 2);
+  }
+
+  ~Sum() override { release(absl::MakeSpan(ops)); }
 
-  float eval(const Inputs& inputs) const noexcept final;
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
 
-  float eval_grad(
-      const Inputs& inputs,
-      Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept final;
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
 
   gpb::Graph to_proto() const noexcept final;
 
   static std::unique_ptr<Sum> from_proto(const gpb::Sum& sproto) noexcept;
+  static std::unique_ptr<Sum> from_proto(const gpb::NarySum& sproto) noexcept;
 };
 
-/// A multiplication operation, with two operands that can be operations
-/// themselves.
+/// A multiplication operation, with two or more operands that can be
+/// operations themselves. A product of many factors is a single node, see
+/// product(absl::Span<const Graph>).
 class Mul : public Op {
-  std::shared_ptr<const Op> op1, op2;
+  Operands ops;
 
  public:
   Mul(std::shared_ptr<const Op> op1, std::shared_ptr<const Op> op2)
-      : op1(std::move(op1)), op2(std::move(op2)) {}
+      : ops{std::move(op1), std::move(op2)} {}
+  explicit Mul(Operands ops_) : ops(std::move(ops_)) {
+    assert(ops.size() >= 2);
+  }
 
-  float eval(const Inputs& inputs) const noexcept final;
+  ~Mul() override { release(absl::MakeSpan(ops)); }
 
-  float eval_grad(
-      const Inputs& inputs,
-      Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept final;
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
 
   gpb::Graph to_proto() const noexcept final;
 
   static std::unique_ptr<Mul> from_proto(const gpb::Mul& mproto) noexcept;
+  static std::unique_ptr<Mul> from_proto(const gpb::NaryMul& mproto) noexcept;
+};
+
+/// A subtraction operation: its first operand minus the second.
+class Sub : public Op {
+  std::array<std::shared_ptr<const Op>, 2> ops;
+
+ public:
+  Sub(std::shared_ptr<const Op> op1, std::shared_ptr<const Op> op2)
+      : ops{std::move(op1), std::move(op2)} {}
+
+  ~Sub() override { release(absl::MakeSpan(ops)); }
+
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
+
+  gpb::Graph to_proto() const noexcept final;
+
+  static std::unique_ptr<Sub> from_proto(const gpb::Sub& sproto) noexcept;
+};
+
+/// A division operation: its first operand divided by the second.
+class Div : public Op {
+  std::array<std::shared_ptr<const Op>, 2> ops;
+
+ public:
+  Div(std::shared_ptr<const Op> op1, std::shared_ptr<const Op> op2)
+      : ops{std::move(op1), std::move(op2)} {}
+
+  ~Div() override { release(absl::MakeSpan(ops)); }
+
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
+
+  gpb::Graph to_proto() const noexcept final;
+
+  static std::unique_ptr<Div> from_proto(const gpb::Div& dproto) noexcept;
+};
+
+/// The opposite of its operand.
+class Neg : public Op {
+  std::array<std::shared_ptr<const Op>, 1> ops;
+
+ public:
+  explicit Neg(std::shared_ptr<const Op> op) : ops{std::move(op)} {}
+
+  ~Neg() override { release(absl::MakeSpan(ops)); }
+
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
+
+  gpb::Graph to_proto() const noexcept final;
+
+  static std::unique_ptr<Neg> from_proto(const gpb::Neg& nproto) noexcept;
+};
+
+/// Its operand to a (possibly negative) integer power. This is a single node
+/// whatever the exponent, with derivative `n * x^(n-1)`: `pow(x, 3)` is
+/// cheaper to evaluate and differentiate than `x * x * x`.
+class Pow : public Op {
+  std::array<std::shared_ptr<const Op>, 1> ops;
+  std::int32_t exponent;
+
+ public:
+  Pow(std::shared_ptr<const Op> op, std::int32_t exponent)
+      : ops{std::move(op)}, exponent(exponent) {}
+
+  ~Pow() override { release(absl::MakeSpan(ops)); }
+
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
+
+  gpb::Graph to_proto() const noexcept final;
+
+  static std::unique_ptr<Pow> from_proto(const gpb::Pow& pproto) noexcept;
+};
+
+/// The exponential of its operand.
+class Exp : public Op {
+  std::array<std::shared_ptr<const Op>, 1> ops;
+
+ public:
+  explicit Exp(std::shared_ptr<const Op> op) : ops{std::move(op)} {}
+
+  ~Exp() override { release(absl::MakeSpan(ops)); }
+
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
+
+  gpb::Graph to_proto() const noexcept final;
+
+  static std::unique_ptr<Exp> from_proto(const gpb::Exp& eproto) noexcept;
+};
+
+/// The natural logarithm of its operand.
+class Log : public Op {
+  std::array<std::shared_ptr<const Op>, 1> ops;
+
+ public:
+  explicit Log(std::shared_ptr<const Op> op) : ops{std::move(op)} {}
+
+  ~Log() override { release(absl::MakeSpan(ops)); }
+
+  absl::Span<const std::shared_ptr<const Op>> operands()
+      const noexcept final {
+    return ops;
+  }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
+
+  gpb::Graph to_proto() const noexcept final;
+
+  static std::unique_ptr<Log> from_proto(const gpb::Log& lproto) noexcept;
+};
+
+/// Structural statistics of a compute graph, see Graph::stats().
+/// Nodes that are shared by several operations are counted once.
+struct GraphStats {
+  std::size_t n_sums = 0;
+  std::size_t n_muls = 0;
+  /// Subtractions, divisions, negations, powers, exponentials and logarithms.
+  std::size_t n_other_ops = 0;
+  std::size_t n_vars = 0;
+  std::size_t n_consts = 0;
+  /// The number of operations on the longest path from the root to a leaf.
+  std::size_t depth = 0;
+  /// The largest number of operations that use the same node as an operand.
+  std::size_t max_fan_out = 0;
+  /// The number of nodes used by more than one operation.
+  std::size_t n_shared = 0;
+  /// The number of nodes the graph would have without sharing (i.e. of the
+  /// expression it represents, written out in full) over n_nodes(). This is
+  /// 1 for trees and can grow exponentially with the depth of the graph.
+  double sharing_ratio = 1.;
+
+  /// The number of distinct nodes, as returned by Graph::size().
+  std::size_t n_nodes() const noexcept {
+    return n_sums + n_muls + n_other_ops + n_vars + n_consts;
+  }
 };
 
 /// A compute graph.
 /// Can be combined with other graphs via operations like Sum and Mul,
-/// and related math operators.
+/// and related math operators: `+`, `-`, `*`, `/`, unary `-`, and the
+/// functions pow() (with an integer exponent), exp(), log(), sum() and
+/// product().
+///
+/// Thread safety: nodes are immutable and shared via `shared_ptr<const Op>`,
+/// so graphs (and graphs that share nodes) can be built, read and evaluated
+/// from any number of threads at the same time. All const member functions,
+/// including evaluations, can be called concurrently on the same instance:
+/// the graph is compiled on first use with atomic operations (concurrent
+/// first calls may each compile it, and one of the results is kept) and
+/// evaluations use per-thread contexts, see CompiledGraph. As with standard
+/// library types, assigning to a Graph while other threads use the same
+/// instance is a data race.
 class Graph {
+  friend class NodeFactory;
+  friend class MultiGraph;
+  friend absl::Status to_chunked_file(const Graph& graph, fs::path path,
+                                      std::size_t nodes_per_chunk);
+  friend std::vector<std::future<absl::StatusOr<Graph>>> from_files_async(
+      absl::Span<const fs::path> paths, ThreadPool& pool, bool compile);
+
   std::shared_ptr<const Op> op;
+  /// Lazily-populated cache for compiled(). Only ever accessed atomically.
+  mutable std::shared_ptr<const CompiledGraph> compiled_cache;
+
+  /// The CompiledGraph that backs eval() and eval_grad(), built on first use.
+  const CompiledGraph& compiled() const;
 
  public:
   Graph(std::shared_ptr<const Op> op) : op(op) { assert(op); }
+  Graph(const Graph& other);
+  Graph(Graph&& other) = default;
+  Graph& operator=(const Graph& other);
+  Graph& operator=(Graph&& other) = default;
 
   // using the hidden friend pattern not to pollute the global namespace:
   // https://www.open-std.org/jtc1/sc22/wg21/docs/papers/2019/p1601r0.pdf
   friend Graph operator+(const Graph& g1, const Graph& g2) {
-    return Graph(std::make_shared<const Sum>(g1.op, g2.op));
+    return Graph(make_node<Sum>(g1.op, g2.op));
   }
 
   friend Graph operator*(const Graph& g1, const Graph& g2) {
-    return Graph(std::make_shared<const Mul>(g1.op, g2.op));
+    return Graph(make_node<Mul>(g1.op, g2.op));
+  }
+
+  friend Graph operator-(const Graph& g1, const Graph& g2) {
+    return Graph(make_node<Sub>(g1.op, g2.op));
+  }
+
+  friend Graph operator/(const Graph& g1, const Graph& g2) {
+    return Graph(make_node<Div>(g1.op, g2.op));
+  }
+
+  friend Graph operator-(const Graph& g) { return Graph(make_node<Neg>(g.op)); }
+
+  friend Graph pow(const Graph& g, std::int32_t n) {
+    return Graph(make_node<Pow>(g.op, n));
   }
 
+  friend Graph exp(const Graph& g) { return Graph(make_node<Exp>(g.op)); }
+
+  friend Graph log(const Graph& g) { return Graph(make_node<Log>(g.op)); }
+
+  friend Graph sum(absl::Span<const Graph> terms);
+  friend Graph product(absl::Span<const Graph> factors);
+
+  /// Lower the graph to a flat instruction tape.
+  /// Evaluating the resulting CompiledGraph is much cheaper than walking the
+  /// graph: callers that evaluate the same graph many times should compile
+  /// it once and reuse the result.
+  /// The graph is optimized in the process: it is simplified (see
+  /// simplify()) and structurally identical subgraphs are merged, so that
+  /// each is only evaluated once.
+  CompiledGraph compile() const;
+
+  /// Return an equivalent graph in which structurally identical subgraphs
+  /// (e.g. the two `x*y` in `x*y*z + x*y`) are a single, shared node, and
+  /// that is simplified as by simplify().
+  Graph optimize() const;
+
+  /// Return an equivalent graph in which constant subexpressions are folded
+  /// (`2 * 3` becomes `6`), identity and absorbing elements are removed
+  /// (`x + 0` and `x * 1` become `x`, `x * 0` becomes `0`) and chained
+  /// constant terms and coefficients are merged (`2 * (3 * x)` becomes
+  /// `6 * x`). compile() and optimize() apply this automatically.
+  /// Note that `x * 0` is folded to `0` even though it would evaluate to NaN
+  /// for an infinite or NaN `x`, and that variables whose contribution is
+  /// eliminated are no longer part of the returned graph.
+  Graph simplify() const;
+
+  /// The number of distinct nodes in the graph. Nodes that are shared by
+  /// several operations are counted once, and a sum or product of many terms
+  /// (see sum(absl::Span<const Graph>)) is one node.
+  std::size_t size() const;
+
+  /// Count the nodes of the graph by type and measure its depth and how
+  /// much sharing there is, e.g. to find out why a graph is slow to
+  /// evaluate. The graph is inspected as built, before the merging and
+  /// simplifications that compile() applies: see
+  /// CompiledGraph::instructions() for the evaluated tape.
+  GraphStats stats() const;
+
+  /// Evaluate the graph at the given point.
+  /// The graph is compiled on first use and the result is cached, see
+  /// compile().
   float eval(const Inputs& inputs) const noexcept;
 
+  /// Evaluate the graph at the given point, passed as one value per variable
+  /// in the order given by layout().
+  float eval(absl::Span<const float> inputs) const noexcept;
+
   /// Evaluate the graph and its gradient at the given point.
   /// The elements of the gradient are the derivative w.r.t. the input variables
   /// in alphabetical order.
-  /// The gradient is evaluated via automatic differentiation (forward mode).
-  // TODO let users specify w.r.t. which variables to derive.
+  /// The gradient is evaluated via automatic differentiation, in forward or
+  /// reverse mode depending on `mode`. By default the mode is picked by
+  /// choose_grad_mode().
   std::pair<float, Eigen::RowVectorXf> eval_grad(
+      const Inputs& inputs, GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Same as eval(const Inputs&) and eval_grad(const Inputs&, GradMode), in
+  /// precision `T`: float or double, e.g. `g.eval<double>(inputs)`. See
+  /// CompiledGraph for the other overloads with a scalar type parameter.
+  template <typename T>
+  T eval(const BasicInputs<T>& inputs) const noexcept {
+    return compiled().eval<T>(inputs);
+  }
+
+  template <typename T>
+  std::pair<T, Eigen::RowVectorX<T>> eval_grad(
+      const BasicInputs<T>& inputs,
+      GradMode mode = GradMode::kAuto) const noexcept {
+    return compiled().eval_grad<T>(inputs, mode);
+  }
+
+  /// Evaluate the graph and its derivatives w.r.t. the variables in `wrt` at
+  /// the given point. The elements of the gradient follow the order of
+  /// `wrt`, whose names must be unique. Only the nodes that depend on those
+  /// variables are differentiated, so this is cheaper than a full gradient
+  /// when few variables are selected. Callers that repeatedly differentiate
+  /// w.r.t. the same variables can skip the selection step by passing a
+  /// CompiledGraph::select() result to CompiledGraph::eval_grad().
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      const Inputs& inputs, absl::Span<const std::string_view> wrt,
+      GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Evaluate the graph and its gradient at the given point, passed as one
+  /// value per variable in the order given by layout().
+  /// The gradient has the same layout as the inputs. Prefer this overload in
+  /// hot loops: it skips all variable name lookups.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      absl::Span<const float> inputs,
+      GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// Evaluate the graph and its Hessian at the given point. Rows and columns
+  /// follow the same order as the gradient of eval_grad(). See
+  /// CompiledGraph::eval_hessian() for how it is computed.
+  std::pair<float, Eigen::MatrixXf> eval_hessian(
       const Inputs& inputs) const noexcept;
 
+  /// Same as eval_hessian(), with the Hessian stored as a sparse matrix.
+  /// Cheaper for graphs with many variables but few nonzero second
+  /// derivatives.
+  std::pair<float, Eigen::SparseMatrix<float>> eval_sparse_hessian(
+      const Inputs& inputs) const;
+
+  /// The product of the Hessian at the given point and the vector `v`, both
+  /// in the same order as the gradient of eval_grad(). The Hessian is never
+  /// formed: the product costs about as much as two gradient evaluations.
+  Eigen::RowVectorXf hvp(const Inputs& inputs,
+                         const Eigen::Ref<const Eigen::RowVectorXf>& v) const;
+
+  /// Evaluate the graph at many points at once.
+  /// `inputs` has one row per point and one column per variable, in the
+  /// order given by layout(). Returns one value per point.
+  Eigen::VectorXf eval_batch(
+      const Eigen::Ref<const Eigen::MatrixXf>& inputs) const;
+
+  /// Evaluate the graph and its gradient at many points at once.
+  /// `inputs` has one row per point and one column per variable, in the
+  /// order given by layout(). Returns one value per point and a gradient
+  /// matrix with the same shape as `inputs`.
+  std::pair<Eigen::VectorXf, Eigen::MatrixXf> eval_grad_batch(
+      const Eigen::Ref<const Eigen::MatrixXf>& inputs) const;
+
+  /// Same as eval_batch(const Eigen::Ref<const Eigen::MatrixXf>&), with the
+  /// batch split across the threads of `pool`.
+  Eigen::VectorXf eval_batch(const Eigen::Ref<const Eigen::MatrixXf>& inputs,
+                             ThreadPool& pool) const;
+
+  /// Same as eval_grad_batch(const Eigen::Ref<const Eigen::MatrixXf>&), with
+  /// the batch split across the threads of `pool`.
+  std::pair<Eigen::VectorXf, Eigen::MatrixXf> eval_grad_batch(
+      const Eigen::Ref<const Eigen::MatrixXf>& inputs, ThreadPool& pool) const;
+
+  /// The variables used in the graph, in the order expected by the overloads
+  /// of eval() and eval_grad() that take dense inputs.
+  const VariableLayout& layout() const;
+
   /// Serialize this Graph instance into a corresponding protobuf object.
+  /// The graph is stored as a flat table of nodes (a gpb::Dag), in which
+  /// nodes shared by several operations appear only once. Each node of the
+  /// graph is one node of the table, so the deserialized graph has the same
+  /// structure (and size()) as this one.
   gpb::Graph to_proto() const noexcept;
 
   /// Deserialize a protobuf object into a Graph instance.
+  /// Both the flat and the nested formats are supported. Nodes that are
+  /// shared in the flat format are also shared in the resulting graph.
   static Graph from_proto(const gpb::Graph& gproto) noexcept;
 };
 
+/// The sum of all `terms` as a single node, or a zero constant if there are
+/// none. The graph is much shallower than a chain of binary sums: compiled,
+/// the terms are added pairwise in a balanced tree, with the same number of
+/// additions.
+Graph sum(absl::Span<const Graph> terms);
+
+/// The product of all `factors` as a single node, or a constant one if there
+/// are none. See sum(absl::Span<const Graph>).
+Graph product(absl::Span<const Graph> factors);
+
+/// Several compute graphs (outputs) over the same variables, evaluated
+/// together. Nodes shared between outputs, as well as structurally identical
+/// subgraphs, are evaluated once for all outputs rather than once per
+/// output, and the Jacobian of all outputs is computed in the cheapest mode
+/// for its shape.
+class MultiGraph {
+  std::vector<Graph> outputs_;
+  /// Lazily-populated cache for compiled(). Only ever accessed atomically.
+  mutable std::shared_ptr<const CompiledMultiGraph> compiled_cache;
+
+  /// The CompiledMultiGraph that backs eval() and eval_jacobian(), built on
+  /// first use.
+  const CompiledMultiGraph& compiled() const;
+
+ public:
+  /// Build a MultiGraph from its outputs, of which there must be at least
+  /// one.
+  explicit MultiGraph(std::vector<Graph> outputs);
+  MultiGraph(const MultiGraph& other);
+  MultiGraph(MultiGraph&& other) = default;
+  MultiGraph& operator=(const MultiGraph& other);
+  MultiGraph& operator=(MultiGraph&& other) = default;
+
+  /// The number of outputs.
+  std::size_t n_outputs() const noexcept { return outputs_.size(); }
+
+  /// The output with index `i`.
+  const Graph& output(std::size_t i) const noexcept { return outputs_[i]; }
+
+  /// Lower all outputs to a single instruction tape, optimized as by
+  /// Graph::compile().
+  CompiledMultiGraph compile() const;
+
+  /// Evaluate all outputs at the given point, in a single pass.
+  /// The graph is compiled on first use and the result is cached, see
+  /// compile().
+  Eigen::VectorXf eval(const Inputs& inputs) const noexcept;
+
+  /// Evaluate all outputs and their Jacobian at the given point. The
+  /// Jacobian has one row per output and one column per input variable, in
+  /// alphabetical order. By default the mode is picked by choose_grad_mode()
+  /// according to the numbers of outputs and variables.
+  std::pair<Eigen::VectorXf, Eigen::MatrixXf> eval_jacobian(
+      const Inputs& inputs, GradMode mode = GradMode::kAuto) const noexcept;
+
+  /// The variables used by any of the outputs, in the order expected by the
+  /// CompiledMultiGraph overloads that take dense inputs.
+  const VariableLayout& layout() const;
+};
+
 /// A scalar constant.
 class Const : public Op {
   float value;
@@ -145,13 +618,13 @@ class Const : public Op {
   // https://www.open-std.org/jtc1/sc22/wg21/docs/papers/2019/p1601r0.pdf
   // TODO: find a less invasive way to define these operations.
   friend Graph operator+(const Const& c1, const Const& c2) {
-    const auto g1 = Graph(std::make_shared<const Const>(c1));
-    const auto g2 = Graph(std::make_shared<const Const>(c2));
+    const auto g1 = Graph(make_node<Const>(c1));
+    const auto g2 = Graph(make_node<Const>(c2));
     return g1 + g2;
   }
 
   friend Graph operator+(const Graph& g1, const Const& c2) {
-    auto g2 = Graph{std::make_shared<const Const>(c2)};
+    auto g2 = Graph{make_node<Const>(c2)};
     return g1 + g2;
   }
 
@@ -159,23 +632,68 @@ class Const : public Op {
 
   /* operator* */
   friend Graph operator*(const Const& c1, const Const& c2) {
-    const auto g1 = Graph(std::make_shared<const Const>(c1));
-    const auto g2 = Graph(std::make_shared<const Const>(c2));
+    const auto g1 = Graph(make_node<Const>(c1));
+    const auto g2 = Graph(make_node<Const>(c2));
     return g1 * g2;
   }
 
   friend Graph operator*(const Graph& g1, const Const& c2) {
-    auto g2 = Graph{std::make_shared<const Const>(c2)};
+    auto g2 = Graph{make_node<Const>(c2)};
     return g1 * g2;
   }
 
   friend Graph operator*(const Const& c1, const Graph& g2) { return g2 * c1; }
 
-  float eval(const Inputs&) const noexcept final { return value; }
+  /* operator- */
+  friend Graph operator-(const Const& c1, const Const& c2) {
+    const auto g1 = Graph(make_node<Const>(c1));
+    const auto g2 = Graph(make_node<Const>(c2));
+    return g1 - g2;
+  }
+
+  friend Graph operator-(const Graph& g1, const Const& c2) {
+    auto g2 = Graph{make_node<Const>(c2)};
+    return g1 - g2;
+  }
+
+  friend Graph operator-(const Const& c1, const Graph& g2) {
+    auto g1 = Graph{make_node<Const>(c1)};
+    return g1 - g2;
+  }
+
+  /* operator/ */
+  friend Graph operator/(const Const& c1, const Const& c2) {
+    const auto g1 = Graph(make_node<Const>(c1));
+    const auto g2 = Graph(make_node<Const>(c2));
+    return g1 / g2;
+  }
+
+  friend Graph operator/(const Graph& g1, const Const& c2) {
+    auto g2 = Graph{make_node<Const>(c2)};
+    return g1 / g2;
+  }
+
+  friend Graph operator/(const Const& c1, const Graph& g2) {
+    auto g1 = Graph{make_node<Const>(c1)};
+    return g1 / g2;
+  }
+
+  /* unary operations */
+  friend Graph operator-(const Const& c) {
+    return -Graph{make_node<Const>(c)};
+  }
+
+  friend Graph pow(const Const& c, std::int32_t n) {
+    return pow(Graph{make_node<Const>(c)}, n);
+  }
+
+  friend Graph exp(const Const& c) { return exp(Graph{make_node<Const>(c)}); }
 
-  float eval_grad(
-      const Inputs& inputs,
-      Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept final;
+  friend Graph log(const Const& c) { return log(Graph{make_node<Const>(c)}); }
+
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
 
   gpb::Graph to_proto() const noexcept final;
   static std::unique_ptr<Const> from_proto(const gpb::Const& cproto) noexcept;
@@ -185,31 +703,37 @@ class Const : public Op {
 /// expression. Note that a Var does not contain any value: it only acts as a
 /// placeholder for one in a compute graph. Concrete values for each of the
 /// variables used will then be passed to Graph::eval as part of the Inputs.
+/// The name is interned (see VarId), so Vars are small and cheap to copy
+/// however long their names are, and Vars with the same name share it.
 class Var : public Op {
-  std::string name;
+  VarId id;
 
  public:
-  Var(std::string_view name) : name(name) {}
+  Var(std::string_view name) : id(name) {}
+  Var(VarId id) : id(id) {}
+
+  std::string_view name() const noexcept { return id.name(); }
+  VarId var_id() const noexcept { return id; }
 
   /* operator+ */
   // using the hidden friend pattern to avoid polluting the global namespace:
   // https://www.open-std.org/jtc1/sc22/wg21/docs/papers/2019/p1601r0.pdf
   friend Graph operator+(const Var& v1, const Var& v2) {
-    const auto g1 = Graph(std::make_shared<const Var>(v1));
-    const auto g2 = Graph(std::make_shared<const Var>(v2));
+    const auto g1 = Graph(make_node<Var>(v1));
+    const auto g2 = Graph(make_node<Var>(v2));
     return g1 + g2;
   }
 
   friend Graph operator+(const Const& c1, const Var& v2) {
-    const auto g1 = Graph{std::make_shared<const Const>(c1)};
-    const auto g2 = Graph{std::make_shared<const Var>(v2)};
+    const auto g1 = Graph{make_node<Const>(c1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
     return g1 + g2;
   }
 
   friend Graph operator+(const Var& v1, const Const& c2) { return c2 + v1; }
 
   friend Graph operator+(const Graph& g1, const Var& v2) {
-    auto g2 = Graph{std::make_shared<const Var>(v2)};
+    auto g2 = Graph{make_node<Var>(v2)};
     return g1 + g2;
   }
 
@@ -217,43 +741,262 @@ class Var : public Op {
 
   /* operator* */
   friend Graph operator*(const Var& v1, const Var& v2) {
-    const auto g1 = Graph{std::make_shared<const Var>(v1)};
-    const auto g2 = Graph{std::make_shared<const Var>(v2)};
+    const auto g1 = Graph{make_node<Var>(v1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
     return g1 * g2;
   }
 
   friend Graph operator*(const Const& c1, const Var& v2) {
-    const auto g1 = Graph{std::make_shared<const Const>(c1)};
-    const auto g2 = Graph{std::make_shared<const Var>(v2)};
+    const auto g1 = Graph{make_node<Const>(c1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
     return g1 * g2;
   }
 
   friend Graph operator*(const Var& v1, const Const& c2) { return c2 * v1; }
 
   friend Graph operator*(const Graph& g1, const Var& v2) {
-    auto g2 = Graph{std::make_shared<const Var>(v2)};
+    auto g2 = Graph{make_node<Var>(v2)};
     return g1 * g2;
   }
 
   friend Graph operator*(const Var& v1, const Graph& g2) { return g2 * v1; }
 
-  float eval(const Inputs& inputs) const noexcept final;
+  /* operator- */
+  friend Graph operator-(const Var& v1, const Var& v2) {
+    const auto g1 = Graph{make_node<Var>(v1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
+    return g1 - g2;
+  }
+
+  friend Graph operator-(const Const& c1, const Var& v2) {
+    const auto g1 = Graph{make_node<Const>(c1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
+    return g1 - g2;
+  }
+
+  friend Graph operator-(const Var& v1, const Const& c2) {
+    const auto g1 = Graph{make_node<Var>(v1)};
+    const auto g2 = Graph{make_node<Const>(c2)};
+    return g1 - g2;
+  }
+
+  friend Graph operator-(const Graph& g1, const Var& v2) {
+    auto g2 = Graph{make_node<Var>(v2)};
+    return g1 - g2;
+  }
+
+  friend Graph operator-(const Var& v1, const Graph& g2) {
+    auto g1 = Graph{make_node<Var>(v1)};
+    return g1 - g2;
+  }
+
+  /* operator/ */
+  friend Graph operator/(const Var& v1, const Var& v2) {
+    const auto g1 = Graph{make_node<Var>(v1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
+    return g1 / g2;
+  }
+
+  friend Graph operator/(const Const& c1, const Var& v2) {
+    const auto g1 = Graph{make_node<Const>(c1)};
+    const auto g2 = Graph{make_node<Var>(v2)};
+    return g1 / g2;
+  }
+
+  friend Graph operator/(const Var& v1, const Const& c2) {
+    const auto g1 = Graph{make_node<Var>(v1)};
+    const auto g2 = Graph{make_node<Const>(c2)};
+    return g1 / g2;
+  }
+
+  friend Graph operator/(const Graph& g1, const Var& v2) {
+    auto g2 = Graph{make_node<Var>(v2)};
+    return g1 / g2;
+  }
+
+  friend Graph operator/(const Var& v1, const Graph& g2) {
+    auto g1 = Graph{make_node<Var>(v1)};
+    return g1 / g2;
+  }
+
+  /* unary operations */
+  friend Graph operator-(const Var& v) { return -Graph{make_node<Var>(v)}; }
+
+  friend Graph pow(const Var& v, std::int32_t n) {
+    return pow(Graph{make_node<Var>(v)}, n);
+  }
+
+  friend Graph exp(const Var& v) { return exp(Graph{make_node<Var>(v)}); }
+
+  friend Graph log(const Var& v) { return log(Graph{make_node<Var>(v)}); }
 
-  float eval_grad(
-      const Inputs& inputs,
-      Eigen::Map<Eigen::RowVectorXf>& grad_out) const noexcept final;
+  std::uint32_t lower(TapeBuilder& builder) const final;
+
+  void to_node(NodeTableWriter& writer, gpb::Node& node) const final;
 
   gpb::Graph to_proto() const noexcept final;
 
   static std::unique_ptr<Var> from_proto(const gpb::Var& vproto) noexcept;
 };
 
+/// Builds compute graphs in which structurally identical subgraphs are
+/// represented by a single node (a.k.a. hash-consing). For example, the two
+/// `x*y` in `f.sum(f.mul(x, y), f.mul(y, x))` are the same node.
+/// All nodes created by a factory stay alive as long as the factory.
+/// A NodeFactory is not thread-safe, but the graphs it returns are.
+class NodeFactory {
+  // the last element is the exponent of powers, zero for other operations
+  using NodeKey = std::tuple<OpCode, const Op*, const Op*, std::int32_t>;
+
+  absl::flat_hash_map<VarId, std::shared_ptr<const Op>> vars;
+  // constants are identified by their bit pattern
+  absl::flat_hash_map<std::uint32_t, std::shared_ptr<const Op>> consts;
+  absl::flat_hash_map<NodeKey, std::shared_ptr<const Op>> ops;
+
+  /// Return the existing node for a binary operation, or create it.
+  template <typename Node>
+  Graph binary(OpCode opcode, const Graph& g1, const Graph& g2);
+
+  /// Return the existing node for a unary operation, or create it.
+  /// `exponent` is only used by powers.
+  template <typename Node>
+  Graph unary(OpCode opcode, const Graph& g, std::int32_t exponent = 0);
+
+ public:
+  Graph var(std::string_view name);
+  Graph constant(float value);
+  Graph sum(const Graph& g1, const Graph& g2);
+  Graph mul(const Graph& g1, const Graph& g2);
+  Graph sub(const Graph& g1, const Graph& g2);
+  Graph div(const Graph& g1, const Graph& g2);
+  Graph neg(const Graph& g);
+  Graph pow(const Graph& g, std::int32_t n);
+  Graph exp(const Graph& g);
+  Graph log(const Graph& g);
+};
+
+/// Allocates the nodes of compute graphs contiguously in an arena, rather
+/// than with one heap allocation each, and frees them all at once.
+/// While a GraphBuilder is alive, all graphs built on the same thread with
+/// the usual operators (and with NodeFactory) have their nodes allocated in
+/// its arena, so code that builds graphs does not need to change:
+///
+///   GraphBuilder builder;
+///   const Graph g = x * y + z;  // both nodes are in the arena
+///
+/// Graphs can outlive the builder they were built in: the arena is freed
+/// when the builder and all graphs that use its nodes are gone. Conversely,
+/// a single graph still in use keeps the whole arena alive.
+/// Nodes in the arena refer to each other with non-owning pointers, so
+/// building a node only touches the reference count of the arena itself.
+/// Nodes in different arenas do own each other, and references between two
+/// arenas in both directions would keep both alive forever: for this reason
+/// a GraphBuilder created while another is active shares its arena, and
+/// graphs built by GraphBuilders that are active at the same time on
+/// different threads should not be combined with each other.
+/// A GraphBuilder must be destroyed on the thread that created it, in
+/// reverse order of construction.
+class GraphBuilder {
+  struct Arena;  // defined in graph.cpp
+
+  std::shared_ptr<Arena> arena;
+  GraphBuilder* outer;  // the builder that was active before this one
+
+  void* allocate(std::size_t size, std::size_t alignment);
+  /// Register a node constructed in memory returned by allocate(), so that it
+  /// is destroyed together with the arena.
+  void adopt(const Op* node);
+  /// Whether `op` is a node in this builder's arena.
+  bool owns(const std::shared_ptr<const Op>& op) const noexcept {
+    return !op.owner_before(arena) && !arena.owner_before(op);
+  }
+
+  /// Nodes take their operands through this: operands in the arena are
+  /// replaced by non-owning pointers, anything else is forwarded as is.
+  template <typename Arg>
+  decltype(auto) operand(Arg&& arg) const noexcept {
+    using Decayed = std::decay_t<Arg>;
+    if constexpr (std::is_same_v<Decayed, std::shared_ptr<const Op>>) {
+      // aliasing an empty shared_ptr: points to the node, owns nothing
+      if (owns(arg)) return std::shared_ptr<const Op>(Decayed(), arg.get());
+      return std::shared_ptr<const Op>(std::forward<Arg>(arg));
+    } else if constexpr (std::is_same_v<Decayed, Op::Operands>) {
+      Op::Operands ops;
+      ops.reserve(arg.size());
+      for (const std::shared_ptr<const Op>& op : arg) ops.push_back(operand(op));
+      return ops;
+    } else {
+      return std::forward<Arg>(arg);
+    }
+  }
+
+ public:
+  /// Create an arena that allocates memory in blocks of `block_size` bytes,
+  /// and make it the active one on this thread. If another GraphBuilder is
+  /// already active on this thread, its arena is used instead.
+  explicit GraphBuilder(std::size_t block_size = 1 << 16);
+  ~GraphBuilder();
+  GraphBuilder(const GraphBuilder&) = delete;
+  GraphBuilder& operator=(const GraphBuilder&) = delete;
+
+  /// The GraphBuilder that was created last on this thread among those that
+  /// are alive, if any.
+  static GraphBuilder* active() noexcept;
+
+  /// Create a node of type `Node` from `args` in the arena.
+  template <typename Node, typename... Args>
+  std::shared_ptr<const Op> make(Args&&... args) {
+    void* memory = allocate(sizeof(Node), alignof(Node));
+    const Node* node =
+        new (memory) const Node(operand(std::forward<Args>(args))...);
+    adopt(node);
+    // shares ownership of the arena rather than of the single node
+    return std::shared_ptr<const Op>(arena, node);
+  }
+};
+
+template <typename Node, typename... Args>
+std::shared_ptr<const Op> make_node(Args&&... args) {
+  if (GraphBuilder* builder = GraphBuilder::active())
+    return builder->make<Node>(std::forward<Args>(args)...);
+  return std::make_shared<const Node>(std::forward<Args>(args)...);
+}
+
 namespace fs = std::filesystem;
 
-/// Serialize a compute graph to a protobuf file.
+/// Serialize a compute graph to a protobuf file, see Graph::to_proto().
 absl::Status to_file(const Graph& graph, fs::path path);
 
-/// Deserialize a protobuf file into a Graph instance.
+/// Serialize a compute graph to a file as a sequence of length-delimited
+/// protobuf messages with at most `nodes_per_chunk` nodes each. Unlike
+/// to_file(), this never holds the serialized form of the whole graph in
+/// memory, and it is not subject to protobuf's limit of 2 GB per message.
+absl::Status to_chunked_file(const Graph& graph, fs::path path,
+                             std::size_t nodes_per_chunk = 1 << 16);
+
+/// Deserialize a file written by to_chunked_file() into a Graph instance,
+/// one chunk at a time: nodes are built while the rest of the file is read.
+/// As with from_file(), the graph is returned as written.
+absl::StatusOr<Graph> from_chunked_file(fs::path path);
+
+/// Deserialize a protobuf file into a Graph instance. The graph is returned
+/// as written, so its layout() matches that of the graph that was saved
+/// (it is simplified when compiled, which keeps the layout). Files written
+/// by older versions, which store graphs as nested messages, can still be
+/// read.
 absl::StatusOr<Graph> from_file(fs::path path);
 
+/// Load the graphs in `paths` concurrently on the workers of `pool`. Each
+/// file is read and parsed as by from_file() and, if `compile`,
+/// compiled (see Graph::compile()) in a task of its own, so reading some
+/// files overlaps with processing others. Returns one future per path, in
+/// the same order, which becomes ready when its graph is loaded and holds
+/// the same result as from_file(), errors included. The pool must not be
+/// destroyed before all futures are ready.
+/// Unlike ThreadPool::parallel_for(), waiting on these futures does not run
+/// queued tasks: calling get() or wait() from a task running on `pool` can
+/// deadlock, e.g. if `pool` has a single worker.
+std::vector<std::future<absl::StatusOr<Graph>>> from_files_async(
+    absl::Span<const fs::path> paths, ThreadPool& pool, bool compile = true);
+
 }  // namespace graph_autodiff
@@ -0,0 +1,176 @@
+#include <benchmark/benchmark.h>
+
+#include <cstddef>  // std::size_t
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>  // std::move
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+namespace {
+// The graph shapes that all benchmarks run on. Each shape is built from a
+// given number of variables.
+enum Shape : std::int64_t {
+  kChain,         // a single path: ((x0 * x1) * x2 + c) * x3 + c...
+  kWideSum,       // x0 * x1 + x1 * x2 + x2 * x3 + ...
+  kBalancedTree,  // (x0 * x1 + x2 * x3) + (x4 * x5 + x6 * x7) + ...
+  kSharedDag,     // g = g * g * c + x_i: every node is used twice
+};
+
+constexpr const char* kShapeNames[] = {"chain", "wide_sum", "balanced_tree",
+                                       "shared_dag"};
+
+// inputs stay in a range in which no shape overflows or produces denormals
+constexpr float kInputValue = 0.5;
+
+std::vector<Var> make_vars(std::size_t n_vars) {
+  std::vector<Var> vars;
+  vars.reserve(n_vars);
+  for (std::size_t i = 0; i < n_vars; ++i)
+    vars.emplace_back("x" + std::to_string(i));
+  return vars;
+}
+
+Graph make_graph(Shape shape, const std::vector<Var>& vars) {
+  const std::size_t n = vars.size();
+  const Const c{kInputValue};
+  // every shape starts from x0 * x1
+  Graph g = vars[0] * vars[1];
+  switch (shape) {
+    case kChain:
+      for (std::size_t i = 2; i < n; ++i) g = g * vars[i] + c;
+      break;
+    case kWideSum:
+      for (std::size_t i = 1; i < n; ++i) g = g + vars[i] * vars[(i + 1) % n];
+      break;
+    case kBalancedTree: {
+      std::vector<Graph> level{g};
+      for (std::size_t i = 2; i + 1 < n; i += 2)
+        level.push_back(vars[i] * vars[i + 1]);
+      if (n % 2 == 1) level.back() = level.back() + vars.back();
+      while (level.size() > 1) {
+        std::vector<Graph> next;
+        for (std::size_t i = 0; i + 1 < level.size(); i += 2)
+          next.push_back(level[i] + level[i + 1]);
+        if (level.size() % 2 == 1) next.back() = next.back() + level.back();
+        level = std::move(next);
+      }
+      g = level.front();
+      break;
+    }
+    case kSharedDag:
+      for (std::size_t i = 2; i < n; ++i) g = g * g * c + vars[i];
+      break;
+  }
+  return g;
+}
+
+Inputs make_inputs(const std::vector<Var>& vars) {
+  Inputs inputs;
+  for (const Var& v : vars) inputs.emplace(v.name(), kInputValue);
+  return inputs;
+}
+
+Shape shape_of(const benchmark::State& state) {
+  return static_cast<Shape>(state.range(0));
+}
+
+std::size_t n_vars_of(const benchmark::State& state) {
+  return state.range(1);
+}
+
+// the label and counters common to all benchmarks on graph `g`
+void describe(benchmark::State& state, const Graph& g) {
+  state.SetLabel(kShapeNames[shape_of(state)]);
+  const std::size_t n_instructions = g.compile().instructions().size();
+  state.counters["instructions"] = n_instructions;
+  state.SetItemsProcessed(state.iterations() * n_instructions);
+}
+
+void BM_Build(benchmark::State& state) {
+  const std::vector<Var> vars = make_vars(n_vars_of(state));
+  for (auto _ : state)
+    benchmark::DoNotOptimize(make_graph(shape_of(state), vars));
+  describe(state, make_graph(shape_of(state), vars));
+}
+
+void BM_BuildInArena(benchmark::State& state) {
+  const std::vector<Var> vars = make_vars(n_vars_of(state));
+  for (auto _ : state) {
+    GraphBuilder builder;
+    benchmark::DoNotOptimize(make_graph(shape_of(state), vars));
+  }
+  describe(state, make_graph(shape_of(state), vars));
+}
+
+void BM_Compile(benchmark::State& state) {
+  const Graph g = make_graph(shape_of(state), make_vars(n_vars_of(state)));
+  for (auto _ : state) benchmark::DoNotOptimize(g.compile());
+  describe(state, g);
+}
+
+void BM_Eval(benchmark::State& state) {
+  const std::vector<Var> vars = make_vars(n_vars_of(state));
+  const Graph g = make_graph(shape_of(state), vars);
+  const Inputs inputs = make_inputs(vars);
+  g.eval(inputs);  // compile the graph outside of the timed loop
+  for (auto _ : state) benchmark::DoNotOptimize(g.eval(inputs));
+  describe(state, g);
+}
+
+void BM_EvalGrad(benchmark::State& state) {
+  const std::vector<Var> vars = make_vars(n_vars_of(state));
+  const Graph g = make_graph(shape_of(state), vars);
+  const Inputs inputs = make_inputs(vars);
+  g.eval_grad(inputs);  // compile the graph outside of the timed loop
+  for (auto _ : state) benchmark::DoNotOptimize(g.eval_grad(inputs));
+  describe(state, g);
+}
+
+void BM_ToFile(benchmark::State& state) {
+  const Graph g = make_graph(shape_of(state), make_vars(n_vars_of(state)));
+  const std::filesystem::path path =
+      std::filesystem::temp_directory_path() / "graph_autodiff_benchmark.pb";
+  for (auto _ : state) {
+    if (!to_file(g, path).ok()) state.SkipWithError("to_file failed");
+  }
+  describe(state, g);
+  std::filesystem::remove(path);
+}
+
+void BM_FromFile(benchmark::State& state) {
+  const Graph g = make_graph(shape_of(state), make_vars(n_vars_of(state)));
+  const std::filesystem::path path =
+      std::filesystem::temp_directory_path() / "graph_autodiff_benchmark.pb";
+  if (!to_file(g, path).ok()) state.SkipWithError("to_file failed");
+  for (auto _ : state) {
+    absl::StatusOr<Graph> read = from_file(path);
+    if (!read.ok()) state.SkipWithError("from_file failed");
+    benchmark::DoNotOptimize(read);
+  }
+  describe(state, g);
+  std::filesystem::remove(path);
+}
+
+// all shapes, with 3 to 100k variables
+void graph_shapes(benchmark::internal::Benchmark* b) {
+  b->ArgsProduct({{kChain, kWideSum, kBalancedTree, kSharedDag},
+                  {3, 100, 10'000, 100'000}})
+      ->ArgNames({"shape", "vars"});
+}
+}  // end of anonymous namespace
+
+BENCHMARK(BM_Build)->Apply(graph_shapes);
+BENCHMARK(BM_BuildInArena)->Apply(graph_shapes);
+BENCHMARK(BM_Compile)->Apply(graph_shapes);
+BENCHMARK(BM_Eval)->Apply(graph_shapes);
+BENCHMARK(BM_EvalGrad)->Apply(graph_shapes);
+BENCHMARK(BM_ToFile)->Apply(graph_shapes);
+BENCHMARK(BM_FromFile)->Apply(graph_shapes);
+
+BENCHMARK_MAIN();
@@ -2,7 +2,19 @@
 
 #include <gtest/gtest.h>
 
+#include <cmath>  // std::exp, std::log
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>  // std::pair
+#include <vector>
+
 #include "absl/status/statusor.h"
+#include "graph_autodiff/thread_pool.h"
 
 using namespace graph_autodiff;
 
@@ -62,6 +74,33 @@ TEST(Graph, MulEval) {
   EXPECT_FLOAT_EQ(g9.eval(inputs), 81.);
 }
 
+TEST(Graph, OtherOpsEval) {
+  const Const c(2.);
+  const Var x("x");
+  const Inputs inputs{{"x", 3.}};
+  const Graph g1 = x * x;
+
+  EXPECT_FLOAT_EQ((x - x).eval(inputs), 0.);    // Var - Var
+  EXPECT_FLOAT_EQ((c - c).eval(inputs), 0.);    // Const - Const
+  EXPECT_FLOAT_EQ((x - c).eval(inputs), 1.);    // Var - Const
+  EXPECT_FLOAT_EQ((c - x).eval(inputs), -1.);  // Const - Var
+  EXPECT_FLOAT_EQ((g1 - x).eval(inputs), 6.);   // Graph - Var
+  EXPECT_FLOAT_EQ((c - g1).eval(inputs), -7.);  // Const - Graph
+
+  EXPECT_FLOAT_EQ((x / c).eval(inputs), 1.5);      // Var / Const
+  EXPECT_FLOAT_EQ((c / x).eval(inputs), 2. / 3.);  // Const / Var
+  EXPECT_FLOAT_EQ((g1 / x).eval(inputs), 3.);      // Graph / Var
+  EXPECT_FLOAT_EQ((g1 / g1).eval(inputs), 1.);     // Graph / Graph
+
+  EXPECT_FLOAT_EQ((-x).eval(inputs), -3.);
+  EXPECT_FLOAT_EQ((-g1).eval(inputs), -9.);
+  EXPECT_FLOAT_EQ(pow(x, 3).eval(inputs), 27.);
+  EXPECT_FLOAT_EQ(pow(g1, -1).eval(inputs), 1. / 9.);
+  EXPECT_FLOAT_EQ(pow(x, 0).eval(inputs), 1.);
+  EXPECT_FLOAT_EQ(exp(x).eval(inputs), std::exp(3.f));
+  EXPECT_FLOAT_EQ(log(g1).eval(inputs), std::log(9.f));
+}
+
 TEST(Tests, WriteAndReadGraph) {
   const Const c{20.};
   const Var x{"x"};
@@ -82,6 +121,183 @@ TEST(Tests, WriteAndReadGraph) {
   EXPECT_FLOAT_EQ(g2.eval(inputs), 42.);
 }
 
+TEST(Tests, SerializationPreservesSharing) {
+  const Var x{"x"};
+  const Var y{"y"};
+
+  // 2^30 paths lead from the root to x*y: stored as nested messages, the
+  // graph would not fit in memory
+  Graph g = x * y;
+  for (int i = 0; i < 30; ++i) g = g + g;
+  EXPECT_EQ(g.size(), 33);
+
+  const gpb::Graph gproto = g.to_proto();
+  ASSERT_TRUE(gproto.has_dag());
+  EXPECT_EQ(gproto.dag().nodes_size(), 33);
+  EXPECT_EQ(gproto.dag().var_names_size(), 2);
+
+  ASSERT_TRUE(to_file(g, "dag_test.pb").ok());
+  const absl::StatusOr<Graph> gs = from_file("dag_test.pb");
+  ASSERT_TRUE(gs.ok());
+  EXPECT_EQ(gs->size(), 33);
+  EXPECT_FLOAT_EQ(gs->eval({{"x", 1.}, {"y", 2.}}), 2. * (1 << 30));
+}
+
+TEST(Tests, ReadNestedFormat) {
+  // x * (x + 2), as written by older versions
+  gpb::Graph x;
+  x.mutable_var()->set_name("x");
+  gpb::Graph two;
+  two.mutable_const_()->set_value(2.);
+  gpb::Graph sum;
+  *sum.mutable_sum()->mutable_op1() = x;
+  *sum.mutable_sum()->mutable_op2() = two;
+  gpb::Graph mul;
+  *mul.mutable_mul()->mutable_op1() = x;
+  *mul.mutable_mul()->mutable_op2() = sum;
+
+  {
+    std::ofstream out_file("nested_test.pb");
+    ASSERT_TRUE(mul.SerializeToOstream(&out_file));
+  }
+  const absl::StatusOr<Graph> gs = from_file("nested_test.pb");
+  ASSERT_TRUE(gs.ok());
+  EXPECT_FLOAT_EQ(gs->eval({{"x", 3.}}), 15.);
+  EXPECT_FLOAT_EQ(Graph::from_proto(mul).eval({{"x", 3.}}), 15.);
+}
+
+TEST(Tests, WriteAndReadOtherOps) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph xy = x * y;
+  const Graph g = exp(-xy) / pow(x - y, -2) + log(xy);
+  const Inputs inputs{{"x", 0.5}, {"y", 2.}};
+
+  ASSERT_TRUE(to_file(g, "other_ops_test.pb").ok());
+  const absl::StatusOr<Graph> gs = from_file("other_ops_test.pb");
+  ASSERT_TRUE(gs.ok()) << gs.status();
+  EXPECT_FLOAT_EQ(gs->eval(inputs), g.eval(inputs));
+
+  // nested format, as written by Op::to_proto()
+  const Neg neg(
+      std::make_shared<const Pow>(std::make_shared<const Var>("x"), -2));
+  const gpb::Graph nested = neg.to_proto();
+  ASSERT_TRUE(nested.has_neg());
+  EXPECT_EQ(nested.neg().op().pow().exponent(), -2);
+  EXPECT_FLOAT_EQ(Graph::from_proto(nested).eval(inputs), -4.);
+}
+
+TEST(Tests, FromFilesAsync) {
+  const Var x{"x"};
+  const Var y{"y"};
+  std::vector<fs::path> paths;
+  for (int i = 0; i < 6; ++i) {
+    paths.push_back("async_test_" + std::to_string(i) + ".pb");
+    ASSERT_TRUE(to_file(pow(x, i) * y + Const(i), paths.back()).ok());
+  }
+  paths.push_back("does_not_exist.pb");
+
+  ThreadPool pool(3);
+  std::vector<std::future<absl::StatusOr<Graph>>> futures =
+      from_files_async(paths, pool);
+  ASSERT_EQ(futures.size(), paths.size());
+  for (int i = 0; i < 6; ++i) {
+    const absl::StatusOr<Graph> g = futures[i].get();
+    ASSERT_TRUE(g.ok()) << g.status();
+    EXPECT_FLOAT_EQ(g->eval({{"x", 2.}, {"y", 3.}}), 3. * (1 << i) + i);
+  }
+  // errors are the same as from_file()'s
+  EXPECT_EQ(futures.back().get().status(),
+            from_file("does_not_exist.pb").status());
+}
+
+TEST(Tests, ReadInvalidDag) {
+  gpb::Graph gproto;
+  gpb::Dag &dag = *gproto.mutable_dag();
+  dag.add_var_names("x");
+  dag.add_nodes()->set_var(0);
+  // refers to itself
+  gpb::Operands &operands = *dag.add_nodes()->mutable_sum();
+  operands.set_op1(0);
+  operands.set_op2(1);
+
+  {
+    std::ofstream out_file("invalid_test.pb");
+    ASSERT_TRUE(gproto.SerializeToOstream(&out_file));
+  }
+  const absl::StatusOr<Graph> gs = from_file("invalid_test.pb");
+  EXPECT_EQ(gs.status().code(), absl::StatusCode::kInvalidArgument);
+
+  // a sum of a single term
+  dag.mutable_nodes()->RemoveLast();
+  dag.add_nodes()->mutable_nary_sum()->add_ops(0);
+  {
+    std::ofstream out_file("invalid_test.pb");
+    ASSERT_TRUE(gproto.SerializeToOstream(&out_file));
+  }
+  EXPECT_EQ(from_file("invalid_test.pb").status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(Tests, ChunkedFile) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const c{2.};
+
+  // variables first appear in different chunks
+  Graph g = x * c;
+  for (int i = 0; i < 10; ++i) g = g + g * c;
+  g = g * y + g;
+  ASSERT_TRUE(to_chunked_file(g, "chunked_test.pb", /*nodes_per_chunk=*/3)
+                  .ok());
+
+  const absl::StatusOr<Graph> gs = from_chunked_file("chunked_test.pb");
+  ASSERT_TRUE(gs.ok()) << gs.status();
+  EXPECT_EQ(gs->size(), g.size());
+  const Inputs inputs{{"x", 1.}, {"y", 0.5}};
+  EXPECT_FLOAT_EQ(gs->eval(inputs), g.eval(inputs));
+
+  // a truncated file is an error
+  const std::uintmax_t size = std::filesystem::file_size("chunked_test.pb");
+  std::filesystem::resize_file("chunked_test.pb", size - 1);
+  EXPECT_FALSE(from_chunked_file("chunked_test.pb").ok());
+}
+
+TEST(Tests, DeepGraph) {
+  // deep enough to overflow the stack of recursive traversals
+  constexpr int kDepth = 500'000;
+  const Var x{"x"};
+  const Var y{"y"};
+  Graph g = x * y;
+  for (int i = 0; i < kDepth; ++i) g = g + x;
+
+  const Inputs inputs{{"x", 1.}, {"y", 2.}};
+  EXPECT_EQ(g.size(), 2 * kDepth + 3);  // each `g + x` adds a new Var
+  EXPECT_FLOAT_EQ(g.eval(inputs), kDepth + 2.);
+  const auto &[value, grads] = g.eval_grad(inputs);
+  EXPECT_FLOAT_EQ(grads(0), kDepth + 2.);
+  EXPECT_FLOAT_EQ(grads(1), 1.);
+
+  ASSERT_TRUE(to_file(g, "deep_test.pb").ok());
+  const absl::StatusOr<Graph> gs = from_file("deep_test.pb");
+  ASSERT_TRUE(gs.ok());
+  EXPECT_FLOAT_EQ(gs->eval(inputs), kDepth + 2.);
+  // the graph is destroyed when g goes out of scope
+}
+
+TEST(Tests, DeepNestedProto) {
+  // protobuf's own (recursive) handling of nested messages limits this depth
+  constexpr int kDepth = 10'000;
+  const auto x = std::make_shared<const Var>("x");
+  std::shared_ptr<const Op> op = x;
+  for (int i = 0; i < kDepth; ++i) op = std::make_shared<const Sum>(op, x);
+
+  const gpb::Graph nested = op->to_proto();
+  ASSERT_TRUE(nested.has_sum());
+  const Graph g = Graph::from_proto(nested);
+  EXPECT_FLOAT_EQ(g.eval({{"x", 1.}}), kDepth + 1.);
+}
+
 TEST(Tests, SumGradient) {
   const Var x{"x"};
   const Const c{2.};
@@ -102,6 +318,77 @@ TEST(Tests, MulGradient) {
   EXPECT_FLOAT_EQ(grads(0), 2.);
 }
 
+TEST(Tests, OtherOpsGradient) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x / y - pow(x, 3) * exp(y) + log(x * y) - (-y);
+  const float xv = 2.;
+  const float yv = 0.5;
+  const auto &[value, grads] = g.eval_grad({{"x", xv}, {"y", yv}});
+  EXPECT_FLOAT_EQ(value, xv / yv - xv * xv * xv * std::exp(yv) +
+                             std::log(xv * yv) + yv);
+  ASSERT_EQ(grads.size(), 2);
+  EXPECT_FLOAT_EQ(grads(0), 1 / yv - 3 * xv * xv * std::exp(yv) + 1 / xv);
+  EXPECT_FLOAT_EQ(grads(1),
+                  -xv / (yv * yv) - xv * xv * xv * std::exp(yv) + 1 / yv + 1);
+}
+
+TEST(Tests, SumAndProductOfMany) {
+  std::vector<Graph> terms;
+  Inputs inputs;
+  for (int i = 0; i < 7; ++i) {
+    const std::string name = "x" + std::to_string(i);
+    terms.emplace_back(std::make_shared<const Var>(name));
+    inputs[name] = i + 1.;
+  }
+
+  // a single node, lowered to a balanced tree of binary additions
+  const Graph s = sum(terms);
+  EXPECT_EQ(s.size(), 7 + 1);
+  EXPECT_EQ(s.stats().n_sums, 1);
+  EXPECT_EQ(s.stats().depth, 1);
+  EXPECT_EQ(s.compile().instructions().size(), 7 + 6);
+  const auto &[value, grads] = s.eval_grad(inputs);
+  EXPECT_FLOAT_EQ(value, 28.);
+  for (int i = 0; i < 7; ++i) EXPECT_FLOAT_EQ(grads(i), 1.);
+
+  const Graph p = product(terms);
+  const auto &[pvalue, pgrads] = p.eval_grad(inputs);
+  EXPECT_FLOAT_EQ(pvalue, 5040.);
+  for (int i = 0; i < 7; ++i) EXPECT_FLOAT_EQ(pgrads(i), 5040. / (i + 1));
+
+  // serialized as single nodes, in all formats
+  const Graph read = Graph::from_proto(s.to_proto());
+  EXPECT_EQ(read.size(), s.size());
+  EXPECT_FLOAT_EQ(read.eval(inputs), 28.);
+  ASSERT_TRUE(to_file(p, "nary_test.pb").ok());
+  const absl::StatusOr<Graph> pread = from_file("nary_test.pb");
+  ASSERT_TRUE(pread.ok()) << pread.status();
+  EXPECT_EQ(pread->size(), p.size());
+  EXPECT_FLOAT_EQ(pread->eval(inputs), 5040.);
+  const Graph sp = s * p;
+  ASSERT_TRUE(to_chunked_file(sp, "nary_test.pb", /*nodes_per_chunk=*/3).ok());
+  const absl::StatusOr<Graph> spread = from_chunked_file("nary_test.pb");
+  ASSERT_TRUE(spread.ok()) << spread.status();
+  EXPECT_EQ(spread->size(), sp.size());
+  EXPECT_FLOAT_EQ(spread->eval(inputs), 28. * 5040.);
+
+  // nested format: sums of two terms keep the format of older versions
+  const auto x0 = std::make_shared<const Var>("x0");
+  const auto x1 = std::make_shared<const Var>("x1");
+  const auto x2 = std::make_shared<const Var>("x2");
+  EXPECT_TRUE(Sum(x0, x1).to_proto().has_sum());
+  const gpb::Graph nested = Mul(Op::Operands{x0, x1, x2}).to_proto();
+  ASSERT_TRUE(nested.has_nary_mul());
+  const Graph nested_read = Graph::from_proto(nested);
+  EXPECT_EQ(nested_read.size(), 3 + 1);
+  EXPECT_FLOAT_EQ(nested_read.eval(inputs), 6.);
+
+  EXPECT_FLOAT_EQ(sum({}).eval(Inputs{}), 0.);
+  EXPECT_FLOAT_EQ(product({}).eval(Inputs{}), 1.);
+  EXPECT_FLOAT_EQ(sum({terms[2]}).eval(inputs), 3.);
+}
+
 TEST(Tests, MultipleVarGradient) {
   const Var x{"x"};
   const Var y{"y"};
@@ -129,3 +416,371 @@ TEST(Tests, MultipleVarGradient) {
   // dg/dz(2,3,4) = 6 + 20 + 30 = 56
   EXPECT_FLOAT_EQ(grads(2), 56.);
 }
+
+TEST(Tests, ReverseModeGradient) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x * x * y + y;
+
+  const Inputs inputs = {{"x", 2.}, {"y", 3.}};
+  const auto &[value, grads] = g.eval_grad(inputs, GradMode::kReverse);
+  EXPECT_FLOAT_EQ(value, 15.);
+  EXPECT_FLOAT_EQ(grads(0), 12.);
+  EXPECT_FLOAT_EQ(grads(1), 5.);
+}
+
+TEST(Tests, SelectedGradient) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Graph g = x * y + y * z;
+
+  const Inputs inputs = {{"x", 2.}, {"y", 3.}, {"z", 4.}};
+  const auto &[value, grads] = g.eval_grad(inputs, {"z", "x"});
+  EXPECT_FLOAT_EQ(value, 18.);
+  ASSERT_EQ(grads.size(), 2);
+  EXPECT_FLOAT_EQ(grads(0), 3.);
+  EXPECT_FLOAT_EQ(grads(1), 3.);
+}
+
+TEST(Tests, BatchedGradient) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x * x * y + y;
+
+  Eigen::MatrixXf inputs(2, 2);  // one point per row: x, y
+  inputs << 2., 3., 1., -1.;
+  const auto &[values, grads] = g.eval_grad_batch(inputs);
+  EXPECT_FLOAT_EQ(values(0), 15.);
+  EXPECT_FLOAT_EQ(values(1), -2.);
+  EXPECT_FLOAT_EQ(grads(0, 0), 12.);
+  EXPECT_FLOAT_EQ(grads(0, 1), 5.);
+  EXPECT_FLOAT_EQ(grads(1, 0), -2.);
+  EXPECT_FLOAT_EQ(grads(1, 1), 2.);
+}
+
+TEST(Tests, Optimize) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+
+  // x, y, x*y, y, x, y*x, z, y*x*z, x*y + y*x*z
+  const Graph g = x * y + y * x * z;
+  EXPECT_EQ(g.size(), 9);
+
+  // x, y, x*y, z, x*y*z, x*y + x*y*z
+  const Graph opt = g.optimize();
+  EXPECT_EQ(opt.size(), 6);
+  EXPECT_EQ(g.compile().instructions().size(), 6);
+
+  const Inputs inputs = {{"x", 2.}, {"y", 3.}, {"z", 4.}};
+  const auto &[value, grads] = g.eval_grad(inputs);
+  const auto &[opt_value, opt_grads] = opt.eval_grad(inputs);
+  EXPECT_FLOAT_EQ(opt_value, value);
+  for (int i = 0; i < 3; ++i) EXPECT_FLOAT_EQ(opt_grads(i), grads(i));
+}
+
+TEST(Tests, Simplify) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const zero{0.};
+  const Const one{1.};
+  const Const two{2.};
+  const Const three{3.};
+
+  // constant folding
+  const Graph folded = (two * three + one).simplify();
+  EXPECT_EQ(folded.size(), 1);
+  EXPECT_FLOAT_EQ(folded.eval(Inputs{}), 7.);
+
+  // identity and absorbing elements
+  EXPECT_EQ((x * one + zero).simplify().size(), 1);
+  const Graph absorbed = (x * y * zero + x).simplify();
+  EXPECT_EQ(absorbed.size(), 1);
+  EXPECT_FLOAT_EQ(absorbed.eval({{"x", 5.}}), 5.);
+
+  // chained constants: 2 * (3 * x) + 1 + 2 -> 6 * x + 3
+  const Graph chained = two * (three * x) + one + two;
+  const Graph simplified = chained.simplify();
+  EXPECT_EQ(simplified.size(), 5);
+  const Inputs inputs{{"x", 4.}};
+  EXPECT_FLOAT_EQ(simplified.eval(inputs), 27.);
+  const auto &[value, grads] = simplified.eval_grad(inputs);
+  EXPECT_FLOAT_EQ(value, 27.);
+  EXPECT_FLOAT_EQ(grads(0), 6.);
+}
+
+TEST(Tests, SimplifyOtherOps) {
+  const Var x{"x"};
+  const Const zero{0.};
+  const Const one{1.};
+  const Const two{2.};
+
+  EXPECT_EQ((x - zero).simplify().size(), 1);
+  EXPECT_EQ((x / one).simplify().size(), 1);
+  EXPECT_EQ((-(-x)).simplify().size(), 1);
+  EXPECT_EQ(pow(x, 1).simplify().size(), 1);
+  EXPECT_EQ(pow(x, 0).simplify().size(), 1);
+
+  const Graph folded = (exp(zero) - pow(two, 3) / log(one + one)).simplify();
+  EXPECT_EQ(folded.size(), 1);
+  EXPECT_FLOAT_EQ(folded.eval(Inputs{}), 1.f - 8.f / std::log(2.f));
+
+  // subtractions and divisions are not commutative
+  const Var y{"y"};
+  EXPECT_EQ((x - y + (y - x)).optimize().size(), 5);
+  EXPECT_FLOAT_EQ((x / y - y / x).eval({{"x", 1.}, {"y", 2.}}), -1.5);
+}
+
+TEST(Tests, CompileSimplifies) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const zero{0.};
+  const Const two{2.};
+
+  // x, 2, x*2, y*0 folds to 0 and vanishes with the sum
+  const Graph g = x * two + y * zero;
+  const CompiledGraph compiled = g.compile();
+  EXPECT_EQ(compiled.instructions().size(), 3);
+
+  // y no longer contributes, but it is still part of the layout
+  EXPECT_EQ(compiled.layout().size(), 2);
+  const auto &[value, grads] = g.eval_grad({{"x", 3.}, {"y", 5.}});
+  EXPECT_FLOAT_EQ(value, 6.);
+  EXPECT_FLOAT_EQ(grads(0), 2.);
+  EXPECT_FLOAT_EQ(grads(1), 0.);
+}
+
+TEST(Tests, FromFileKeepsLayout) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const zero{0.};
+
+  // x no longer contributes once simplified, but is still an input
+  const Graph g = x * zero + y;
+  ASSERT_TRUE(to_file(g, "layout_test.pb").ok());
+
+  const absl::StatusOr<Graph> gs = from_file("layout_test.pb");
+  ASSERT_TRUE(gs.ok());
+  EXPECT_EQ(gs->layout().names(), g.layout().names());
+  EXPECT_EQ(gs->compile().layout().names(), g.layout().names());
+
+  // dense inputs are read from the same slots
+  const std::vector<float> inputs{2., 3.};
+  EXPECT_FLOAT_EQ(gs->eval(inputs), 3.);
+  const auto &[value, grads] = gs->eval_grad(inputs);
+  EXPECT_FLOAT_EQ(value, 3.);
+  EXPECT_FLOAT_EQ(grads(0), 0.);
+  EXPECT_FLOAT_EQ(grads(1), 1.);
+}
+
+TEST(Tests, NodeFactory) {
+  NodeFactory f;
+  const Graph x = f.var("x");
+  const Graph y = f.var("y");
+  const Graph g =
+      f.sum(f.mul(x, y), f.mul(f.mul(f.var("y"), f.var("x")), f.constant(2.)));
+
+  // x, y, x*y, 2, x*y*2, x*y + x*y*2
+  EXPECT_EQ(g.size(), 6);
+  EXPECT_FLOAT_EQ(g.eval({{"x", 2.}, {"y", 3.}}), 18.);
+
+  // x-y and y-x differ, and so do powers with different exponents
+  EXPECT_EQ(f.sum(f.sub(x, y), f.sub(f.var("y"), f.var("x"))).size(), 5);
+  EXPECT_EQ(f.mul(f.pow(x, 2), f.pow(f.var("x"), 3)).size(), 4);
+  EXPECT_EQ(f.exp(x).size(), f.sum(f.exp(x), f.exp(x)).size() - 1);
+}
+
+TEST(Tests, GraphBuilder) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph outside = x * y;  // on the heap
+  std::optional<Graph> g;
+  {
+    GraphBuilder builder;
+    EXPECT_EQ(GraphBuilder::active(), &builder);
+    Graph inside = outside + x;
+    for (int i = 0; i < 1000; ++i) inside = inside * Const(1.f) + y;
+    g = inside;
+  }
+  EXPECT_EQ(GraphBuilder::active(), nullptr);
+
+  // the graph outlives the builder, and so does the heap graph it uses
+  const Inputs inputs{{"x", 2.}, {"y", 3.}};
+  EXPECT_FLOAT_EQ(g->eval(inputs), 3008.);
+  const auto &[value, grads] = g->eval_grad(inputs);
+  EXPECT_FLOAT_EQ(grads(0), 4.);
+  EXPECT_FLOAT_EQ(grads(1), 1002.);
+  EXPECT_FLOAT_EQ(outside.eval(inputs), 6.);
+}
+
+TEST(Tests, NestedGraphBuilders) {
+  const Var x{"x"};
+  GraphBuilder outer;
+  const Graph g1 = x + x;
+  std::optional<Graph> g2;
+  {
+    GraphBuilder inner;
+    EXPECT_EQ(GraphBuilder::active(), &inner);
+    g2 = g1 * x;
+  }
+  EXPECT_EQ(GraphBuilder::active(), &outer);
+  // the inner builder shared the outer arena, so this is not a reference
+  // cycle between arenas
+  const Graph g3 = *g2 + NodeFactory().constant(1.f);
+  EXPECT_FLOAT_EQ(g3.eval({{"x", 3.}}), 19.);
+}
+
+TEST(Tests, DeepGraphInBuilder) {
+  constexpr int kDepth = 500'000;
+  const Var x{"x"};
+  Graph g = x + x;
+  {
+    GraphBuilder builder;
+    for (int i = 0; i < kDepth; ++i) g = g + x;
+  }
+  EXPECT_FLOAT_EQ(g.eval({{"x", 1.}}), kDepth + 2.);
+  // the arena is freed when g goes out of scope
+}
+
+TEST(Tests, Hessian) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = x * x * y + y;
+  const Inputs inputs = {{"x", 2.}, {"y", 3.}};
+
+  // (d2g/dx2, d2g/dxdy, d2g/dy2) = (2y, 2x, 0)
+  const auto &[value, hess] = g.eval_hessian(inputs);
+  EXPECT_FLOAT_EQ(value, 15.);
+  EXPECT_FLOAT_EQ(hess(0, 0), 6.);
+  EXPECT_FLOAT_EQ(hess(0, 1), 4.);
+  EXPECT_FLOAT_EQ(hess(1, 0), 4.);
+  EXPECT_FLOAT_EQ(hess(1, 1), 0.);
+
+  const auto &[sparse_value, sparse_hess] = g.eval_sparse_hessian(inputs);
+  EXPECT_FLOAT_EQ(sparse_value, 15.);
+  EXPECT_EQ(Eigen::MatrixXf(sparse_hess), hess);
+
+  const Eigen::RowVectorXf hv = g.hvp(inputs, Eigen::RowVectorXf{{1., -1.}});
+  EXPECT_FLOAT_EQ(hv(0), 2.);
+  EXPECT_FLOAT_EQ(hv(1), 4.);
+}
+
+TEST(Tests, Stats) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const c{2.};
+  const Graph xy = x * y;
+  const Graph g = (xy + xy) * (xy + c);
+
+  const GraphStats stats = g.stats();
+  EXPECT_EQ(stats.n_sums, 2);
+  EXPECT_EQ(stats.n_muls, 2);
+  EXPECT_EQ(stats.n_vars, 2);
+  EXPECT_EQ(stats.n_consts, 1);
+  EXPECT_EQ(stats.n_nodes(), g.size());
+  EXPECT_EQ(stats.depth, 3);
+  // xy is used three times
+  EXPECT_EQ(stats.max_fan_out, 3);
+  EXPECT_EQ(stats.n_shared, 1);
+  // written out in full, g has 3 copies of xy (3 nodes each), 2 sums, c and
+  // the root
+  EXPECT_DOUBLE_EQ(stats.sharing_ratio, 13. / 7.);
+}
+
+TEST(Tests, ConcurrentEvaluation) {
+  // a graph shared by all threads, compiled by whichever evaluates it first...
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Graph xy = x * y;
+  const Graph g = x * xy + xy * z + exp(-z) * (x + y) + pow(y, 3);
+
+  constexpr int n_threads = 8;
+  constexpr int n_points = 200;
+  const auto point = [](int thread, int i) {
+    return std::vector<float>{0.1f * thread, 0.01f * i, 1.f - 0.005f * i};
+  };
+
+  // the expected results, from a graph that is not shared
+  const Graph reference = x * (x * y) + (x * y) * z + exp(-z) * (x + y) +
+                          pow(y, 3);
+  std::vector<std::vector<std::pair<float, Eigen::RowVectorXf>>> expected(
+      n_threads);
+  for (int t = 0; t < n_threads; ++t)
+    for (int i = 0; i < n_points; ++i)
+      expected[t].push_back(reference.eval_grad(point(t, i)));
+
+  // ...and a compiled graph shared by all threads, each with its own context
+  const CompiledGraph cg = reference.compile();
+
+  std::vector<int> n_mismatches(n_threads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t] {
+      EvalContext ctx;
+      Eigen::RowVectorXf grads(3);
+      for (int i = 0; i < n_points; ++i) {
+        const std::vector<float> p = point(t, i);
+        const auto &[value, grad] = expected[t][i];
+        const auto &[value1, grads1] = g.eval_grad(p);
+        const float value2 = cg.eval_grad(p, grads, ctx);
+        const Inputs inputs{{"x", p[0]}, {"y", p[1]}, {"z", p[2]}};
+        if (value1 != value || grads1 != grad || value2 != value ||
+            grads != grad || g.eval(inputs) != value)
+          ++n_mismatches[t];
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  for (int t = 0; t < n_threads; ++t)
+    EXPECT_EQ(n_mismatches[t], 0) << "thread " << t;
+}
+
+TEST(Tests, MultiGraph) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{2.};
+  // x*y is shared by the first three outputs
+  const std::vector<Graph> outputs = {x * y * z, x * y + z, x * y, c * x};
+  const MultiGraph mg(outputs);
+  ASSERT_EQ(mg.n_outputs(), 4);
+  // w is not used by any output
+  const Inputs inputs = {{"w", 1.}, {"x", 2.}, {"y", 3.}, {"z", 4.}};
+
+  // x, y, z, c, x*y, x*y*z, x*y + z and c*x: every node appears once
+  const CompiledMultiGraph cmg = mg.compile();
+  EXPECT_EQ(cmg.instructions().size(), 8);
+
+  const Eigen::VectorXf values = mg.eval(inputs);
+  ASSERT_EQ(values.size(), 4);
+  for (std::size_t k = 0; k < outputs.size(); ++k)
+    EXPECT_FLOAT_EQ(values(k), outputs[k].eval(inputs));
+
+  for (GradMode mode : {GradMode::kAuto, GradMode::kForward,
+                        GradMode::kReverse, GradMode::kSparseForward}) {
+    const auto &[jac_values, jac] = mg.eval_jacobian(inputs, mode);
+    EXPECT_EQ(jac_values, values);
+    ASSERT_EQ(jac.rows(), 4);
+    ASSERT_EQ(jac.cols(), 4);
+    for (std::size_t k = 0; k < outputs.size(); ++k) {
+      const auto &[value, grad] = outputs[k].eval_grad(inputs);
+      EXPECT_EQ(jac.row(k), grad) << "output " << k;
+    }
+  }
+}
+
+TEST(TestsDeathTest, ErrorsAreReported) {
+  const Var x{"x"};
+  const Graph g = x * x;
+  EXPECT_DEATH(g.eval(Inputs{}), "No value was provided for variable 'x'");
+
+  // node 0 refers to node 1, which does not precede it
+  gpb::Graph gproto;
+  gpb::Node& node = *gproto.mutable_dag()->add_nodes();
+  node.mutable_sum()->set_op1(1);
+  node.mutable_sum()->set_op2(1);
+  EXPECT_DEATH(Graph::from_proto(gproto), "does not precede it");
+}
@@ -0,0 +1,215 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "incremental_evaluator.h"
+
+#include <cassert>
+#include <optional>
+#include <string>
+#include <utility>  // std::move
+
+#include "absl/algorithm/container.h"
+#include "absl/status/statusor.h"
+#include "graph_autodiff/fail.h"
+#include "graph_autodiff/ops.h"
+
+using namespace graph_autodiff;
+
+IncrementalEvaluator::IncrementalEvaluator(CompiledGraph graph_,
+                                           absl::Span<const float> inputs)
+    : cg(std::move(graph_)), var_values(inputs.begin(), inputs.end()) {
+  const absl::Span<const Instruction> tape = cg.instructions();
+  const std::size_t n_vars = cg.layout().size();
+  assert(var_values.size() == n_vars);
+
+  // the derivatives that each instruction can have: those w.r.t. the
+  // variables it depends on, merged from its operands' in sorted order
+  grad_begin.resize(tape.size() + 1);
+  for (std::uint32_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    grad_begin[i] = grad_slots.size();
+    switch (instr.opcode) {
+      case OpCode::kConst:
+        break;
+      case OpCode::kVar:
+        grad_slots.push_back(instr.op1);
+        break;
+      default: {
+        // unary operations merge with an empty range
+        const bool is_binary = n_operands(instr.opcode) == 2;
+        std::uint32_t j1 = grad_begin[instr.op1];
+        std::uint32_t j2 = is_binary ? grad_begin[instr.op2] : 0;
+        const std::uint32_t end1 = grad_begin[instr.op1 + 1];
+        const std::uint32_t end2 = is_binary ? grad_begin[instr.op2 + 1] : 0;
+        // indices rather than iterators: grad_slots grows while we read it
+        while (j1 < end1 || j2 < end2) {
+          if (j2 == end2 || (j1 < end1 && grad_slots[j1] < grad_slots[j2])) {
+            grad_slots.push_back(grad_slots[j1++]);
+          } else if (j1 == end1 || grad_slots[j2] < grad_slots[j1]) {
+            grad_slots.push_back(grad_slots[j2++]);
+          } else {
+            grad_slots.push_back(grad_slots[j1++]);
+            ++j2;
+          }
+        }
+        break;
+      }
+    }
+  }
+  grad_begin.back() = grad_slots.size();
+  grads.resize(grad_slots.size());
+
+  // reverse edges, to find what depends on a changed variable
+  user_begin.assign(tape.size() + 1, 0);
+  var_instr_begin.assign(n_vars + 1, 0);
+  for (const Instruction& instr : tape) {
+    if (instr.opcode == OpCode::kVar) ++var_instr_begin[instr.op1 + 1];
+    const int n_ops = n_operands(instr.opcode);
+    if (n_ops == 0) continue;
+    ++user_begin[instr.op1 + 1];
+    if (n_ops == 2 && instr.op2 != instr.op1) ++user_begin[instr.op2 + 1];
+  }
+  for (std::size_t i = 0; i < tape.size(); ++i)
+    user_begin[i + 1] += user_begin[i];
+  for (std::size_t s = 0; s < n_vars; ++s)
+    var_instr_begin[s + 1] += var_instr_begin[s];
+  users.resize(user_begin.back());
+  var_instrs.resize(var_instr_begin.back());
+  std::vector<std::uint32_t> n_users(tape.size(), 0);
+  std::vector<std::uint32_t> n_var_instrs(n_vars, 0);
+  for (std::uint32_t i = 0; i < tape.size(); ++i) {
+    const Instruction& instr = tape[i];
+    if (instr.opcode == OpCode::kVar) {
+      var_instrs[var_instr_begin[instr.op1] + n_var_instrs[instr.op1]++] = i;
+      continue;
+    }
+    const int n_ops = n_operands(instr.opcode);
+    if (n_ops == 0) continue;
+    users[user_begin[instr.op1] + n_users[instr.op1]++] = i;
+    if (n_ops == 2 && instr.op2 != instr.op1)
+      users[user_begin[instr.op2] + n_users[instr.op2]++] = i;
+  }
+
+  values.resize(tape.size());
+  for (std::uint32_t i = 0; i < tape.size(); ++i) recompute(i);
+  n_recomputed_ = tape.size();
+  is_dirty.assign(tape.size(), false);
+
+  gradient_ = Eigen::RowVectorXf::Zero(n_vars);
+  const std::uint32_t root = tape.size() - 1;
+  for (std::uint32_t j = grad_begin[root]; j < grad_begin[root + 1]; ++j)
+    gradient_[grad_slots[j]] = grads[j];
+}
+
+namespace {
+std::vector<float> bind_or_abort(const CompiledGraph& graph,
+                                 const Inputs& inputs) {
+  absl::StatusOr<std::vector<float>> var_values = graph.layout().bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  return *std::move(var_values);
+}
+}  // end of anonymous namespace
+
+IncrementalEvaluator::IncrementalEvaluator(CompiledGraph graph_,
+                                           const Inputs& inputs)
+    : IncrementalEvaluator(graph_, bind_or_abort(graph_, inputs)) {}
+
+void IncrementalEvaluator::recompute(std::uint32_t i) noexcept {
+  const Instruction& instr = cg.instructions()[i];
+  switch (instr.opcode) {
+    case OpCode::kConst:
+      values[i] = cg.constant_table()[instr.op1];
+      return;
+    case OpCode::kVar:
+      values[i] = var_values[instr.op1];
+      grads[grad_begin[i]] = 1.;
+      return;
+    default:
+      values[i] =
+          apply_op(instr, values[instr.op1], operand2(instr, values));
+      break;
+  }
+
+  // same merge as in the constructor, into the existing ranges
+  const auto [c1, c2] = instr_partials(instr, i, values);
+  const bool is_binary = n_operands(instr.opcode) == 2;
+  std::uint32_t j1 = grad_begin[instr.op1];
+  std::uint32_t j2 = is_binary ? grad_begin[instr.op2] : 0;
+  const std::uint32_t end1 = grad_begin[instr.op1 + 1];
+  const std::uint32_t end2 = is_binary ? grad_begin[instr.op2 + 1] : 0;
+  for (std::uint32_t j = grad_begin[i]; j < grad_begin[i + 1]; ++j) {
+    float grad = 0.f;
+    if (j1 < end1 && grad_slots[j1] == grad_slots[j]) grad += c1 * grads[j1++];
+    if (j2 < end2 && grad_slots[j2] == grad_slots[j]) grad += c2 * grads[j2++];
+    grads[j] = grad;
+  }
+}
+
+void IncrementalEvaluator::invalidate(std::size_t slot) {
+  for (std::uint32_t k = var_instr_begin[slot]; k < var_instr_begin[slot + 1];
+       ++k) {
+    const std::uint32_t i = var_instrs[k];
+    if (!is_dirty[i]) {
+      is_dirty[i] = true;
+      stack.push_back(i);
+    }
+  }
+}
+
+void IncrementalEvaluator::flush() {
+  // collect everything downstream of the changed variables...
+  dirty.clear();
+  while (!stack.empty()) {
+    const std::uint32_t i = stack.back();
+    stack.pop_back();
+    dirty.push_back(i);
+    for (std::uint32_t k = user_begin[i]; k < user_begin[i + 1]; ++k) {
+      const std::uint32_t user = users[k];
+      if (!is_dirty[user]) {
+        is_dirty[user] = true;
+        stack.push_back(user);
+      }
+    }
+  }
+
+  // ...and evaluate it again in tape order, so that operands come first
+  absl::c_sort(dirty);
+  for (std::uint32_t i : dirty) {
+    recompute(i);
+    is_dirty[i] = false;
+  }
+  n_recomputed_ = dirty.size();
+
+  const std::uint32_t root = values.size() - 1;
+  if (!dirty.empty() && dirty.back() == root) {
+    for (std::uint32_t j = grad_begin[root]; j < grad_begin[root + 1]; ++j)
+      gradient_[grad_slots[j]] = grads[j];
+  }
+}
+
+void IncrementalEvaluator::update(std::size_t slot, float value) {
+  assert(slot < var_values.size());
+  var_values[slot] = value;
+  invalidate(slot);
+  flush();
+}
+
+void IncrementalEvaluator::update(std::string_view name, float value) {
+  if (const std::optional<std::size_t> slot = cg.layout().slot(name))
+    update(*slot, value);
+  else
+    n_recomputed_ = 0;
+}
+
+void IncrementalEvaluator::update(const Inputs& changes) {
+  for (const auto& [name, value] : changes) {
+    if (const std::optional<std::size_t> slot = cg.layout().slot(name)) {
+      var_values[*slot] = value;
+      invalidate(*slot);
+    }
+  }
+  flush();
+}
@@ -0,0 +1,114 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <cstddef>  // std::size_t
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "Eigen/Core"
+#include "absl/types/span.h"
+#include "graph_autodiff/compiled_graph.h"
+
+namespace graph_autodiff {
+
+/// Evaluates a graph and its gradient at a point that changes a few
+/// variables at a time.
+/// The value and the nonzero derivatives of every instruction are cached.
+/// When variables change, only the instructions that depend on them (the
+/// path from the changed variables to the result) are evaluated again, so
+/// the cost of an update depends on the size of that path rather than on
+/// the size of the graph.
+/// Derivatives are cached as in GradMode::kSparseForward, one per variable
+/// that each instruction depends on: memory use is proportional to the sum
+/// of those counts, which is small for graphs in which most nodes only
+/// depend on a few variables but grows quadratically for e.g. long chains.
+/// Unlike CompiledGraph, an IncrementalEvaluator is stateful: it must not be
+/// used by several threads at the same time.
+class IncrementalEvaluator {
+  CompiledGraph cg;
+  /// The current value of each variable, in layout order.
+  std::vector<float> var_values;
+  /// The value of each instruction.
+  std::vector<float> values;
+  /// The nonzero derivatives of instruction i are
+  /// grads[grad_begin[i]:grad_begin[i+1]], w.r.t. the variables at the same
+  /// positions of grad_slots (sorted). Which derivatives are nonzero only
+  /// depends on the structure of the graph, so the ranges never change.
+  std::vector<std::uint32_t> grad_begin;
+  std::vector<std::uint32_t> grad_slots;
+  std::vector<float> grads;
+  /// The instructions that use instruction i as an operand are
+  /// users[user_begin[i]:user_begin[i+1]].
+  std::vector<std::uint32_t> user_begin;
+  std::vector<std::uint32_t> users;
+  /// The kVar instructions that load the variable in slot s are
+  /// var_instrs[var_instr_begin[s]:var_instr_begin[s+1]].
+  std::vector<std::uint32_t> var_instr_begin;
+  std::vector<std::uint32_t> var_instrs;
+  /// The gradient of the result, in layout order.
+  Eigen::RowVectorXf gradient_;
+
+  // scratch state of update(): instructions whose variables changed and
+  // ones that must be evaluated again
+  std::vector<std::uint32_t> stack;
+  std::vector<std::uint32_t> dirty;
+  std::vector<bool> is_dirty;
+  std::size_t n_recomputed_ = 0;
+
+  /// Compute the value and derivatives of instruction `i` from those of its
+  /// operands.
+  void recompute(std::uint32_t i) noexcept;
+
+  /// Mark the instructions that load the variable in `slot` as dirty.
+  void invalidate(std::size_t slot);
+
+  /// Evaluate all dirty instructions again.
+  void flush();
+
+ public:
+  /// Evaluate `graph` at the given point, passed as one value per variable
+  /// in the order given by graph.layout().
+  IncrementalEvaluator(CompiledGraph graph, absl::Span<const float> inputs);
+
+  /// Evaluate `graph` at the given point. All of its variables must be part
+  /// of `inputs`: inputs that are not part of the graph are ignored.
+  IncrementalEvaluator(CompiledGraph graph, const Inputs& inputs);
+
+  /// Set the value of variable `name` and re-evaluate the instructions that
+  /// depend on it. Variables that are not part of the graph are ignored.
+  void update(std::string_view name, float value);
+
+  /// Set the values of several variables at once, e.g.
+  /// `update({{"x", 2.5}, {"y", 1.}})`, and re-evaluate the instructions
+  /// that depend on any of them, each at most once.
+  void update(const Inputs& changes);
+
+  /// Same as update(std::string_view, float), for the variable in slot
+  /// `slot` of graph().layout().
+  void update(std::size_t slot, float value);
+
+  /// The value of the graph at the current point.
+  float value() const noexcept { return values.back(); }
+
+  /// The gradient of the graph at the current point, with one element per
+  /// variable in the order given by graph().layout().
+  const Eigen::RowVectorXf& gradient() const noexcept { return gradient_; }
+
+  /// The value of the variable in slot `slot` of graph().layout().
+  float input(std::size_t slot) const noexcept { return var_values[slot]; }
+
+  /// The number of instructions that the last update evaluated again.
+  std::size_t n_recomputed() const noexcept { return n_recomputed_; }
+
+  /// The graph being evaluated.
+  const CompiledGraph& graph() const noexcept { return cg; }
+};
+
+}  // namespace graph_autodiff
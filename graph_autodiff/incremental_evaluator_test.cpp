@@ -0,0 +1,99 @@
+#include "graph_autodiff/incremental_evaluator.h"
+
+#include <gtest/gtest.h>
+
+#include <cstddef>  // std::size_t
+#include <string>
+#include <utility>  // std::move
+#include <vector>
+
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+// check the evaluator's state against a full evaluation at the same point
+void expect_consistent(const IncrementalEvaluator& ev) {
+  const CompiledGraph& cg = ev.graph();
+  std::vector<float> inputs(cg.layout().size());
+  for (std::size_t s = 0; s < inputs.size(); ++s) inputs[s] = ev.input(s);
+  const auto& [value, grad] = cg.eval_grad(inputs);
+  EXPECT_FLOAT_EQ(ev.value(), value);
+  ASSERT_EQ(ev.gradient().size(), grad.size());
+  for (Eigen::Index i = 0; i < grad.size(); ++i)
+    EXPECT_FLOAT_EQ(ev.gradient()(i), grad(i)) << "variable " << i;
+}
+
+TEST(IncrementalEvaluator, UpdatesMatchFullEvaluation) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{10.};
+  const Graph xy = x * y;
+  const Graph g = x * x * x * y + xy * z + c * z * (x + y) + xy + c;
+
+  IncrementalEvaluator ev(g.compile(), {{"x", 2.}, {"y", 3.}, {"z", 4.}});
+  EXPECT_FLOAT_EQ(ev.value(), 264.);
+  expect_consistent(ev);
+
+  ev.update("x", 2.5);
+  expect_consistent(ev);
+  ev.update("z", -1.);
+  expect_consistent(ev);
+  ev.update({{"x", 1.}, {"y", -2.}});
+  expect_consistent(ev);
+  ev.update(/*slot=*/2, 0.5);
+  EXPECT_FLOAT_EQ(ev.input(2), 0.5);
+  expect_consistent(ev);
+
+  // variables that are not part of the graph are ignored
+  ev.update("w", 1.);
+  EXPECT_EQ(ev.n_recomputed(), 0);
+  expect_consistent(ev);
+}
+
+TEST(IncrementalEvaluator, OtherOps) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = exp(-x) / pow(x - y, 2) + log(x * y);
+
+  IncrementalEvaluator ev(g.compile(), {{"x", 2.}, {"y", 3.}});
+  expect_consistent(ev);
+  ev.update("x", 1.5);
+  expect_consistent(ev);
+  ev.update("y", 0.5);
+  expect_consistent(ev);
+}
+
+TEST(IncrementalEvaluator, OnlyTheAffectedPathIsRecomputed) {
+  // a balanced tree of sums over products of pairs of variables
+  constexpr std::size_t n_vars = 1024;
+  std::vector<Var> vars;
+  for (std::size_t i = 0; i < n_vars; ++i)
+    vars.emplace_back("x" + std::to_string(i));
+  std::vector<Graph> level;
+  for (std::size_t i = 0; i < n_vars; i += 2)
+    level.push_back(vars[i] * vars[i + 1]);
+  while (level.size() > 1) {
+    std::vector<Graph> next;
+    for (std::size_t i = 0; i < level.size(); i += 2)
+      next.push_back(level[i] + level[i + 1]);
+    level = std::move(next);
+  }
+
+  const CompiledGraph cg = level.front().compile();
+  IncrementalEvaluator ev(cg, std::vector<float>(n_vars, 1.));
+  EXPECT_EQ(ev.n_recomputed(), cg.instructions().size());
+  EXPECT_FLOAT_EQ(ev.value(), 512.);
+
+  // the variable, its product and the 9 sums above it
+  ev.update("x17", 3.);
+  EXPECT_EQ(ev.n_recomputed(), 11);
+  EXPECT_FLOAT_EQ(ev.value(), 514.);
+  expect_consistent(ev);
+
+  // shared paths are only recomputed once
+  ev.update({{"x16", 2.}, {"x17", 2.}});
+  EXPECT_EQ(ev.n_recomputed(), 12);
+  EXPECT_FLOAT_EQ(ev.value(), 515.);
+  expect_consistent(ev);
+}
@@ -0,0 +1,169 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "jit.h"
+
+#include <dlfcn.h>   // dlopen, dlsym, dlclose
+#include <stdlib.h>  // mkdtemp
+
+#include <cassert>
+#include <cstdlib>  // std::getenv, std::system
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "fmt/core.h"
+#include "graph_autodiff/codegen.h"
+#include "graph_autodiff/fail.h"
+
+using namespace graph_autodiff;
+
+namespace {
+constexpr const char* kEvalSymbol = "graph_autodiff_jit_eval";
+constexpr const char* kEvalGradSymbol = "graph_autodiff_jit_eval_grad";
+
+std::string generate_source(const CompiledGraph& graph) {
+  std::string source = "#include <cmath>\n#include <limits>\n\n";
+  source += fmt::format("extern \"C\" float {}(const float* inputs) {{\n",
+                        kEvalSymbol);
+  source += generate_function_body(graph, /*with_gradient=*/false);
+  source += "}\n\n";
+  source += fmt::format(
+      "extern \"C\" float {}(const float* inputs, float* grad) {{\n",
+      kEvalGradSymbol);
+  source += generate_function_body(graph, /*with_gradient=*/true);
+  source += "}\n";
+  return source;
+}
+
+// Removes a directory and its contents when it goes out of scope.
+struct DirectoryRemover {
+  fs::path path;
+  ~DirectoryRemover() {
+    std::error_code ec;  // nothing to do about errors
+    fs::remove_all(path, ec);
+  }
+};
+
+absl::StatusOr<fs::path> make_temp_directory() {
+  std::string path =
+      (fs::temp_directory_path() / "graph_autodiff_jit_XXXXXX").string();
+  if (mkdtemp(path.data()) == nullptr)
+    return absl::InternalError("Could not create a temporary directory.");
+  return path;
+}
+}  // end of anonymous namespace
+
+JitGraph::JitGraph(std::shared_ptr<void> library_, EvalFn eval_fn_,
+                   EvalGradFn eval_grad_fn_, VariableLayout layout_)
+    : library(std::move(library_)),
+      eval_fn(eval_fn_),
+      eval_grad_fn(eval_grad_fn_),
+      var_layout(std::move(layout_)) {}
+
+absl::StatusOr<JitGraph> JitGraph::compile(const CompiledGraph& graph,
+                                           const JitOptions& options) {
+  const absl::StatusOr<fs::path> dir = make_temp_directory();
+  if (!dir.ok()) return dir.status();
+  // the library can be removed as soon as it is loaded
+  const DirectoryRemover remover{*dir};
+  const fs::path source_path = *dir / "graph.cpp";
+  const fs::path library_path = *dir / "graph.so";
+  const fs::path log_path = *dir / "compiler.log";
+
+  {
+    std::ofstream source_file(source_path);
+    source_file << generate_source(graph);
+    if (!source_file.good()) {
+      return absl::InternalError(fmt::format("Could not write file {}.",
+                                             source_path.string()));
+    }
+  }
+
+  std::string compiler = options.compiler;
+  if (compiler.empty()) {
+    const char* cxx = std::getenv("CXX");
+    compiler = cxx ? cxx : "c++";
+  }
+  const std::string command = fmt::format(
+      "{} {} -std=c++17 -shared -fPIC -o '{}' '{}' > '{}' 2>&1", compiler,
+      options.flags, library_path.string(), source_path.string(),
+      log_path.string());
+  if (std::system(command.c_str()) != 0) {
+    std::ifstream log_file(log_path);
+    const std::string log(std::istreambuf_iterator<char>(log_file), {});
+    return absl::InternalError(
+        fmt::format("Compilation with `{}` failed:\n{}", command, log));
+  }
+
+  void* handle = dlopen(library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    return absl::InternalError(
+        fmt::format("Could not load the compiled graph: {}", dlerror()));
+  }
+  // the library stays loaded until the last copy of the JitGraph is gone
+  std::shared_ptr<void> library(handle, [](void* h) { dlclose(h); });
+
+  const auto eval_fn = reinterpret_cast<EvalFn>(dlsym(handle, kEvalSymbol));
+  const auto eval_grad_fn =
+      reinterpret_cast<EvalGradFn>(dlsym(handle, kEvalGradSymbol));
+  if (eval_fn == nullptr || eval_grad_fn == nullptr)
+    return absl::InternalError("The compiled graph lacks entry points.");
+
+  return JitGraph(std::move(library), eval_fn, eval_grad_fn, graph.layout());
+}
+
+absl::StatusOr<JitGraph> JitGraph::compile(const Graph& graph,
+                                           const JitOptions& options) {
+  return compile(graph.compile(), options);
+}
+
+float JitGraph::eval(const Inputs& inputs) const noexcept {
+  const absl::StatusOr<std::vector<float>> var_values =
+      var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  return eval(*var_values);
+}
+
+float JitGraph::eval(absl::Span<const float> inputs) const noexcept {
+  assert(inputs.size() == var_layout.size());
+  return eval_fn(inputs.data());
+}
+
+std::pair<float, Eigen::RowVectorXf> JitGraph::eval_grad(
+    const Inputs& inputs) const noexcept {
+  const absl::StatusOr<std::vector<float>> var_values =
+      var_layout.bind(inputs);
+  if (!var_values.ok()) fail(var_values.status());
+  const auto [value, var_grads] = eval_grad(*var_values);
+
+  // derivatives w.r.t. inputs that do not appear in the graph are zero
+  Eigen::RowVectorXf grads = Eigen::RowVectorXf::Zero(inputs.size());
+  const std::vector<std::size_t> grad_cols =
+      var_layout.gradient_columns(inputs);
+  for (std::size_t i = 0; i < grad_cols.size(); ++i)
+    grads[grad_cols[i]] = var_grads[i];
+
+  return {value, grads};
+}
+
+std::pair<float, Eigen::RowVectorXf> JitGraph::eval_grad(
+    absl::Span<const float> inputs) const noexcept {
+  Eigen::RowVectorXf grads(var_layout.size());
+  const float value = eval_grad(inputs, grads);
+  return {value, grads};
+}
+
+float JitGraph::eval_grad(
+    absl::Span<const float> inputs,
+    Eigen::Ref<Eigen::RowVectorXf> grad_out) const noexcept {
+  assert(inputs.size() == var_layout.size());
+  assert(std::size_t(grad_out.size()) == var_layout.size());
+  return eval_grad_fn(inputs.data(), grad_out.data());
+}
@@ -0,0 +1,93 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>  // std::pair
+
+#include "Eigen/Core"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "graph_autodiff/compiled_graph.h"
+#include "graph_autodiff/graph.h"
+
+namespace graph_autodiff {
+
+/// How JitGraph::compile() invokes the system's C++ compiler.
+struct JitOptions {
+  /// The compiler executable. If empty, the CXX environment variable is
+  /// used, or `c++` if that is not set either.
+  std::string compiler;
+  /// Flags passed to the compiler, in addition to those required to build a
+  /// shared library.
+  std::string flags = "-O2";
+};
+
+/// A graph compiled to native code at runtime.
+/// The graph is translated to straight-line C++ (see codegen.h), which the
+/// system's C++ compiler builds into a shared library that is then loaded
+/// into the process. Evaluation has the same API and result layout as that
+/// of CompiledGraph. Compilation takes a while, especially for large graphs:
+/// JIT-compiling only pays off for graphs that are evaluated many times.
+/// Copies share the loaded code. The generated functions have no state, so
+/// like CompiledGraph, a JitGraph can be evaluated by several threads at the
+/// same time.
+class JitGraph {
+  using EvalFn = float (*)(const float* inputs);
+  using EvalGradFn = float (*)(const float* inputs, float* grad);
+
+  std::shared_ptr<void> library;  // the dlopen handle
+  EvalFn eval_fn = nullptr;
+  EvalGradFn eval_grad_fn = nullptr;
+  VariableLayout var_layout;
+
+  JitGraph(std::shared_ptr<void> library, EvalFn eval_fn,
+           EvalGradFn eval_grad_fn, VariableLayout layout);
+
+ public:
+  /// Compile `graph` to native code.
+  /// Returns an error if the compiler is not available or fails.
+  static absl::StatusOr<JitGraph> compile(const CompiledGraph& graph,
+                                          const JitOptions& options = {});
+
+  /// Same as compile(const CompiledGraph&, const JitOptions&), for the
+  /// result of graph.compile().
+  static absl::StatusOr<JitGraph> compile(const Graph& graph,
+                                          const JitOptions& options = {});
+
+  /// Evaluate the graph at the given point.
+  float eval(const Inputs& inputs) const noexcept;
+
+  /// Evaluate the graph at the given point, passed as one value per variable
+  /// in the order given by layout().
+  float eval(absl::Span<const float> inputs) const noexcept;
+
+  /// Evaluate the graph and its gradient at the given point.
+  /// See Graph::eval_grad() for the layout of the gradient.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      const Inputs& inputs) const noexcept;
+
+  /// Evaluate the graph and its gradient at the given point, passed as one
+  /// value per variable in the order given by layout(). The gradient has the
+  /// same layout as the inputs.
+  std::pair<float, Eigen::RowVectorXf> eval_grad(
+      absl::Span<const float> inputs) const noexcept;
+
+  /// Same as eval_grad(absl::Span<const float>), but the gradient is written
+  /// into `grad_out`, which must have one element per variable. Performs no
+  /// heap allocations. Returns the graph's value.
+  float eval_grad(absl::Span<const float> inputs,
+                  Eigen::Ref<Eigen::RowVectorXf> grad_out) const noexcept;
+
+  /// The variables used in the graph and their slots in dense input and
+  /// gradient vectors.
+  const VariableLayout& layout() const noexcept { return var_layout; }
+};
+
+}  // namespace graph_autodiff
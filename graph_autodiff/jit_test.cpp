@@ -0,0 +1,75 @@
+#include "graph_autodiff/jit.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+TEST(Jit, SameResultsAsCompiledGraph) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Var z{"z"};
+  const Const c{0.1};
+  const Graph xy = x * y;
+  const Graph g = x * xy + xy * z + c * z * (x + y) + c;
+  const CompiledGraph cg = g.compile();
+
+  const absl::StatusOr<JitGraph> jit = JitGraph::compile(cg);
+  ASSERT_TRUE(jit.ok()) << jit.status();
+  EXPECT_EQ(jit->layout().names(), cg.layout().names());
+
+  const std::vector<float> inputs{2., 3., 4.};
+  EXPECT_FLOAT_EQ(jit->eval(inputs), cg.eval(inputs));
+  const auto &[value, grads] = cg.eval_grad(inputs);
+  const auto &[jit_value, jit_grads] = jit->eval_grad(inputs);
+  EXPECT_FLOAT_EQ(jit_value, value);
+  ASSERT_EQ(jit_grads.size(), 3);
+  for (int i = 0; i < 3; ++i) EXPECT_FLOAT_EQ(jit_grads(i), grads(i));
+
+  // same gradient layout as Graph::eval_grad: one element per input
+  const Inputs named_inputs{{"w", 1.}, {"x", 2.}, {"y", 3.}, {"z", 4.}};
+  const auto &[named_value, named_grads] = jit->eval_grad(named_inputs);
+  EXPECT_FLOAT_EQ(named_value, value);
+  ASSERT_EQ(named_grads.size(), 4);
+  EXPECT_FLOAT_EQ(named_grads(0), 0.);
+  for (int i = 0; i < 3; ++i) EXPECT_FLOAT_EQ(named_grads(i + 1), grads(i));
+}
+
+TEST(Jit, OtherOps) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Graph g = exp(-x) / pow(x - y, 5) + log(x * y) - pow(y, -3);
+  const CompiledGraph cg = g.compile();
+
+  const absl::StatusOr<JitGraph> jit = JitGraph::compile(cg);
+  ASSERT_TRUE(jit.ok()) << jit.status();
+  const std::vector<float> inputs{2.5, 0.5};
+  const auto &[value, grads] = cg.eval_grad(inputs);
+  const auto &[jit_value, jit_grads] = jit->eval_grad(inputs);
+  EXPECT_FLOAT_EQ(jit_value, value);
+  for (int i = 0; i < 2; ++i) EXPECT_FLOAT_EQ(jit_grads(i), grads(i));
+}
+
+TEST(Jit, UnusedVariable) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const zero{0.};
+  // y is part of the layout but simplified away
+  const absl::StatusOr<JitGraph> jit = JitGraph::compile(x * x + y * zero);
+  ASSERT_TRUE(jit.ok()) << jit.status();
+  const auto &[value, grads] = jit->eval_grad(std::vector<float>{3., 5.});
+  EXPECT_FLOAT_EQ(value, 9.);
+  EXPECT_FLOAT_EQ(grads(0), 6.);
+  EXPECT_FLOAT_EQ(grads(1), 0.);
+}
+
+TEST(Jit, CompilerErrors) {
+  const Var x{"x"};
+  JitOptions options;
+  options.compiler = "false";
+  EXPECT_FALSE(JitGraph::compile(x * x, options).ok());
+}
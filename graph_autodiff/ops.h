@@ -0,0 +1,187 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <cmath>  // std::exp, std::log
+#include <cstddef>  // std::size_t
+#include <cstdint>
+#include <utility>  // std::pair
+#include <vector>
+
+#include "graph_autodiff/compiled_graph.h"
+
+// The arithmetic of the operations that instructions perform: their values
+// and their hand-written first and second derivatives w.r.t. their
+// operands. Operations are all instructions other than kConst and kVar.
+
+namespace graph_autodiff {
+
+/// The number of operands of instructions with the given opcode, i.e. of
+/// earlier instructions whose results they read: `op1` if at least one,
+/// `op1` and `op2` if two.
+constexpr int n_operands(OpCode opcode) noexcept {
+  switch (opcode) {
+    case OpCode::kConst:
+    case OpCode::kVar:
+      return 0;
+    case OpCode::kNeg:
+    case OpCode::kPow:
+    case OpCode::kExp:
+    case OpCode::kLog:
+      return 1;
+    default:
+      return 2;
+  }
+}
+
+/// The exponent of a kPow instruction.
+constexpr std::int32_t pow_exponent(const Instruction& instr) noexcept {
+  return static_cast<std::int32_t>(instr.op2);
+}
+
+/// `x` to the integer power `n`, by repeated squaring: about log2(|n|)
+/// multiplications. Negative powers are the reciprocals of positive ones.
+template <typename T>
+constexpr T ipow(T x, std::int64_t n) noexcept {
+  std::uint64_t e = n < 0 ? -std::uint64_t(n) : std::uint64_t(n);
+  T result = T(1);
+  while (e != 0) {
+    if (e & 1) result *= x;
+    x *= x;
+    e >>= 1;
+  }
+  return n < 0 ? T(1) / result : result;
+}
+
+/// The value of the operation `instr` on operands with values `a` and `b`.
+/// `b` is ignored by unary operations.
+template <typename T>
+T apply_op(const Instruction& instr, T a, T b) noexcept {
+  switch (instr.opcode) {
+    case OpCode::kSum:
+      return a + b;
+    case OpCode::kMul:
+      return a * b;
+    case OpCode::kSub:
+      return a - b;
+    case OpCode::kDiv:
+      return a / b;
+    case OpCode::kNeg:
+      return -a;
+    case OpCode::kPow:
+      return ipow(a, pow_exponent(instr));
+    case OpCode::kExp:
+      return std::exp(a);
+    case OpCode::kLog:
+      return std::log(a);
+    case OpCode::kConst:
+    case OpCode::kVar:
+      break;
+  }
+  return T(0);  // not an operation
+}
+
+/// The derivatives of the operation `instr` w.r.t. its operands, which have
+/// values `a` and `b`, given its result `value`. The derivative w.r.t. `b`
+/// is zero for unary operations.
+template <typename T>
+std::pair<T, T> op_partials(const Instruction& instr, T a, T b,
+                            T value) noexcept {
+  switch (instr.opcode) {
+    case OpCode::kSum:
+      return {T(1), T(1)};
+    case OpCode::kMul:
+      return {b, a};
+    case OpCode::kSub:
+      return {T(1), T(-1)};
+    case OpCode::kDiv:
+      return {T(1) / b, -value / b};
+    case OpCode::kNeg:
+      return {T(-1), T(0)};
+    case OpCode::kPow: {
+      const std::int64_t n = pow_exponent(instr);
+      return {n == 0 ? T(0) : T(n) * ipow(a, n - 1), T(0)};
+    }
+    case OpCode::kExp:
+      return {value, T(0)};
+    case OpCode::kLog:
+      return {T(1) / a, T(0)};
+    case OpCode::kConst:
+    case OpCode::kVar:
+      break;
+  }
+  return {T(0), T(0)};
+}
+
+/// The value of the second operand of the operation `instr`, given the
+/// `values` of all earlier instructions of its tape, or zero if it is unary
+/// (the `op2` of unary operations is not an instruction).
+template <typename T>
+T operand2(const Instruction& instr, const std::vector<T>& values) noexcept {
+  return n_operands(instr.opcode) == 2 ? values[instr.op2] : T(0);
+}
+
+/// op_partials() of the operation `instr` at index `i` of a tape, given the
+/// `values` of its instructions up to `i` included.
+template <typename T>
+std::pair<T, T> instr_partials(const Instruction& instr, std::size_t i,
+                               const std::vector<T>& values) noexcept {
+  return op_partials(instr, values[instr.op1], operand2(instr, values),
+                     values[i]);
+}
+
+/// The second derivatives of an operation w.r.t. its operands a and b.
+template <typename T>
+struct OpSecondPartials {
+  T aa = T(0);
+  T ab = T(0);
+  T bb = T(0);
+};
+
+/// The second derivatives of the operation `instr`, with the same arguments
+/// as op_partials(). Those that involve `b` are zero for unary operations.
+template <typename T>
+OpSecondPartials<T> op_second_partials(const Instruction& instr, T a, T b,
+                                       T value) noexcept {
+  OpSecondPartials<T> d2;
+  switch (instr.opcode) {
+    case OpCode::kMul:
+      d2.ab = T(1);
+      break;
+    case OpCode::kDiv:
+      d2.ab = T(-1) / (b * b);
+      d2.bb = T(2) * value / (b * b);
+      break;
+    case OpCode::kPow: {
+      const std::int64_t n = pow_exponent(instr);
+      if (n != 0 && n != 1) d2.aa = T(n * (n - 1)) * ipow(a, n - 2);
+      break;
+    }
+    case OpCode::kExp:
+      d2.aa = value;
+      break;
+    case OpCode::kLog:
+      d2.aa = T(-1) / (a * a);
+      break;
+    default:  // linear
+      break;
+  }
+  return d2;
+}
+
+/// op_second_partials() of the operation `instr` at index `i` of a tape, with
+/// the same arguments as instr_partials().
+template <typename T>
+OpSecondPartials<T> instr_second_partials(
+    const Instruction& instr, std::size_t i,
+    const std::vector<T>& values) noexcept {
+  return op_second_partials(instr, values[instr.op1], operand2(instr, values),
+                            values[i]);
+}
+
+}  // namespace graph_autodiff
@@ -0,0 +1,464 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "tensor.h"
+
+#include <algorithm>  // std::sort
+#include <cassert>
+#include <optional>
+#include <utility>  // std::move
+
+#include "fmt/core.h"
+#include "graph_autodiff/fail.h"
+#include "graph_autodiff/var_id.h"
+
+using namespace graph_autodiff;
+
+/// A node of a tensor graph. Nodes are immutable and shared between graphs.
+class graph_autodiff::TensorNode {
+ public:
+  TensorOpCode opcode;
+  Eigen::Index rows;
+  Eigen::Index cols;
+  /// The operands of the operation, if any.
+  std::shared_ptr<const TensorNode> op1;
+  std::shared_ptr<const TensorNode> op2;
+  /// The variable loaded by a kVar node.
+  std::optional<VarId> var;
+  /// The value of a kConst node.
+  Eigen::MatrixXf value;
+};
+
+namespace {
+std::shared_ptr<const TensorNode> make_node(
+    TensorOpCode opcode, Eigen::Index rows, Eigen::Index cols,
+    std::shared_ptr<const TensorNode> op1 = nullptr,
+    std::shared_ptr<const TensorNode> op2 = nullptr) {
+  auto node = std::make_shared<TensorNode>();
+  node->opcode = opcode;
+  node->rows = rows;
+  node->cols = cols;
+  node->op1 = std::move(op1);
+  node->op2 = std::move(op2);
+  return node;
+}
+
+bool is_scalar(Eigen::Index rows, Eigen::Index cols) {
+  return rows == 1 && cols == 1;
+}
+
+// The shape of an elementwise operation between tensors of the given shapes.
+std::pair<Eigen::Index, Eigen::Index> broadcast_shape(const Tensor& t1,
+                                                      const Tensor& t2) {
+  if (is_scalar(t1.rows(), t1.cols())) return {t2.rows(), t2.cols()};
+  if (is_scalar(t2.rows(), t2.cols())) return {t1.rows(), t1.cols()};
+  if (t1.rows() != t2.rows() || t1.cols() != t2.cols())
+    fail(fmt::format("cannot combine tensors of shapes {}x{} and {}x{}",
+                     t1.rows(), t1.cols(), t2.rows(), t2.cols()));
+  return {t1.rows(), t1.cols()};
+}
+
+// Add the adjoint contribution `c`, which has the shape of the result of an
+// elementwise operation, to the adjoint of one of its operands: operands that
+// were broadcast receive the sum of the contributions.
+template <typename Contribution>
+void accumulate(Eigen::MatrixXf& adjoint, const Contribution& c) {
+  if (adjoint.size() == 1 && c.size() != 1)
+    adjoint(0, 0) += c.sum();
+  else
+    adjoint += c;
+}
+
+// Same as accumulate(), for the contribution `result_adjoint` ∘ `other` of an
+// elementwise product, where `other` is the other operand.
+void accumulate_product(Eigen::MatrixXf& adjoint,
+                        const Eigen::MatrixXf& result_adjoint,
+                        const Eigen::MatrixXf& other) {
+  if (other.size() == 1)
+    accumulate(adjoint, result_adjoint * other(0, 0));
+  else
+    accumulate(adjoint, result_adjoint.cwiseProduct(other));
+}
+}  // end of anonymous namespace
+
+Tensor::Tensor(std::shared_ptr<const TensorNode> node_)
+    : node(std::move(node_)) {
+  assert(node);
+}
+
+Eigen::Index Tensor::rows() const noexcept { return node->rows; }
+
+Eigen::Index Tensor::cols() const noexcept { return node->cols; }
+
+Tensor graph_autodiff::operator+(const Tensor& t1, const Tensor& t2) {
+  const auto [rows, cols] = broadcast_shape(t1, t2);
+  return Tensor(make_node(TensorOpCode::kSum, rows, cols, t1.node, t2.node));
+}
+
+Tensor graph_autodiff::operator*(const Tensor& t1, const Tensor& t2) {
+  const auto [rows, cols] = broadcast_shape(t1, t2);
+  return Tensor(
+      make_node(TensorOpCode::kProduct, rows, cols, t1.node, t2.node));
+}
+
+Tensor graph_autodiff::matmul(const Tensor& t1, const Tensor& t2) {
+  if (t1.cols() != t2.rows())
+    fail(fmt::format("cannot multiply matrices of shapes {}x{} and {}x{}",
+                     t1.rows(), t1.cols(), t2.rows(), t2.cols()));
+  return Tensor(make_node(TensorOpCode::kMatMul, t1.rows(), t2.cols(),
+                          t1.node, t2.node));
+}
+
+Tensor graph_autodiff::transpose(const Tensor& t) {
+  return Tensor(
+      make_node(TensorOpCode::kTranspose, t.cols(), t.rows(), t.node));
+}
+
+Tensor graph_autodiff::sum(const Tensor& t) {
+  return Tensor(make_node(TensorOpCode::kReduceSum, 1, 1, t.node));
+}
+
+TensorVar::TensorVar(std::string_view name, Eigen::Index rows,
+                     Eigen::Index cols)
+    : Tensor([&] {
+        if (rows <= 0 || cols <= 0)
+          fail(fmt::format("tensor variable '{}' has invalid shape {}x{}",
+                           name, rows, cols));
+        auto node = std::make_shared<TensorNode>();
+        node->opcode = TensorOpCode::kVar;
+        node->rows = rows;
+        node->cols = cols;
+        node->var = VarId(name);
+        return node;
+      }()) {}
+
+TensorConst::TensorConst(Eigen::MatrixXf value)
+    : Tensor([&] {
+        if (value.size() == 0) fail("tensor constants cannot be empty");
+        auto node = std::make_shared<TensorNode>();
+        node->opcode = TensorOpCode::kConst;
+        node->rows = value.rows();
+        node->cols = value.cols();
+        node->value = std::move(value);
+        return node;
+      }()) {}
+
+TensorConst::TensorConst(float value)
+    : TensorConst(Eigen::MatrixXf::Constant(1, 1, value)) {}
+
+CompiledTensorGraph Tensor::compile() const {
+  std::vector<TensorInstruction> tape;
+  std::vector<Eigen::MatrixXf> constants;
+  absl::flat_hash_map<const TensorNode*, std::uint32_t> lowered;
+  // variables in order of first use: kVar operands are indices into these
+  // until they are sorted alphabetically at the end
+  std::vector<const TensorNode*> vars;
+  absl::flat_hash_map<VarId, std::uint32_t> var_idxs;
+
+  // iterative post-order traversal, so that deep graphs do not overflow the
+  // stack: a node is lowered once all of its operands have been
+  std::vector<const TensorNode*> stack = {node.get()};
+  while (!stack.empty()) {
+    const TensorNode* n = stack.back();
+    if (lowered.contains(n)) {
+      stack.pop_back();
+      continue;
+    }
+    bool ready = true;
+    for (const TensorNode* operand : {n->op1.get(), n->op2.get()}) {
+      if (operand != nullptr && !lowered.contains(operand)) {
+        stack.push_back(operand);
+        ready = false;
+      }
+    }
+    if (!ready) continue;
+    stack.pop_back();
+
+    TensorInstruction instr{n->opcode, 0, 0, n->rows, n->cols};
+    switch (n->opcode) {
+      case TensorOpCode::kConst:
+        instr.op1 = constants.size();
+        constants.push_back(n->value);
+        break;
+      case TensorOpCode::kVar: {
+        const auto [it, inserted] = var_idxs.emplace(*n->var, vars.size());
+        if (inserted) {
+          vars.push_back(n);
+        } else if (vars[it->second]->rows != n->rows ||
+                   vars[it->second]->cols != n->cols) {
+          fail(fmt::format("tensor variable '{}' is used with shapes {}x{} "
+                           "and {}x{}",
+                           n->var->name(), vars[it->second]->rows,
+                           vars[it->second]->cols, n->rows, n->cols));
+        } else {
+          // another node for the same variable: reuse its instruction
+          const std::uint32_t instr_idx = lowered.at(vars[it->second]);
+          lowered.emplace(n, instr_idx);
+          continue;
+        }
+        instr.op1 = it->second;
+        break;
+      }
+      default:
+        instr.op1 = lowered.at(n->op1.get());
+        if (n->op2) instr.op2 = lowered.at(n->op2.get());
+    }
+    lowered.emplace(n, tape.size());
+    tape.push_back(instr);
+  }
+
+  std::vector<std::uint32_t> order(vars.size());
+  for (std::uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+    return vars[a]->var->name() < vars[b]->var->name();
+  });
+  std::vector<std::uint32_t> slots(vars.size());
+  std::vector<std::string> names;
+  std::vector<std::pair<Eigen::Index, Eigen::Index>> shapes;
+  for (std::uint32_t slot = 0; slot < order.size(); ++slot) {
+    const TensorNode* var = vars[order[slot]];
+    slots[order[slot]] = slot;
+    names.emplace_back(var->var->name());
+    shapes.emplace_back(var->rows, var->cols);
+  }
+  for (TensorInstruction& instr : tape)
+    if (instr.opcode == TensorOpCode::kVar) instr.op1 = slots[instr.op1];
+
+  return CompiledTensorGraph(std::move(tape), std::move(constants),
+                             VariableLayout(std::move(names)),
+                             std::move(shapes));
+}
+
+Eigen::MatrixXf Tensor::eval(const TensorInputs& inputs) const {
+  return compile().eval(inputs);
+}
+
+std::pair<float, std::vector<Eigen::MatrixXf>> Tensor::eval_grad(
+    const TensorInputs& inputs) const {
+  if (!is_scalar(rows(), cols()))
+    fail(fmt::format("cannot differentiate a tensor of shape {}x{}: the "
+                     "graph must be 1x1",
+                     rows(), cols()));
+  return compile().eval_grad(inputs);
+}
+
+CompiledTensorGraph::CompiledTensorGraph(
+    std::vector<TensorInstruction> tape_,
+    std::vector<Eigen::MatrixXf> constants_, VariableLayout layout,
+    std::vector<std::pair<Eigen::Index, Eigen::Index>> var_shapes_)
+    : tape(std::move(tape_)),
+      constants(std::move(constants_)),
+      var_shapes(std::move(var_shapes_)),
+      depends(tape.size()),
+      var_layout(std::move(layout)) {
+  assert(!tape.empty());
+  assert(var_shapes.size() == var_layout.size());
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const TensorInstruction& instr = tape[i];
+    switch (instr.opcode) {
+      case TensorOpCode::kConst:
+        break;
+      case TensorOpCode::kVar:
+        depends[i] = true;
+        break;
+      case TensorOpCode::kSum:
+      case TensorOpCode::kProduct:
+      case TensorOpCode::kMatMul:
+        depends[i] = depends[instr.op1] || depends[instr.op2];
+        break;
+      case TensorOpCode::kTranspose:
+      case TensorOpCode::kReduceSum:
+        depends[i] = depends[instr.op1];
+        break;
+    }
+  }
+}
+
+std::vector<Eigen::MatrixXf> CompiledTensorGraph::bind(
+    const TensorInputs& inputs) const {
+  std::vector<Eigen::MatrixXf> values;
+  values.reserve(var_layout.size());
+  for (std::size_t slot = 0; slot < var_layout.size(); ++slot) {
+    const auto it = inputs.find(var_layout.names()[slot]);
+    if (it == inputs.end()) {
+      fail(fmt::format("no value was provided for tensor variable '{}'",
+                       var_layout.names()[slot]));
+    }
+    const auto [rows, cols] = var_shapes[slot];
+    if (it->second.rows() != rows || it->second.cols() != cols) {
+      fail(fmt::format("tensor variable '{}' has shape {}x{}, but a value of "
+                       "shape {}x{} was provided",
+                       var_layout.names()[slot], rows, cols,
+                       it->second.rows(), it->second.cols()));
+    }
+    values.push_back(it->second);
+  }
+  return values;
+}
+
+const Eigen::MatrixXf& CompiledTensorGraph::value(
+    std::size_t i, absl::Span<const Eigen::MatrixXf> inputs,
+    const TensorEvalContext& ctx) const noexcept {
+  switch (tape[i].opcode) {
+    case TensorOpCode::kConst:
+      return constants[tape[i].op1];
+    case TensorOpCode::kVar:
+      return inputs[tape[i].op1];
+    default:
+      return ctx.values[i];
+  }
+}
+
+void CompiledTensorGraph::eval_values(absl::Span<const Eigen::MatrixXf> inputs,
+                                      TensorEvalContext& ctx) const noexcept {
+  assert(inputs.size() == var_layout.size());
+  ctx.values.resize(tape.size());
+  for (std::size_t i = 0; i < tape.size(); ++i) {
+    const TensorInstruction& instr = tape[i];
+    Eigen::MatrixXf& out = ctx.values[i];
+    switch (instr.opcode) {
+      case TensorOpCode::kConst:
+      case TensorOpCode::kVar:
+        break;
+      case TensorOpCode::kSum: {
+        const Eigen::MatrixXf& a = value(instr.op1, inputs, ctx);
+        const Eigen::MatrixXf& b = value(instr.op2, inputs, ctx);
+        if (a.size() == 1 && b.size() != 1)
+          out = b.array() + a(0, 0);
+        else if (b.size() == 1 && a.size() != 1)
+          out = a.array() + b(0, 0);
+        else
+          out = a + b;
+        break;
+      }
+      case TensorOpCode::kProduct: {
+        const Eigen::MatrixXf& a = value(instr.op1, inputs, ctx);
+        const Eigen::MatrixXf& b = value(instr.op2, inputs, ctx);
+        if (a.size() == 1 && b.size() != 1)
+          out = b * a(0, 0);
+        else if (b.size() == 1 && a.size() != 1)
+          out = a * b(0, 0);
+        else
+          out = a.cwiseProduct(b);
+        break;
+      }
+      case TensorOpCode::kMatMul:
+        out.noalias() =
+            value(instr.op1, inputs, ctx) * value(instr.op2, inputs, ctx);
+        break;
+      case TensorOpCode::kTranspose:
+        out = value(instr.op1, inputs, ctx).transpose();
+        break;
+      case TensorOpCode::kReduceSum:
+        out.resize(1, 1);
+        out(0, 0) = value(instr.op1, inputs, ctx).sum();
+        break;
+    }
+  }
+}
+
+Eigen::MatrixXf CompiledTensorGraph::eval(const TensorInputs& inputs) const {
+  TensorEvalContext ctx;
+  return eval(bind(inputs), ctx);
+}
+
+const Eigen::MatrixXf& CompiledTensorGraph::eval(
+    absl::Span<const Eigen::MatrixXf> inputs,
+    TensorEvalContext& ctx) const noexcept {
+  eval_values(inputs, ctx);
+  return value(tape.size() - 1, inputs, ctx);
+}
+
+std::pair<float, std::vector<Eigen::MatrixXf>> CompiledTensorGraph::eval_grad(
+    const TensorInputs& inputs) const {
+  if (!is_scalar(tape.back().rows, tape.back().cols))
+    fail(fmt::format("cannot differentiate a tensor of shape {}x{}: the "
+                     "graph must be 1x1",
+                     tape.back().rows, tape.back().cols));
+
+  // one gradient per input, in alphabetical order
+  std::vector<std::string> input_names;
+  input_names.reserve(inputs.size());
+  for (const auto& [name, _] : inputs) input_names.push_back(name);
+  std::sort(input_names.begin(), input_names.end());
+
+  std::vector<Eigen::MatrixXf> var_grads(var_layout.size());
+  for (std::size_t slot = 0; slot < var_layout.size(); ++slot)
+    var_grads[slot].resize(var_shapes[slot].first, var_shapes[slot].second);
+  TensorEvalContext ctx;
+  const float value = eval_grad(bind(inputs), absl::MakeSpan(var_grads), ctx);
+
+  std::vector<Eigen::MatrixXf> grads;
+  grads.reserve(input_names.size());
+  for (const std::string& name : input_names) {
+    const std::optional<std::size_t> slot = var_layout.slot(name);
+    if (slot) {
+      grads.push_back(std::move(var_grads[*slot]));
+    } else {
+      const Eigen::MatrixXf& input = inputs.at(name);
+      grads.push_back(Eigen::MatrixXf::Zero(input.rows(), input.cols()));
+    }
+  }
+  return {value, std::move(grads)};
+}
+
+float CompiledTensorGraph::eval_grad(absl::Span<const Eigen::MatrixXf> inputs,
+                                     absl::Span<Eigen::MatrixXf> grads_out,
+                                     TensorEvalContext& ctx) const noexcept {
+  assert(tape.back().rows == 1 && tape.back().cols == 1);
+  assert(grads_out.size() == var_layout.size());
+  eval_values(inputs, ctx);
+
+  std::vector<Eigen::MatrixXf>& adjoints = ctx.adjoints;
+  adjoints.resize(tape.size());
+  for (std::size_t i = 0; i < tape.size(); ++i)
+    if (depends[i]) adjoints[i].setZero(tape[i].rows, tape[i].cols);
+  adjoints.back().setOnes(1, 1);
+
+  // reverse pass: each instruction adds the adjoint of its result times its
+  // local derivative to the adjoints of the operands that depend on variables
+  for (std::size_t i = tape.size(); i-- > 0;) {
+    if (!depends[i]) continue;
+    const TensorInstruction& instr = tape[i];
+    const Eigen::MatrixXf& adj = adjoints[i];
+    switch (instr.opcode) {
+      case TensorOpCode::kConst:
+        break;
+      case TensorOpCode::kVar:
+        grads_out[instr.op1] = adj;
+        break;
+      case TensorOpCode::kSum:
+        if (depends[instr.op1]) accumulate(adjoints[instr.op1], adj);
+        if (depends[instr.op2]) accumulate(adjoints[instr.op2], adj);
+        break;
+      case TensorOpCode::kProduct:
+        if (depends[instr.op1])
+          accumulate_product(adjoints[instr.op1], adj,
+                             value(instr.op2, inputs, ctx));
+        if (depends[instr.op2])
+          accumulate_product(adjoints[instr.op2], adj,
+                             value(instr.op1, inputs, ctx));
+        break;
+      case TensorOpCode::kMatMul:
+        // C = AB: dA = dC Bᵀ, dB = Aᵀ dC
+        if (depends[instr.op1])
+          adjoints[instr.op1].noalias() +=
+              adj * value(instr.op2, inputs, ctx).transpose();
+        if (depends[instr.op2])
+          adjoints[instr.op2].noalias() +=
+              value(instr.op1, inputs, ctx).transpose() * adj;
+        break;
+      case TensorOpCode::kTranspose:
+        adjoints[instr.op1] += adj.transpose();
+        break;
+      case TensorOpCode::kReduceSum:
+        adjoints[instr.op1].array() += adj(0, 0);
+        break;
+    }
+  }
+
+  return value(tape.size() - 1, inputs, ctx)(0, 0);
+}
@@ -0,0 +1,208 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <cstddef>  // std::size_t
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>  // std::pair
+#include <vector>
+
+#include "Eigen/Core"
+#include "absl/container/flat_hash_map.h"
+#include "absl/types/span.h"
+#include "graph_autodiff/compiled_graph.h"
+
+namespace graph_autodiff {
+
+/// Inputs to a tensor graph's eval function: a mapping from variable name to
+/// value. Each value must have the shape the variable was declared with.
+using TensorInputs = absl::flat_hash_map<std::string, Eigen::MatrixXf>;
+
+/// The kind of operation performed by a TensorInstruction.
+enum class TensorOpCode : std::uint8_t {
+  kConst,      // the constant at index `op1` in the constant table
+  kVar,        // the variable at index `op1` in the variable table
+  kSum,        // the elementwise sum of the results of `op1` and `op2`
+  kProduct,    // the elementwise product of the results of `op1` and `op2`
+  kMatMul,     // the matrix product of the results of `op1` and `op2`
+  kTranspose,  // the transpose of the result of `op1`
+  kReduceSum,  // the sum of all elements of the result of `op1`, as a 1x1
+};
+
+/// A single step of a CompiledTensorGraph, with the shape of its result.
+/// Operands always refer to earlier instructions. The operands of kSum and
+/// kProduct have the same shape, or one of them is 1x1 and is broadcast.
+struct TensorInstruction {
+  TensorOpCode opcode;
+  std::uint32_t op1;
+  std::uint32_t op2;
+  Eigen::Index rows;
+  Eigen::Index cols;
+};
+
+class TensorNode;  // defined in tensor.cpp
+class CompiledTensorGraph;
+
+/// A compute graph whose nodes are matrices: vectors are matrices with one
+/// column and scalars are 1x1 matrices.
+/// Each node is a whole matrix operation (e.g. a matrix product) that is
+/// evaluated and differentiated with Eigen's kernels, rather than one scalar
+/// node per element as with Graph. Shapes are checked when graphs are built
+/// and when they are evaluated: a mismatch is reported on stderr and aborts
+/// the program.
+/// Tensors are built from TensorVar and TensorConst and combined with:
+/// - `a + b`, `a * b`: elementwise sum and product. Either operand can be a
+///   1x1 tensor, which is then broadcast to the shape of the other.
+/// - matmul(a, b): the matrix product.
+/// - transpose(a)
+/// - sum(a): the sum of all elements, as a 1x1 tensor.
+class Tensor {
+  std::shared_ptr<const TensorNode> node;
+
+ protected:
+  explicit Tensor(std::shared_ptr<const TensorNode> node);
+
+ public:
+  Eigen::Index rows() const noexcept;
+  Eigen::Index cols() const noexcept;
+
+  friend Tensor operator+(const Tensor& t1, const Tensor& t2);
+  friend Tensor operator*(const Tensor& t1, const Tensor& t2);
+  friend Tensor matmul(const Tensor& t1, const Tensor& t2);
+  friend Tensor transpose(const Tensor& t);
+  friend Tensor sum(const Tensor& t);
+
+  /// Lower the graph to a flat instruction tape, in which nodes shared by
+  /// several operations appear once. Callers that evaluate the same graph
+  /// repeatedly should compile it once and reuse the result.
+  CompiledTensorGraph compile() const;
+
+  /// Evaluate the graph at the given point.
+  Eigen::MatrixXf eval(const TensorInputs& inputs) const;
+
+  /// Evaluate the graph and its gradient at the given point. The graph must
+  /// be 1x1, which is checked. The gradient has one element per input, in
+  /// alphabetical order, with the same shape as the input.
+  std::pair<float, std::vector<Eigen::MatrixXf>> eval_grad(
+      const TensorInputs& inputs) const;
+};
+
+Tensor operator+(const Tensor& t1, const Tensor& t2);
+Tensor operator*(const Tensor& t1, const Tensor& t2);
+Tensor matmul(const Tensor& t1, const Tensor& t2);
+Tensor transpose(const Tensor& t);
+Tensor sum(const Tensor& t);
+
+/// A matrix-valued variable with a fixed shape.
+class TensorVar : public Tensor {
+ public:
+  TensorVar(std::string_view name, Eigen::Index rows, Eigen::Index cols);
+};
+
+/// A matrix-valued constant.
+class TensorConst : public Tensor {
+ public:
+  explicit TensorConst(Eigen::MatrixXf value);
+  /// A 1x1 constant, e.g. to scale a tensor with `TensorConst(2.f) * t`.
+  explicit TensorConst(float value);
+};
+
+/// Scratch buffers for the evaluation of CompiledTensorGraphs.
+/// Once a context has been used with a graph, further evaluations of that
+/// graph through it reuse its buffers for all values and adjoints. Matrix
+/// products also need a workspace, which Eigen takes from the stack for
+/// small products but allocates for large ones, whose packed operands
+/// exceed EIGEN_STACK_ALLOCATION_LIMIT (128 kB by default): evaluations of
+/// graphs with e.g. 8x8 products perform no heap allocations, those with
+/// 512x512 products do. A context must not be used by several evaluations
+/// at the same time.
+class TensorEvalContext {
+  friend class CompiledTensorGraph;
+
+  std::vector<Eigen::MatrixXf> values;
+  std::vector<Eigen::MatrixXf> adjoints;
+};
+
+/// A tensor graph lowered to a flat, topologically-sorted instruction tape.
+/// The last instruction is the result. Gradients are computed in reverse
+/// mode, one matrix operation per instruction.
+class CompiledTensorGraph {
+  std::vector<TensorInstruction> tape;
+  std::vector<Eigen::MatrixXf> constants;
+  /// The shape of each variable, in layout order.
+  std::vector<std::pair<Eigen::Index, Eigen::Index>> var_shapes;
+  /// For each instruction, whether it depends on any variable: adjoints are
+  /// only propagated through those that do.
+  std::vector<bool> depends;
+  /// The variables used in the graph. The operand of a kVar instruction is
+  /// the variable's slot in this layout.
+  VariableLayout var_layout;
+
+  /// Bind `inputs` to the graph's variables, checking their shapes.
+  std::vector<Eigen::MatrixXf> bind(const TensorInputs& inputs) const;
+
+  /// The value of instruction `i`: variables and constants are read from
+  /// `inputs` and the constant table rather than copied into `ctx`.
+  const Eigen::MatrixXf& value(std::size_t i,
+                               absl::Span<const Eigen::MatrixXf> inputs,
+                               const TensorEvalContext& ctx) const noexcept;
+
+  void eval_values(absl::Span<const Eigen::MatrixXf> inputs,
+                   TensorEvalContext& ctx) const noexcept;
+
+ public:
+  /// Build a CompiledTensorGraph from its tape, constant table and
+  /// variables. The tape must be non-empty, topologically sorted and
+  /// consistent with the shapes of the constants and variables.
+  CompiledTensorGraph(
+      std::vector<TensorInstruction> tape,
+      std::vector<Eigen::MatrixXf> constants, VariableLayout layout,
+      std::vector<std::pair<Eigen::Index, Eigen::Index>> var_shapes);
+
+  /// Evaluate the graph at the given point.
+  Eigen::MatrixXf eval(const TensorInputs& inputs) const;
+
+  /// Evaluate the graph at the given point, passed as one value per variable
+  /// in the order given by layout(). Returns a view of the result, which is
+  /// valid until `ctx` is used again.
+  const Eigen::MatrixXf& eval(absl::Span<const Eigen::MatrixXf> inputs,
+                              TensorEvalContext& ctx) const noexcept;
+
+  /// Evaluate the graph and its gradient at the given point. See
+  /// Tensor::eval_grad() for the layout of the gradient.
+  std::pair<float, std::vector<Eigen::MatrixXf>> eval_grad(
+      const TensorInputs& inputs) const;
+
+  /// Evaluate the graph and its gradient at the given point, passed as one
+  /// value per variable in the order given by layout(). The derivatives
+  /// w.r.t. each variable are written into the element of `grads_out` with
+  /// the same index, which must have the shape of the variable. The graph
+  /// must be 1x1. Returns the graph's value.
+  float eval_grad(absl::Span<const Eigen::MatrixXf> inputs,
+                  absl::Span<Eigen::MatrixXf> grads_out,
+                  TensorEvalContext& ctx) const noexcept;
+
+  absl::Span<const TensorInstruction> instructions() const noexcept {
+    return tape;
+  }
+
+  /// The variables used in the graph and their slots in dense inputs and
+  /// gradients.
+  const VariableLayout& layout() const noexcept { return var_layout; }
+
+  /// The shape of the variable in slot `slot` of layout().
+  std::pair<Eigen::Index, Eigen::Index> var_shape(
+      std::size_t slot) const noexcept {
+    return var_shapes[slot];
+  }
+};
+
+}  // namespace graph_autodiff
@@ -0,0 +1,154 @@
+#include "graph_autodiff/tensor.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <utility>  // std::make_pair
+#include <vector>
+
+using namespace graph_autodiff;
+
+// allocations are caught with Eigen's runtime checks, see the
+// graph_autodiff_malloc_checks target
+#ifndef EIGEN_RUNTIME_NO_MALLOC
+#error "tensor_test requires EIGEN_RUNTIME_NO_MALLOC"
+#endif
+
+void expect_matrix_near(const Eigen::MatrixXf& actual,
+                        const Eigen::MatrixXf& expected) {
+  ASSERT_EQ(actual.rows(), expected.rows());
+  ASSERT_EQ(actual.cols(), expected.cols());
+  for (Eigen::Index r = 0; r < expected.rows(); ++r)
+    for (Eigen::Index c = 0; c < expected.cols(); ++c)
+      EXPECT_NEAR(actual(r, c), expected(r, c), 1e-4)
+          << "element (" << r << ", " << c << ")";
+}
+
+TEST(Tensor, LinearLayer) {
+  const TensorVar w{"w", 4, 3};
+  const TensorVar x{"x", 3, 1};
+  const TensorVar b{"b", 4, 1};
+  const Tensor h = matmul(w, x) + b;
+  const Tensor loss = sum(h * h);
+  EXPECT_EQ(loss.rows(), 1);
+  EXPECT_EQ(loss.cols(), 1);
+
+  const TensorInputs inputs = {{"w", Eigen::MatrixXf::Random(4, 3)},
+                               {"x", Eigen::MatrixXf::Random(3, 1)},
+                               {"b", Eigen::MatrixXf::Random(4, 1)},
+                               {"u", Eigen::MatrixXf::Random(2, 2)}};
+  const Eigen::MatrixXf& W = inputs.at("w");
+  const Eigen::MatrixXf& X = inputs.at("x");
+  const Eigen::MatrixXf H = W * X + inputs.at("b");
+
+  expect_matrix_near(loss.eval(inputs), H.transpose() * H);
+
+  // gradients are in alphabetical order of the inputs: b, u, w, x
+  const auto& [value, grads] = loss.eval_grad(inputs);
+  EXPECT_NEAR(value, H.squaredNorm(), 1e-4);
+  ASSERT_EQ(grads.size(), 4);
+  expect_matrix_near(grads[0], 2 * H);
+  expect_matrix_near(grads[1], Eigen::MatrixXf::Zero(2, 2));
+  expect_matrix_near(grads[2], 2 * H * X.transpose());
+  expect_matrix_near(grads[3], 2 * W.transpose() * H);
+
+  // dense inputs and gradients, in layout order, through a reused context
+  const CompiledTensorGraph cg = loss.compile();
+  ASSERT_EQ(cg.layout().names(), (std::vector<std::string>{"b", "w", "x"}));
+  const std::vector<Eigen::MatrixXf> dense = {inputs.at("b"), W, X};
+  std::vector<Eigen::MatrixXf> dense_grads(3);
+  TensorEvalContext ctx;
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_NEAR(cg.eval_grad(dense, absl::MakeSpan(dense_grads), ctx),
+                H.squaredNorm(), 1e-4);
+    expect_matrix_near(dense_grads[0], grads[0]);
+    expect_matrix_near(dense_grads[1], grads[2]);
+    expect_matrix_near(dense_grads[2], grads[3]);
+  }
+  expect_matrix_near(cg.eval(dense, ctx), H.transpose() * H);
+}
+
+TEST(Tensor, BroadcastAndTranspose) {
+  const TensorVar a{"a", 2, 3};
+  const TensorVar b{"b", 3, 2};
+  const TensorVar s{"s", 1, 1};
+  const Tensor g =
+      sum(TensorConst(2.f) * transpose(a) * b) + sum(s * a) + TensorConst(1.f);
+
+  const TensorInputs inputs = {{"a", Eigen::MatrixXf::Random(2, 3)},
+                               {"b", Eigen::MatrixXf::Random(3, 2)},
+                               {"s", Eigen::MatrixXf::Constant(1, 1, 3.f)}};
+  const Eigen::MatrixXf& A = inputs.at("a");
+  const Eigen::MatrixXf& B = inputs.at("b");
+
+  // g = 2 sum(Aᵀ ∘ B) + s sum(A) + 1
+  const float expected = 2 * A.transpose().cwiseProduct(B).sum() +
+                         3 * A.sum() + 1;
+  const auto& [value, grads] = g.eval_grad(inputs);
+  EXPECT_NEAR(value, expected, 1e-4);
+  ASSERT_EQ(grads.size(), 3);
+  expect_matrix_near(grads[0], 2 * B.transpose() +
+                                   Eigen::MatrixXf::Constant(2, 3, 3.f));
+  expect_matrix_near(grads[1], 2 * A.transpose());
+  expect_matrix_near(grads[2], Eigen::MatrixXf::Constant(1, 1, A.sum()));
+}
+
+TEST(Tensor, SharedNodesAreLoweredOnce) {
+  const TensorVar w{"w", 512, 512};
+  const TensorVar x{"x", 512, 1};
+  const Tensor h = matmul(w, x);
+  // a 512x512 matrix product is one instruction, not 512^2 scalar nodes
+  const CompiledTensorGraph cg = sum(h * h + TensorVar("x", 512, 1)).compile();
+  // w, x, matmul, product, sum, reduction: the second `x` reuses the first
+  EXPECT_EQ(cg.instructions().size(), 6);
+  EXPECT_EQ(cg.layout().size(), 2);
+  EXPECT_EQ(cg.var_shape(0),
+            std::make_pair(Eigen::Index{512}, Eigen::Index{512}));
+}
+
+TEST(Tensor, ReusedContextDoesNotAllocate) {
+  // products this small get their workspace from the stack, see
+  // TensorEvalContext
+  const TensorVar w{"w", 8, 8};
+  const TensorVar x{"x", 8, 8};
+  const Tensor h = matmul(w, x);
+  const CompiledTensorGraph cg = sum(matmul(transpose(h), h)).compile();
+  const std::vector<Eigen::MatrixXf> inputs = {Eigen::MatrixXf::Random(8, 8),
+                                               Eigen::MatrixXf::Random(8, 8)};
+  std::vector<Eigen::MatrixXf> grads(2, Eigen::MatrixXf::Zero(8, 8));
+  TensorEvalContext ctx;
+
+  // the first evaluation sizes the buffers in ctx...
+  const float value = cg.eval_grad(inputs, absl::MakeSpan(grads), ctx);
+  const std::vector<Eigen::MatrixXf> expected_grads = grads;
+
+  // ...then Eigen, which asserts if it allocates, should not allocate again
+  Eigen::internal::set_is_malloc_allowed(false);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_FLOAT_EQ(cg.eval_grad(inputs, absl::MakeSpan(grads), ctx), value);
+    EXPECT_FLOAT_EQ(cg.eval(inputs, ctx)(0, 0), value);
+  }
+  Eigen::internal::set_is_malloc_allowed(true);
+  expect_matrix_near(grads[0], expected_grads[0]);
+  expect_matrix_near(grads[1], expected_grads[1]);
+}
+
+TEST(TensorDeathTest, ShapeErrors) {
+  const TensorVar w{"w", 2, 3};
+  const TensorVar x{"x", 3, 1};
+  const TensorInputs inputs{{"w", Eigen::MatrixXf::Ones(2, 3)},
+                            {"x", Eigen::MatrixXf::Ones(3, 1)}};
+
+  // only 1x1 graphs can be differentiated
+  const Tensor h = matmul(w, x);
+  EXPECT_DEATH(h.eval_grad(inputs), "must be 1x1");
+  EXPECT_DEATH(h.compile().eval_grad(inputs), "must be 1x1");
+
+  EXPECT_DEATH(matmul(x, w), "cannot multiply matrices of shapes 3x1 and 2x3");
+  EXPECT_DEATH(w + x, "cannot combine tensors");
+  EXPECT_DEATH(sum(h).eval({{"w", Eigen::MatrixXf::Ones(3, 2)},
+                            {"x", Eigen::MatrixXf::Ones(3, 1)}}),
+               "'w' has shape 2x3");
+  EXPECT_DEATH(sum(h).eval({{"x", Eigen::MatrixXf::Ones(3, 1)}}),
+               "no value was provided for tensor variable 'w'");
+}
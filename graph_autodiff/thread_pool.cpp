@@ -0,0 +1,141 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "thread_pool.h"
+
+#include <algorithm>  // std::max
+#include <cassert>
+#include <utility>  // std::move
+
+using namespace graph_autodiff;
+
+namespace {
+// the pool and worker index of the current thread, if it is a pool worker
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local std::size_t current_worker_idx = 0;
+}  // end of anonymous namespace
+
+ThreadPool::ThreadPool(std::size_t n_threads) {
+  n_threads = std::max<std::size_t>(n_threads, 1);
+  queues.reserve(n_threads);
+  for (std::size_t i = 0; i < n_threads; ++i)
+    queues.push_back(std::make_unique<TaskQueue>());
+
+  workers.reserve(n_threads);
+  for (std::size_t i = 0; i < n_threads; ++i)
+    workers.emplace_back([this, i] { worker_loop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  wake_up.notify_all();
+  for (std::thread& worker : workers) worker.join();
+}
+
+std::size_t ThreadPool::current_worker() const noexcept {
+  return current_pool == this ? current_worker_idx : size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  const std::size_t worker = current_worker();
+
+  std::size_t queue_idx = worker;
+  if (worker == size()) {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    queue_idx = next_queue;
+    next_queue = (next_queue + 1) % size();
+  }
+
+  {
+    // workers pop from the front of their own queue and steal from the back
+    TaskQueue& queue = *queues[queue_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_front(std::move(task));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    ++n_queued;
+  }
+  wake_up.notify_one();
+}
+
+bool ThreadPool::run_one(std::size_t worker_idx) {
+  std::function<void()> task;
+
+  // callers from outside the pool (worker_idx == size()) only steal
+  for (std::size_t i = 0; i < size() && !task; ++i) {
+    const std::size_t queue_idx = (worker_idx + i) % size();
+    TaskQueue& queue = *queues[queue_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) continue;
+    if (queue_idx == worker_idx) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    } else {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+  }
+
+  if (!task) return false;
+
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    --n_queued;
+  }
+  task();
+  return true;
+}
+
+void ThreadPool::worker_loop(std::size_t worker_idx) {
+  current_pool = this;
+  current_worker_idx = worker_idx;
+
+  while (true) {
+    if (run_one(worker_idx)) continue;
+
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    wake_up.wait(lock, [this] { return stopping || n_queued > 0; });
+    if (stopping && n_queued == 0) return;
+  }
+}
+
+void ThreadPool::parallel_for(
+    std::size_t n,
+    const std::function<void(std::size_t worker, std::size_t i)>& fn) {
+  std::mutex done_mutex;
+  std::condition_variable done;
+  std::size_t n_remaining = n;  // guarded by done_mutex
+
+  for (std::size_t i = 0; i < n; ++i) {
+    submit([&, i] {
+      fn(current_worker(), i);
+      // notify while holding the lock: the waiting caller, and with it the
+      // mutex and condition variable, might be gone as soon as we release it
+      std::lock_guard<std::mutex> lock(done_mutex);
+      if (--n_remaining == 0) done.notify_all();
+    });
+  }
+
+  // help with the work instead of just waiting for it
+  const std::size_t worker = current_worker();
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(done_mutex);
+      if (n_remaining == 0) return;
+    }
+    if (run_one(worker)) continue;
+
+    // all remaining tasks are running on other threads
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done.wait(lock, [&] { return n_remaining == 0; });
+    return;
+  }
+}
@@ -0,0 +1,81 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>  // std::size_t
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace graph_autodiff {
+
+/// A fixed-size pool of worker threads.
+/// Each worker has its own task queue: tasks submitted from a worker go to
+/// the front of its own queue, and idle workers steal tasks from the back of
+/// the others' queues, so that load stays balanced without a central queue.
+class ThreadPool {
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<TaskQueue>> queues;
+  std::vector<std::thread> workers;
+
+  // workers sleep on `wake_up` when no tasks are queued
+  std::mutex sleep_mutex;
+  std::condition_variable wake_up;
+  std::size_t n_queued = 0;  // guarded by sleep_mutex
+  bool stopping = false;     // guarded by sleep_mutex
+
+  // round-robin target for tasks submitted from outside the pool
+  std::size_t next_queue = 0;  // guarded by sleep_mutex
+
+  void worker_loop(std::size_t worker_idx);
+
+  /// Pop a task from the queue of worker `worker_idx`, or steal one from
+  /// another worker, and run it. Returns false if there were no tasks.
+  bool run_one(std::size_t worker_idx);
+
+ public:
+  /// Start a pool with `n_threads` worker threads (at least one).
+  explicit ThreadPool(
+      std::size_t n_threads = std::thread::hardware_concurrency());
+
+  /// Run all tasks that are still queued, then join the workers.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// The number of worker threads.
+  // queues is complete before the first worker starts, workers is not
+  std::size_t size() const noexcept { return queues.size(); }
+
+  /// The index of the worker running the calling code, in [0, size()), or
+  /// size() if the caller is not one of this pool's workers.
+  std::size_t current_worker() const noexcept;
+
+  /// Schedule `task` for asynchronous execution on one of the workers.
+  void submit(std::function<void()> task);
+
+  /// Call `fn(worker, i)` for each i in [0, n), in parallel, and return when
+  /// all calls have completed. `worker` is the current_worker() executing the
+  /// call: a caller that is waiting for its tasks helps running them, so it
+  /// can be size(). Code that needs per-thread scratch space can therefore
+  /// allocate size() + 1 instances and index them with `worker`.
+  void parallel_for(
+      std::size_t n,
+      const std::function<void(std::size_t worker, std::size_t i)>& fn);
+};
+
+}  // namespace graph_autodiff
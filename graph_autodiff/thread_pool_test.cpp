@@ -0,0 +1,64 @@
+#include "graph_autodiff/thread_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstddef>  // std::size_t
+#include <vector>
+
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+TEST(ThreadPool, ParallelForRunsEachIndexOnce) {
+  ThreadPool pool(4);
+  std::vector<std::atomic<int>> counts(1000);
+  std::vector<std::atomic<int>> per_worker(pool.size() + 1);
+  pool.parallel_for(counts.size(), [&](std::size_t worker, std::size_t i) {
+    ASSERT_LE(worker, pool.size());
+    ++counts[i];
+    ++per_worker[worker];
+  });
+
+  for (const auto &c : counts) EXPECT_EQ(c, 1);
+  int total = 0;
+  for (const auto &c : per_worker) total += c;
+  EXPECT_EQ(total, 1000);
+}
+
+TEST(ThreadPool, NestedParallelFor) {
+  ThreadPool pool(2);
+  std::atomic<int> count = 0;
+  pool.parallel_for(8, [&](std::size_t, std::size_t) {
+    pool.parallel_for(8, [&](std::size_t, std::size_t) { ++count; });
+  });
+  EXPECT_EQ(count, 64);
+}
+
+TEST(ThreadPool, SubmittedTasksRunBeforeDestruction) {
+  std::atomic<int> count = 0;
+  {
+    ThreadPool pool(3);
+    for (int i = 0; i < 100; ++i) pool.submit([&] { ++count; });
+  }
+  EXPECT_EQ(count, 100);
+}
+
+TEST(ThreadPool, MultiThreadedBatchedEvaluation) {
+  const Var x{"x"};
+  const Var y{"y"};
+  const Const c{3.};
+  const Graph g = x * x * y + c * y;
+
+  const Eigen::MatrixXf inputs = Eigen::MatrixXf::Random(10000, 2);
+  const auto &[values, grads] = g.eval_grad_batch(inputs);
+
+  ThreadPool pool(4);
+  const Eigen::VectorXf mt_values = g.eval_batch(inputs, pool);
+  const auto &[mt_grad_values, mt_grads] = g.eval_grad_batch(inputs, pool);
+
+  // results are the same, bit by bit, as those of single-threaded evaluation
+  EXPECT_EQ(mt_values, values);
+  EXPECT_EQ(mt_grad_values, values);
+  EXPECT_EQ(mt_grads, grads);
+}
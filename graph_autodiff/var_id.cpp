@@ -0,0 +1,84 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+#include "var_id.h"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/numeric/bits.h"
+#include "graph_autodiff/fail.h"
+
+using namespace graph_autodiff;
+
+namespace {
+/// The process-wide table of interned names.
+/// Names are stored in segments of doubling size that are never moved or
+/// freed, so that they can be read without locking: name `id` is in segment
+/// `s = bit_width(id + 1) - 1`, at offset `id + 1 - 2^s`.
+/// A name is written before its id is handed out, and ids can only be
+/// obtained through intern() or from another VarId, so reads never race
+/// with the corresponding write.
+class SymbolTable {
+  static constexpr int kNumSegments = 32;
+
+  std::mutex mutex;
+  // keys are views into the segments
+  absl::flat_hash_map<std::string_view, std::uint32_t> ids;  // guarded by mutex
+  std::array<std::atomic<std::string*>, kNumSegments> segments{};
+
+  static int segment_of(std::uint32_t id) noexcept {
+    return absl::bit_width(std::uint64_t(id) + 1) - 1;
+  }
+
+  static std::uint64_t offset_in_segment(std::uint32_t id, int segment) {
+    return std::uint64_t(id) + 1 - (std::uint64_t(1) << segment);
+  }
+
+ public:
+  std::uint32_t intern(std::string_view name) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (auto it = ids.find(name); it != ids.end()) return it->second;
+
+    if (ids.size() == UINT32_MAX) fail("too many variable names");
+    const std::uint32_t id = ids.size();
+    const int segment = segment_of(id);
+    std::string* names = segments[segment].load(std::memory_order_relaxed);
+    if (names == nullptr) {
+      names = new std::string[std::size_t(1) << segment];
+      segments[segment].store(names, std::memory_order_release);
+    }
+    std::string& stored = names[offset_in_segment(id, segment)];
+    stored = name;
+    ids.emplace(stored, id);
+    return id;
+  }
+
+  std::string_view name(std::uint32_t id) const noexcept {
+    const int segment = segment_of(id);
+    const std::string* names =
+        segments[segment].load(std::memory_order_acquire);
+    assert(names != nullptr);
+    return names[offset_in_segment(id, segment)];
+  }
+};
+
+SymbolTable& symbol_table() {
+  // never destroyed: names must stay valid during static destruction too
+  static SymbolTable* table = new SymbolTable();
+  return *table;
+}
+}  // end of anonymous namespace
+
+VarId::VarId(std::string_view name) : id(symbol_table().intern(name)) {}
+
+std::string_view VarId::name() const noexcept {
+  return symbol_table().name(id);
+}
@@ -0,0 +1,50 @@
+/*
+cpp-graph-autodiff  Copyright (C) 2023 Enrico Guiraud
+This program comes with ABSOLUTELY NO WARRANTY.
+This is free software, and you are welcome to redistribute it
+under certain conditions: see LICENSE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <utility>  // std::move
+
+namespace graph_autodiff {
+
+/// An interned variable name.
+/// Names are stored once in a process-wide symbol table, and all VarIds with
+/// the same name have the same value, also across graphs: they are cheap to
+/// copy, compare and hash, and the name they refer to never goes away.
+/// Creating a VarId from a name takes a lock, while all other operations
+/// (including name()) are lock-free. VarIds can be used from any thread.
+class VarId {
+  std::uint32_t id;
+
+ public:
+  /// Intern `name`, if it was not interned before.
+  explicit VarId(std::string_view name);
+
+  /// The interned name. The view stays valid until the end of the program.
+  std::string_view name() const noexcept;
+
+  /// A small integer that identifies this VarId: values are assigned in
+  /// order of interning, starting from zero.
+  std::uint32_t value() const noexcept { return id; }
+
+  friend bool operator==(VarId id1, VarId id2) noexcept {
+    return id1.id == id2.id;
+  }
+
+  friend bool operator!=(VarId id1, VarId id2) noexcept {
+    return id1.id != id2.id;
+  }
+
+  template <typename H>
+  friend H AbslHashValue(H h, VarId var_id) {
+    return H::combine(std::move(h), var_id.id);
+  }
+};
+
+}  // namespace graph_autodiff
@@ -0,0 +1,52 @@
+#include "graph_autodiff/var_id.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graph_autodiff/graph.h"
+
+using namespace graph_autodiff;
+
+TEST(VarId, Interning) {
+  const VarId x1("x");
+  const VarId x2(std::string("x"));
+  const VarId y("y");
+  EXPECT_EQ(x1, x2);
+  EXPECT_NE(x1, y);
+  EXPECT_EQ(x1.value(), x2.value());
+  EXPECT_EQ(x1.name(), "x");
+  EXPECT_EQ(y.name(), "y");
+  // the interned names are shared
+  EXPECT_EQ(x1.name().data(), x2.name().data());
+}
+
+TEST(VarId, SharedAcrossGraphs) {
+  const Var x{"a_long_variable_name_that_does_not_fit_in_small_strings"};
+  const Graph g1 = x * x;
+  const Graph g2 = x + Const(1.f);
+  EXPECT_EQ(g1.layout().names(), g2.layout().names());
+  EXPECT_EQ(x.var_id(), VarId(x.name()));
+  EXPECT_LT(sizeof(Var), sizeof(Op) + sizeof(std::string));
+}
+
+TEST(VarId, ConcurrentInterning) {
+  // enough names to span several segments of the symbol table
+  constexpr int kNames = 5000;
+  constexpr int kThreads = 4;
+  std::vector<std::vector<VarId>> ids(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([t, &ids] {
+      for (int i = 0; i < kNames; ++i)
+        ids[t].emplace_back("concurrent" + std::to_string(i));
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+
+  for (int t = 1; t < kThreads; ++t) EXPECT_EQ(ids[t], ids[0]);
+  for (int i = 0; i < kNames; ++i)
+    EXPECT_EQ(ids[0][i].name(), "concurrent" + std::to_string(i));
+}